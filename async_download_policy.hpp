@@ -0,0 +1,765 @@
+/*******************************************************************************
+ * Copyright (c) 2012, Andrzej Zawadzki (azawadzki@gmail.com)
+ *
+ * soakfs is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * soakfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with soakfs; if not, see <http ://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#ifndef SOAKFS_ASYNC_DOWNLOAD_POLICY_HPP
+#define SOAKFS_ASYNC_DOWNLOAD_POLICY_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#include "event_loop.hpp"
+#include "http_client.hpp"
+#include "inflate_sink.hpp"
+#include "soakfs_api.hpp"
+
+namespace soak {
+
+// Transport running every request on a single event loop thread, over
+// non-blocking sockets and TLS. Requests are started with async_load() from
+// any thread and report back through a callback, so hedged attempts don't
+// need a thread each. Storage still waits for every request on the thread
+// which made it, as its callers are blocking fuse handlers. Keep-alive
+// connections are reused, up to `connections` at once; further requests wait
+// for a free one.
+//
+// The loop thread is started with start(). Requests made before, e.g. while
+// logging in, are run by the calling thread itself, so no thread is left
+// running when fuse daemonizes.
+class DownloadPolicyAsync {
+
+    typedef std::chrono::steady_clock clock;
+
+public:
+
+    struct Options {
+        Options()
+        : connections(8)
+        , idle_timeout(30)
+        , stripe_size(1024 * 1024)
+        , stripes(4) {
+
+        }
+
+        // timeout also closes connections which receive nothing for that
+        // long; the rest has the same meaning as for DownloadPolicySync
+        RequestRunner::Settings requests;
+        size_t connections;
+        unsigned idle_timeout;
+        size_t stripe_size;
+        size_t stripes;
+    };
+
+    typedef RequestRunner::done_t done_t;
+
+    DownloadPolicyAsync(const std::string &username, const std::string &password, const Options &options = Options())
+    : m_auth(http_basic_auth(username, password))
+    , m_max_connections(std::max<size_t>(options.connections, 1))
+    , m_idle_timeout(std::chrono::seconds(options.idle_timeout))
+    , m_timeout(std::chrono::seconds(options.requests.timeout))
+    , m_tls(create_tls_context())
+    , m_started(false)
+    , m_stopping(false) {
+
+    }
+
+    ~DownloadPolicyAsync() {
+        stop();
+        {
+            std::lock_guard<std::mutex> lock(m_drive_mutex);
+            // nobody may be left waiting
+            const std::exception_ptr error { std::make_exception_ptr(std::runtime_error("transport shut down")) };
+            std::vector<Connection*> busy;
+            for (const auto &c : m_connections) {
+                busy.push_back(c.first);
+            }
+            for (Connection *c : busy) {
+                fail(c, error, false);
+            }
+            while (!m_waiting.empty()) {
+                const std::shared_ptr<Request> request { m_waiting.front() };
+                m_waiting.pop_front();
+                finish(*request, error);
+            }
+            m_closed.clear();
+        }
+        SSL_CTX_free(m_tls);
+    }
+
+    // starts a request and returns right away. sink and done are called on
+    // the loop thread, which must not be blocked by them for long. Until
+    // start() is called, the caller runs the loop until the request ends.
+    void async_load(const std::string &url, const Sink &sink, std::pair<long, long> range, const done_t &done) {
+        const std::shared_ptr<Request> request { new Request(url) };
+        try {
+            // here rather than on the loop thread, as resolving blocks
+            request->addresses = resolve(request->target);
+        } catch (...) {
+            done(std::current_exception());
+            return;
+        }
+        request->head = http_request_head(request->target, m_auth, range, is_listing_url(url));
+        if (is_listing_url(url)) {
+            // the request owns the sink, so a plain pointer to it will do
+            const Request *raw { request.get() };
+            request->inflate = std::make_shared<InflateSink>(sink, [raw] { return raw->response->content_encoding(); });
+            const std::shared_ptr<InflateSink> inflate { request->inflate };
+            request->sink = [inflate] (const char *data, size_t size) { (*inflate)(data, size); };
+        } else {
+            request->sink = sink;
+        }
+        if (m_started) {
+            request->done = done;
+            m_loop.post([this, request] { submit(request); });
+            return;
+        }
+        // run by m_drive_mutex holders only
+        const std::shared_ptr<bool> finished { std::make_shared<bool>(false) };
+        request->done = [finished, done] (std::exception_ptr error) {
+            *finished = true;
+            done(error);
+        };
+        m_loop.post([this, request] { submit(request); });
+        for (;;) {
+            std::lock_guard<std::mutex> lock(m_drive_mutex);
+            if (*finished) {
+                return;
+            }
+            const SigpipeGuard guard;
+            run_once();
+        }
+    }
+
+protected:
+
+    void load(const std::string &url, const Sink &sink, std::pair<long, long> range) {
+        const std::shared_ptr<std::promise<void>> finished { std::make_shared<std::promise<void>>() };
+        std::future<void> result { finished->get_future() };
+        async_load(url, sink, range, [finished] (std::exception_ptr error) {
+            if (error) {
+                finished->set_exception(error);
+            } else {
+                finished->set_value();
+            }
+        });
+        result.get();
+    }
+
+    void start() {
+        std::lock_guard<std::mutex> lock(m_thread_mutex);
+        if (m_thread.joinable()) {
+            return;
+        }
+        m_stopping = false;
+        m_thread = std::thread(&DownloadPolicyAsync::run, this);
+        m_started = true;
+    }
+
+    // stops the loop thread, if it's running, and closes idle connections,
+    // which might not survive daemonizing
+    void kill_running_threads() {
+        stop();
+        std::lock_guard<std::mutex> lock(m_drive_mutex);
+        while (!m_idle.empty()) {
+            release(m_idle.back());
+        }
+        m_closed.clear();
+    }
+
+    // stops the loop thread; requests still in progress are failed by the
+    // destructor
+    void abort() {
+        stop();
+    }
+
+private:
+
+    struct Request {
+        explicit Request(const std::string &url)
+        : url(url)
+        , target(parse_http_url(url))
+        , response(nullptr)
+        , fresh(false) {
+
+        }
+
+        const std::string url;
+        const HttpTarget target;
+        std::shared_ptr<addrinfo> addresses;
+        // request line and headers
+        std::string head;
+        Sink sink;
+        std::shared_ptr<InflateSink> inflate;
+        // of the connection the request was last assigned to
+        const HttpResponseParser *response;
+        done_t done;
+        // repeated on a new connection after a reused one turned out closed
+        bool fresh;
+    };
+
+    enum State {
+        CONNECTING,
+        HANDSHAKE,
+        SENDING,
+        RECEIVING,
+        IDLE
+    };
+
+    struct Connection {
+        explicit Connection(const HttpTarget &target)
+        : target(target)
+        , address(nullptr)
+        , fd(-1)
+        , ssl(nullptr)
+        , state(CONNECTING)
+        , watched(0)
+        , want(0)
+        , sent(0)
+        , reused(false)
+        , received(false) {
+
+        }
+
+        ~Connection() {
+            if (ssl != nullptr) {
+                SSL_free(ssl);
+            }
+            if (fd != -1) {
+                close(fd);
+            }
+        }
+
+        const HttpTarget target;
+        std::shared_ptr<addrinfo> addresses;
+        // the one being connected to, or connected
+        const addrinfo *address;
+        int fd;
+        SSL *ssl;
+        State state;
+        // events epoll reports, and the ones the last i/o call waits for
+        uint32_t watched;
+        uint32_t want;
+        std::shared_ptr<Request> request;
+        size_t sent;
+        HttpResponseParser response;
+        // used by an earlier request, so the server may have closed it
+        bool reused;
+        bool received;
+        clock::time_point last_activity;
+    };
+
+    struct Resolved {
+        std::shared_ptr<addrinfo> addresses;
+        clock::time_point expires;
+    };
+
+    // how often timeouts are checked, in milliseconds, and for how long
+    // resolved addresses are used, in seconds
+    enum {
+        TICK_MS = 250,
+        ADDRESS_TTL = 60
+    };
+
+    void stop() {
+        std::lock_guard<std::mutex> lock(m_thread_mutex);
+        if (!m_thread.joinable()) {
+            return;
+        }
+        m_stopping = true;
+        m_loop.post([] { });
+        m_thread.join();
+        m_started = false;
+    }
+
+    void run() {
+        const SigpipeGuard guard;
+        while (!m_stopping) {
+            std::lock_guard<std::mutex> lock(m_drive_mutex);
+            run_once();
+        }
+    }
+
+    // a single iteration of the loop; m_drive_mutex must be held
+    void run_once() {
+        m_loop.poll(TICK_MS);
+        expire();
+        dispatch_waiting();
+        m_closed.clear();
+    }
+
+    void submit(const std::shared_ptr<Request> &request) {
+        if (!request->fresh) {
+            // the most recently used connection is the least likely one to
+            // have been closed by the server
+            for (std::vector<Connection*>::reverse_iterator it = m_idle.rbegin(); it != m_idle.rend(); ++it) {
+                if ((*it)->target.key() == request->target.key()) {
+                    Connection *c = *it;
+                    m_idle.erase(std::next(it).base());
+                    assign(c, request);
+                    return;
+                }
+            }
+        }
+        if (m_connections.size() >= m_max_connections) {
+            if (m_idle.empty()) {
+                m_waiting.push_back(request);
+                return;
+            }
+            // an idle connection to another server, or one the request
+            // mustn't reuse, gives way
+            release(m_idle.front());
+        }
+        connect(request);
+    }
+
+    void dispatch_waiting() {
+        while (!m_waiting.empty() && (m_connections.size() < m_max_connections || !m_idle.empty())) {
+            const std::shared_ptr<Request> request { m_waiting.front() };
+            m_waiting.pop_front();
+            submit(request);
+        }
+    }
+
+    // host names are resolved by the callers of async_load, and the results
+    // are kept for a while, unless none of the addresses can be connected to
+    std::shared_ptr<addrinfo> resolve(const HttpTarget &target) {
+        const std::string key { target.key() };
+        {
+            std::lock_guard<std::mutex> lock(m_addresses_mutex);
+            std::map<std::string, Resolved>::const_iterator it = m_addresses.find(key);
+            if (it != m_addresses.end() && it->second.expires > clock::now()) {
+                return it->second.addresses;
+            }
+        }
+        addrinfo hints {};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo *result = nullptr;
+        const int ret = getaddrinfo(target.host.c_str(), target.port.c_str(), &hints, &result);
+        if (ret != 0 || result == nullptr) {
+            throw std::runtime_error(target.host + ": " + gai_strerror(ret));
+        }
+        const std::shared_ptr<addrinfo> addresses { result, &freeaddrinfo };
+        std::lock_guard<std::mutex> lock(m_addresses_mutex);
+        m_addresses[key] = Resolved { addresses, clock::now() + std::chrono::seconds(ADDRESS_TTL) };
+        return addresses;
+    }
+
+    void forget(const HttpTarget &target, const std::shared_ptr<addrinfo> &addresses) {
+        std::lock_guard<std::mutex> lock(m_addresses_mutex);
+        std::map<std::string, Resolved>::iterator it = m_addresses.find(target.key());
+        if (it != m_addresses.end() && it->second.addresses == addresses) {
+            m_addresses.erase(it);
+        }
+    }
+
+    void connect(const std::shared_ptr<Request> &request) {
+        std::unique_ptr<Connection> conn { new Connection(request->target) };
+        Connection *c = conn.get();
+        c->addresses = request->addresses;
+        c->address = c->addresses.get();
+        try {
+            dial(c);
+        } catch (...) {
+            finish(*request, std::current_exception());
+            return;
+        }
+        c->request = request;
+        request->response = &c->response;
+        m_connections[c] = std::move(conn);
+    }
+
+    // starts connecting to c->address or, if that fails right away, to the
+    // addresses which follow it
+    void dial(Connection *c) {
+        std::string error;
+        for (; c->address != nullptr; c->address = c->address->ai_next) {
+            const addrinfo *a = c->address;
+            const int fd = socket(a->ai_family, a->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, a->ai_protocol);
+            if (fd == -1) {
+                error = std::strerror(errno);
+                continue;
+            }
+            if (::connect(fd, a->ai_addr, a->ai_addrlen) != 0 && errno != EINPROGRESS) {
+                error = std::strerror(errno);
+                close(fd);
+                continue;
+            }
+            const int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            c->fd = fd;
+            m_loop.add(c->fd, EPOLLOUT, [this, c] (uint32_t events) { on_event(c, events); });
+            c->watched = EPOLLOUT;
+            c->last_activity = clock::now();
+            return;
+        }
+        forget(c->target, c->addresses);
+        throw std::runtime_error(c->target.host + ": " + error);
+    }
+
+    // gives up the address being connected to and dials the next one
+    void redial(Connection *c, const std::string &error) {
+        m_loop.remove(c->fd);
+        close(c->fd);
+        c->fd = -1;
+        c->address = c->address->ai_next;
+        if (c->address == nullptr) {
+            forget(c->target, c->addresses);
+            throw std::runtime_error(c->target.host + ": " + error);
+        }
+        dial(c);
+    }
+
+    void assign(Connection *c, const std::shared_ptr<Request> &request) {
+        c->request = request;
+        request->response = &c->response;
+        c->state = SENDING;
+        c->sent = 0;
+        c->received = false;
+        c->response.reset();
+        c->last_activity = clock::now();
+        try {
+            send(c);
+        } catch (...) {
+            fail(c, std::current_exception(), true);
+        }
+    }
+
+    void on_event(Connection *c, uint32_t events) {
+        c->last_activity = clock::now();
+        try {
+            switch (c->state) {
+            case CONNECTING:
+                connected(c);
+                break;
+            case HANDSHAKE:
+                handshake(c);
+                break;
+            case SENDING:
+                send(c);
+                break;
+            case RECEIVING:
+                receive(c);
+                break;
+            case IDLE:
+                // closed by the server, or it sent something unasked for
+                release(c);
+                break;
+            }
+        } catch (...) {
+            fail(c, std::current_exception(), true);
+        }
+        (void) events;
+    }
+
+    void connected(Connection *c) {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &error, &length) != 0 || error != 0) {
+            redial(c, std::strerror(error != 0 ? error : errno));
+            return;
+        }
+        if (!c->target.tls) {
+            c->state = SENDING;
+            send(c);
+            return;
+        }
+        c->ssl = create_tls_connection(m_tls, c->fd, c->target.host);
+        c->state = HANDSHAKE;
+        handshake(c);
+    }
+
+    void handshake(Connection *c) {
+        ERR_clear_error();
+        const int ret = SSL_connect(c->ssl);
+        if (ret == 1) {
+            c->state = SENDING;
+            send(c);
+            return;
+        }
+        if (!tls_wants(c, ret)) {
+            throw std::runtime_error(c->target.host + ": TLS handshake failed: " + tls_error());
+        }
+        watch(c, c->want);
+    }
+
+    void send(Connection *c) {
+        const std::string &head = c->request->head;
+        while (c->sent < head.size()) {
+            const ssize_t n = write_some(c, head.data() + c->sent, head.size() - c->sent);
+            if (n < 0) {
+                watch(c, c->want);
+                return;
+            }
+            c->sent += n;
+        }
+        c->state = RECEIVING;
+        watch(c, EPOLLIN);
+    }
+
+    void receive(Connection *c) {
+        for (;;) {
+            const ssize_t n = read_some(c, m_buffer, sizeof(m_buffer));
+            if (n < 0) {
+                watch(c, c->want);
+                return;
+            }
+            if (n == 0) {
+                c->response.on_close();
+                if (!c->response.complete()) {
+                    throw std::runtime_error(c->target.host + ": connection closed");
+                }
+                complete(c, false);
+                return;
+            }
+            c->received = true;
+            const size_t used = c->response.feed(m_buffer, n, c->request->sink);
+            if (c->response.complete()) {
+                // anything past the response means the connection is out of
+                // step with the server
+                complete(c, used == static_cast<size_t>(n));
+                return;
+            }
+        }
+    }
+
+    // returns the number of bytes written, or -1 if the connection must
+    // become ready first
+    ssize_t write_some(Connection *c, const char *data, size_t size) {
+        if (c->ssl == nullptr) {
+            const ssize_t n = ::send(c->fd, data, size, MSG_NOSIGNAL);
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+                c->want = EPOLLOUT;
+                return -1;
+            }
+            if (n < 0) {
+                throw std::runtime_error(c->target.host + ": " + std::strerror(errno));
+            }
+            return n;
+        }
+        ERR_clear_error();
+        const int n = SSL_write(c->ssl, data, size);
+        if (n > 0) {
+            return n;
+        }
+        if (tls_wants(c, n)) {
+            return -1;
+        }
+        throw std::runtime_error(c->target.host + ": " + tls_error());
+    }
+
+    // returns the number of bytes read, 0 at the end of the stream or -1 if
+    // the connection must become ready first
+    ssize_t read_some(Connection *c, char *data, size_t size) {
+        if (c->ssl == nullptr) {
+            const ssize_t n = recv(c->fd, data, size, 0);
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+                c->want = EPOLLIN;
+                return -1;
+            }
+            if (n < 0) {
+                throw std::runtime_error(c->target.host + ": " + std::strerror(errno));
+            }
+            return n;
+        }
+        ERR_clear_error();
+        const int n = SSL_read(c->ssl, data, size);
+        if (n > 0) {
+            return n;
+        }
+        const int error = SSL_get_error(c->ssl, n);
+        if (error == SSL_ERROR_ZERO_RETURN || (error == SSL_ERROR_SYSCALL && ERR_peek_error() == 0)) {
+            // orderly or abrupt close
+            return 0;
+        }
+        if (tls_wants(c, n)) {
+            return -1;
+        }
+        throw std::runtime_error(c->target.host + ": " + tls_error());
+    }
+
+    // tells if a failed TLS call only waits for the socket, and for what
+    static bool tls_wants(Connection *c, int ret) {
+        switch (SSL_get_error(c->ssl, ret)) {
+        case SSL_ERROR_WANT_READ:
+            c->want = EPOLLIN;
+            return true;
+        case SSL_ERROR_WANT_WRITE:
+            c->want = EPOLLOUT;
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    void watch(Connection *c, uint32_t events) {
+        if (c->watched != events) {
+            m_loop.modify(c->fd, events);
+            c->watched = events;
+        }
+    }
+
+    void complete(Connection *c, bool reusable) {
+        const std::shared_ptr<Request> request { std::move(c->request) };
+        std::exception_ptr error;
+        try {
+            check_http_status(request->url, c->response.status());
+            if (request->inflate) {
+                request->inflate->finish();
+            }
+        } catch (...) {
+            error = std::current_exception();
+        }
+        if (reusable && c->response.keep_alive()) {
+            c->state = IDLE;
+            c->reused = true;
+            c->last_activity = clock::now();
+            watch(c, EPOLLIN);
+            m_idle.push_back(c);
+        } else {
+            release(c);
+        }
+        finish(*request, error);
+    }
+
+    // closes the connection and ends its request, if any. A request which
+    // found a reused connection closed is repeated on a new one.
+    void fail(Connection *c, std::exception_ptr error, bool may_retry) {
+        const std::shared_ptr<Request> request { std::move(c->request) };
+        const bool stale = c->reused && !c->received;
+        release(c);
+        if (!request) {
+            return;
+        }
+        if (may_retry && stale && !request->fresh) {
+            request->fresh = true;
+            submit(request);
+            return;
+        }
+        finish(*request, error);
+    }
+
+    // closes a connection. It's destroyed at the end of the loop iteration,
+    // as it may be the one being handled.
+    void release(Connection *c) {
+        m_loop.remove(c->fd);
+        m_idle.erase(std::remove(m_idle.begin(), m_idle.end(), c), m_idle.end());
+        std::unordered_map<Connection*, std::unique_ptr<Connection>>::iterator it = m_connections.find(c);
+        if (it != m_connections.end()) {
+            m_closed.push_back(std::move(it->second));
+            m_connections.erase(it);
+        }
+    }
+
+    static void finish(Request &request, std::exception_ptr error) {
+        const done_t done { std::move(request.done) };
+        if (done) {
+            done(error);
+        }
+    }
+
+    // closes idle connections past their time, and fails requests which
+    // have received nothing for too long. A connection attempt which takes
+    // too long moves on to the next address first.
+    void expire() {
+        const clock::time_point now { clock::now() };
+        std::vector<Connection*> idle;
+        std::vector<Connection*> connecting;
+        std::vector<Connection*> stalled;
+        for (const auto &c : m_connections) {
+            if (c.first->state == IDLE) {
+                if (now - c.first->last_activity > m_idle_timeout) {
+                    idle.push_back(c.first);
+                }
+            } else if (m_timeout.count() > 0 && now - c.first->last_activity > m_timeout) {
+                if (c.first->state == CONNECTING && c.first->address->ai_next != nullptr) {
+                    connecting.push_back(c.first);
+                } else {
+                    stalled.push_back(c.first);
+                }
+            }
+        }
+        for (Connection *c : idle) {
+            release(c);
+        }
+        for (Connection *c : connecting) {
+            try {
+                redial(c, "connection timed out");
+            } catch (...) {
+                fail(c, std::current_exception(), false);
+            }
+        }
+        for (Connection *c : stalled) {
+            fail(c, std::make_exception_ptr(TimeoutException()), false);
+        }
+    }
+
+    const std::string m_auth;
+    const size_t m_max_connections;
+    const clock::duration m_idle_timeout;
+    const clock::duration m_timeout;
+    SSL_CTX *m_tls;
+
+    // everything below, but the loop's post(), is used by m_drive_mutex
+    // holders only: the loop thread, or callers running the loop themselves
+    EventLoop m_loop;
+    std::mutex m_drive_mutex;
+    std::unordered_map<Connection*, std::unique_ptr<Connection>> m_connections;
+    std::vector<std::unique_ptr<Connection>> m_closed;
+    // most recently used last
+    std::vector<Connection*> m_idle;
+    std::deque<std::shared_ptr<Request>> m_waiting;
+    char m_buffer[64 * 1024];
+
+    // resolved addresses by HttpTarget::key(), used by callers of async_load
+    // as well
+    std::map<std::string, Resolved> m_addresses;
+    std::mutex m_addresses_mutex;
+
+    std::atomic<bool> m_started;
+    std::atomic<bool> m_stopping;
+    std::thread m_thread;
+    std::mutex m_thread_mutex;
+};
+
+}
+
+#endif // SOAKFS_ASYNC_DOWNLOAD_POLICY_HPP
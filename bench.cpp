@@ -0,0 +1,344 @@
+/*******************************************************************************
+ * Copyright (c) 2012, Andrzej Zawadzki (azawadzki@gmail.com)
+ *
+ * soakfs is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * soakfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with soakfs; if not, see <http ://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#include "soakfs.hpp"
+#include "mock_download_policy.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+
+// Runs filesystem scenarios against a simulated storage server and reports
+// throughput and latency of single operations. Every scenario starts with
+// empty caches, so runs with the same settings are comparable.
+
+typedef BasicSoakFS<soak::MockDownloadPolicy> BenchFS;
+typedef std::chrono::steady_clock bench_clock;
+
+struct BenchConfig {
+    SoakFSConfig fs;
+    soak::MockDownloadPolicy::Options storage;
+    std::string scenario { "all" };
+    // size of sequential reads, in KiB
+    unsigned long read_size { 128 };
+    unsigned long random_reads { 2000 };
+    unsigned long readers { 8 };
+};
+
+// latencies of operations run by a scenario
+class Results {
+
+public:
+
+    Results()
+    : m_start(bench_clock::now()) {
+
+    }
+
+    template<typename Op>
+    void time(Op op) {
+        const bench_clock::time_point start { bench_clock::now() };
+        op();
+        const double us = std::chrono::duration<double, std::micro>(bench_clock::now() - start).count();
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_latencies.push_back(us);
+    }
+
+    void report(const std::string &name, const BenchFS &fs) {
+        const double seconds = std::chrono::duration<double>(bench_clock::now() - m_start).count();
+        std::sort(m_latencies.begin(), m_latencies.end());
+        std::cout << std::left << std::setw(14) << name << std::right << std::fixed << std::setprecision(2)
+            << std::setw(9) << m_latencies.size() << " ops"
+            << std::setw(11) << m_latencies.size() / seconds << " ops/s"
+            << "  p50 " << std::setw(8) << percentile(0.5) / 1000
+            << "  p90 " << std::setw(8) << percentile(0.9) / 1000
+            << "  p99 " << std::setw(8) << percentile(0.99) / 1000
+            << "  max " << std::setw(8) << percentile(1) / 1000 << " ms"
+            << std::setw(8) << fs.download_policy().requests() << " requests"
+            << std::setw(10) << fs.download_policy().bytes() / (1024.0 * 1024.0) << " MiB"
+            << std::endl;
+    }
+
+private:
+
+    double percentile(double p) const {
+        if (m_latencies.empty()) {
+            return 0;
+        }
+        const size_t i = static_cast<size_t>(p * (m_latencies.size() - 1) + 0.5);
+        return m_latencies[i];
+    }
+
+    const bench_clock::time_point m_start;
+    std::vector<double> m_latencies;
+    std::mutex m_mutex;
+};
+
+struct DirEntry {
+    std::string name;
+    bool dir;
+};
+
+static std::vector<DirEntry> list(BenchFS &fs, const std::string &path, Results &results) {
+    std::vector<DirEntry> entries;
+    results.time([&fs, &path, &entries] {
+        const int ret = fs.readdir(path, 0, [&entries] (const char *name, const struct stat *stbuf, off_t) -> bool {
+            if (strcmp(name, ".") != 0 && strcmp(name, "..") != 0) {
+                entries.push_back(DirEntry { name, S_ISDIR(stbuf->st_mode) });
+            }
+            return false;
+        });
+        if (ret < 0) {
+            throw std::runtime_error(path + ": readdir failed");
+        }
+    });
+    return entries;
+}
+
+static void stat_path(BenchFS &fs, const std::string &path, Results &results) {
+    results.time([&fs, &path] {
+        struct stat stbuf;
+        if (fs.getattr(path, &stbuf) < 0) {
+            throw std::runtime_error(path + ": getattr failed");
+        }
+    });
+}
+
+// reads [offset, offset + size) of an open file, checking the contents
+static void read_range(BenchFS &fs, const std::string &path, uint64_t fh, unsigned long offset, size_t size,
+        Results &results) {
+    std::vector<char> buf(size);
+    results.time([&fs, &path, fh, offset, size, &buf] {
+        char *out = buf.data();
+        const int ret = fs.read(path, size, offset, fh,
+            [&out] (const soak::BlockCache::Block &block, size_t block_offset, size_t n) {
+                std::memcpy(out, block->data() + block_offset, n);
+                out += n;
+            });
+        if (ret < 0) {
+            throw std::runtime_error(path + ": read failed");
+        }
+    });
+    // leading slash isn't part of the path on the server
+    const unsigned seed = soak::MockDownloadPolicy::hash(path.substr(1));
+    for (size_t i = 0; i < buf.size(); i += 4096) {
+        if (buf[i] != soak::MockDownloadPolicy::content(seed, offset + i)) {
+            throw std::runtime_error(path + ": corrupted data");
+        }
+    }
+}
+
+static void read_file(BenchFS &fs, const std::string &path, const BenchConfig &config, Results &results) {
+    uint64_t fh;
+    bool direct_io;
+    if (fs.open(path, O_RDONLY, fh, direct_io) < 0) {
+        throw std::runtime_error(path + ": open failed");
+    }
+    const size_t chunk = config.read_size * 1024;
+    for (unsigned long offset = 0; offset < config.storage.file_size; offset += chunk) {
+        read_range(fs, path, fh, offset, std::min<unsigned long>(chunk, config.storage.file_size - offset), results);
+    }
+    fs.release(fh);
+}
+
+static std::string file_path(const BenchConfig &config, unsigned long n) {
+    return "/dev0/d" + std::to_string((n / config.storage.files) % config.storage.dirs) + "/f" + std::to_string(n % config.storage.files);
+}
+
+// find -type f on every device but the huge directory
+static void walk(BenchFS &fs, const std::string &path, Results &results) {
+    for (const DirEntry &e : list(fs, path, results)) {
+        const std::string child { path == "/" ? "/" + e.name : path + "/" + e.name };
+        stat_path(fs, child, results);
+        if (e.dir && child != "/big") {
+            walk(fs, child, results);
+        }
+    }
+}
+
+static void scenario_find(BenchFS &fs, const BenchConfig&, Results &results) {
+    walk(fs, "/", results);
+}
+
+// ls -l of the huge directory
+static void scenario_ls(BenchFS &fs, const BenchConfig&, Results &results) {
+    for (const DirEntry &e : list(fs, "/big/d0", results)) {
+        stat_path(fs, "/big/d0/" + e.name, results);
+    }
+}
+
+static void scenario_sequential(BenchFS &fs, const BenchConfig &config, Results &results) {
+    for (unsigned long i = 0; i < 4; ++i) {
+        read_file(fs, file_path(config, i), config, results);
+    }
+}
+
+static void scenario_random(BenchFS &fs, const BenchConfig &config, Results &results) {
+    std::mt19937 random { 42 };
+    const size_t size = 4096;
+    std::uniform_int_distribution<unsigned long> files(0, config.storage.files * config.storage.dirs - 1);
+    std::uniform_int_distribution<unsigned long> offsets(0, (config.storage.file_size - size) / size);
+    for (unsigned long i = 0; i < config.random_reads; ++i) {
+        const std::string path { file_path(config, files(random)) };
+        uint64_t fh;
+        bool direct_io;
+        if (fs.open(path, O_RDONLY, fh, direct_io) < 0) {
+            throw std::runtime_error(path + ": open failed");
+        }
+        read_range(fs, path, fh, offsets(random) * size, size, results);
+        fs.release(fh);
+    }
+}
+
+// sequential readers of distinct files running at once
+static void scenario_concurrent(BenchFS &fs, const BenchConfig &config, Results &results) {
+    std::vector<std::thread> readers;
+    std::exception_ptr error;
+    std::mutex error_mutex;
+    for (unsigned long i = 0; i < config.readers; ++i) {
+        readers.push_back(std::thread([&fs, &config, &results, &error, &error_mutex, i] {
+            try {
+                read_file(fs, file_path(config, i), config, results);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(error_mutex);
+                error = std::current_exception();
+            }
+        }));
+    }
+    for (std::thread &t : readers) {
+        t.join();
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+typedef void (*scenario_t)(BenchFS&, const BenchConfig&, Results&);
+
+static const struct {
+    const char *name;
+    scenario_t run;
+} scenarios[] = {
+    { "find", scenario_find },
+    { "ls", scenario_ls },
+    { "sequential", scenario_sequential },
+    { "random", scenario_random },
+    { "concurrent", scenario_concurrent },
+};
+
+static bool parse_args(int argc, char *argv[], BenchConfig &config) {
+    unsigned long latency_ms = config.storage.latency / 1000;
+    unsigned long bandwidth_kib = config.storage.bandwidth / 1024;
+    unsigned long file_size_kib = config.storage.file_size / 1024;
+    unsigned long slow_latency_ms = config.storage.slow_latency / 1000;
+    const struct {
+        const char *name;
+        unsigned long *value;
+    } numbers[] = {
+        { "latency", &latency_ms },
+        { "bandwidth", &bandwidth_kib },
+        { "file_size", &file_size_kib },
+        { "devices", &config.storage.devices },
+        { "dirs", &config.storage.dirs },
+        { "files", &config.storage.files },
+        { "depth", &config.storage.depth },
+        { "huge_dir", &config.storage.huge_dir },
+        { "slow", &config.storage.slow },
+        { "slow_latency", &slow_latency_ms },
+        { "gzip", &config.storage.gzip },
+        { "read_size", &config.read_size },
+        { "random_reads", &config.random_reads },
+        { "readers", &config.readers },
+        { "block_size", &config.fs.block_size },
+        { "cache_size", &config.fs.cache_size },
+        { "readahead", &config.fs.readahead },
+        { "readahead_threads", &config.fs.readahead_threads },
+        { "connections", &config.fs.connections },
+        { "stripe_size", &config.fs.stripe_size },
+        { "stripes", &config.fs.stripes },
+        { "request_timeout", &config.fs.request_timeout },
+        { "hedge", &config.fs.hedge },
+        { "retries", &config.fs.retries },
+    };
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg { argv[i] };
+        const size_t eq = arg.find('=');
+        const std::string key { arg.substr(0, eq) };
+        const std::string value { eq == std::string::npos ? "" : arg.substr(eq + 1) };
+        bool known = false;
+        if (key == "scenario") {
+            config.scenario = value;
+            known = true;
+        }
+        for (const auto &n : numbers) {
+            if (key == n.name) {
+                *n.value = std::strtoul(value.c_str(), nullptr, 10);
+                known = true;
+            }
+        }
+        if (!known) {
+            std::cerr << "unknown argument " << arg << std::endl;
+            return false;
+        }
+    }
+    config.storage.latency = latency_ms * 1000;
+    config.storage.bandwidth = bandwidth_kib * 1024;
+    config.storage.file_size = file_size_kib * 1024;
+    config.storage.slow_latency = slow_latency_ms * 1000;
+    return config.storage.files > 0 && config.storage.dirs > 0 && config.storage.file_size >= 4096
+        && config.read_size > 0 && config.fs.block_size > 0;
+}
+
+int main(int argc, char *argv[]) {
+    BenchConfig config;
+    if (!parse_args(argc, argv, config)) {
+        std::cerr << "usage: " << argv[0] << " [scenario=all|find|ls|sequential|random|concurrent] [key=value...]" << std::endl;
+        return EXIT_FAILURE;
+    }
+    bool found = false;
+    for (const auto &s : scenarios) {
+        if (config.scenario != "all" && config.scenario != s.name) {
+            continue;
+        }
+        found = true;
+        try {
+            BenchFS fs { "bench", "bench", config.fs, config.storage };
+            fs.start_workers();
+            Results results;
+            s.run(fs, config, results);
+            results.report(s.name, fs);
+        } catch (const std::exception &e) {
+            std::cerr << s.name << ": " << e.what() << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+    if (!found) {
+        std::cerr << "unknown scenario " << config.scenario << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,288 @@
+/*******************************************************************************
+ * Copyright (c) 2012, Andrzej Zawadzki (azawadzki@gmail.com)
+ *
+ * soakfs is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * soakfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with soakfs; if not, see <http ://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#ifndef SOAKFS_BLOCK_CACHE_HPP
+#define SOAKFS_BLOCK_CACHE_HPP
+
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "lru_cache.hpp"
+#include "stats.hpp"
+
+namespace soak {
+
+// Keeps recently read file contents in memory. Files are split into aligned
+// blocks of equal size (only the last block of a file may be shorter), so
+// that overlapping reads coming from the kernel hit the same entries. Blocks
+// are keyed by the size and modification time of the file along with its path,
+// so contents of an older version of a file are never served for a newer one,
+// even after the listing which described the old version is gone. Blocks of
+// older versions are not dropped eagerly, as files opened before the change
+// may still read them; they age out like any other entry.
+class BlockCache {
+
+public:
+
+    typedef std::shared_ptr<const std::vector<char>> Block;
+    // returns blocks [first, last) of a file
+    typedef std::function<std::vector<Block>(unsigned long first, unsigned long last)> run_loader_t;
+
+    BlockCache(size_t block_size, size_t budget)
+    : m_block_size(block_size)
+    , m_blocks(budget) {
+
+    }
+
+    size_t block_size() const noexcept {
+        return m_block_size;
+    }
+
+    // returns empty pointer if block is not cached. Blocks are immutable and
+    // reference counted, so the caller can use them without holding any lock.
+    Block get(const std::string &path, unsigned long index, unsigned long file_size, unsigned long mtime) {
+        const std::unique_lock<std::mutex> lock { timed_lock(m_blocks_mutex, m_lock_waits) };
+        Block *block = m_blocks.find(BlockKey { path, index, file_size, mtime });
+        if (block == nullptr) {
+            ++m_misses;
+            return Block();
+        }
+        ++m_hits;
+        return *block;
+    }
+
+    // unlike get, neither counts as a hit or miss nor marks the block as used
+    bool contains(const std::string &path, unsigned long index, unsigned long file_size, unsigned long mtime) {
+        const std::unique_lock<std::mutex> lock { timed_lock(m_blocks_mutex, m_lock_waits) };
+        return m_blocks.contains(BlockKey { path, index, file_size, mtime });
+    }
+
+    void put(const std::string &path, unsigned long index, unsigned long file_size, unsigned long mtime, Block block) {
+        const std::unique_lock<std::mutex> lock { timed_lock(m_blocks_mutex, m_lock_waits) };
+        insert(BlockKey { path, index, file_size, mtime }, std::move(block));
+    }
+
+    // returns cached block or creates it with loader. Concurrent requests for
+    // the same missing block, e.g. a foreground read racing with prefetch,
+    // wait for a single load instead of downloading the data twice. A block
+    // which is part of a long prefetch run is loaded on its own though, as
+    // the whole run may take much longer than a single block; whichever
+    // copy comes second is dropped.
+    Block fetch(const std::string &path, unsigned long index, unsigned long file_size, unsigned long mtime,
+            std::function<Block()> loader) {
+        const BlockKey key { path, index, file_size, mtime };
+        std::promise<Block> promise;
+        {
+            std::unique_lock<std::mutex> lock { timed_lock(m_blocks_mutex, m_lock_waits) };
+            Block *block = m_blocks.find(key);
+            if (block != nullptr) {
+                ++m_hits;
+                return *block;
+            }
+            auto pending = m_pending.find(key);
+            if (pending != m_pending.end() && pending->second.joinable) {
+                ++m_joined;
+                std::shared_future<Block> result { pending->second.result };
+                lock.unlock();
+                return result.get();
+            }
+            ++m_misses;
+            if (pending != m_pending.end()) {
+                // left to the prefetch run, which keeps the entry
+                lock.unlock();
+                Block block { loader() };
+                const std::unique_lock<std::mutex> relock { timed_lock(m_blocks_mutex, m_lock_waits) };
+                insert_new(key, block);
+                return block;
+            }
+            m_pending[key] = Pending { promise.get_future().share(), true };
+        }
+        try {
+            Block block { loader() };
+            const std::unique_lock<std::mutex> lock { timed_lock(m_blocks_mutex, m_lock_waits) };
+            insert_new(key, block);
+            m_pending.erase(key);
+            promise.set_value(block);
+            return block;
+        } catch (...) {
+            const std::unique_lock<std::mutex> lock { timed_lock(m_blocks_mutex, m_lock_waits) };
+            m_pending.erase(key);
+            promise.set_exception(std::current_exception());
+            throw;
+        }
+    }
+
+    // loads the blocks in [first, last) which are neither cached nor being
+    // loaded, calling loader once for every run of consecutive such blocks,
+    // e.g. so that read-ahead downloads them with a single request. Callers
+    // of fetch wait for blocks of short runs in the meantime, as with a
+    // single load.
+    void prefetch(const std::string &path, unsigned long first, unsigned long last, unsigned long file_size,
+            unsigned long mtime, const run_loader_t &loader) {
+        std::vector<std::pair<unsigned long, std::promise<Block>>> claimed;
+        claimed.reserve(last - first);
+        {
+            const std::unique_lock<std::mutex> lock { timed_lock(m_blocks_mutex, m_lock_waits) };
+            for (unsigned long index = first; index < last; ++index) {
+                const BlockKey key { path, index, file_size, mtime };
+                if (m_blocks.contains(key)) {
+                    ++m_hits;
+                    continue;
+                }
+                if (m_pending.count(key) > 0) {
+                    continue;
+                }
+                ++m_misses;
+                claimed.push_back(std::make_pair(index, std::promise<Block>()));
+            }
+            for (size_t begin = 0; begin < claimed.size(); ) {
+                const size_t end = run_end(claimed, begin);
+                for (size_t i = begin; i < end; ++i) {
+                    m_pending[BlockKey { path, claimed[i].first, file_size, mtime }]
+                        = Pending { claimed[i].second.get_future().share(), end - begin <= MAX_JOINED_RUN };
+                }
+                begin = end;
+            }
+        }
+        std::exception_ptr first_error;
+        for (size_t begin = 0; begin < claimed.size(); ) {
+            const size_t end = run_end(claimed, begin);
+            std::vector<Block> blocks;
+            std::exception_ptr error;
+            try {
+                blocks = loader(claimed[begin].first, claimed[end - 1].first + 1);
+            } catch (...) {
+                error = std::current_exception();
+                if (!first_error) {
+                    first_error = error;
+                }
+            }
+            const std::unique_lock<std::mutex> lock { timed_lock(m_blocks_mutex, m_lock_waits) };
+            for (size_t i = begin; i < end; ++i) {
+                const BlockKey key { path, claimed[i].first, file_size, mtime };
+                if (!error) {
+                    insert_new(key, blocks[i - begin]);
+                }
+                m_pending.erase(key);
+                if (error) {
+                    claimed[i].second.set_exception(error);
+                } else {
+                    claimed[i].second.set_value(blocks[i - begin]);
+                }
+            }
+            begin = end;
+        }
+        if (first_error) {
+            std::rethrow_exception(first_error);
+        }
+    }
+
+    // writes counters as "name value" lines; joined counts callers which
+    // waited for a load started by someone else, duplicates blocks loaded
+    // both by a foreground read and by prefetch
+    void report(std::ostream &out, const std::string &prefix) {
+        size_t entries;
+        size_t cost;
+        {
+            std::lock_guard<std::mutex> lock(m_blocks_mutex);
+            entries = m_blocks.size();
+            cost = m_blocks.cost();
+        }
+        out << prefix << "_hits " << m_hits.value() << "\n"
+            << prefix << "_misses " << m_misses.value() << "\n"
+            << prefix << "_joined " << m_joined.value() << "\n"
+            << prefix << "_duplicates " << m_duplicates.value() << "\n"
+            << prefix << "_entries " << entries << "\n"
+            << prefix << "_bytes " << cost << "\n";
+        m_lock_waits.write(out, prefix + "_lock_wait");
+    }
+
+private:
+
+    struct BlockKey {
+        std::string path;
+        unsigned long index;
+        unsigned long file_size;
+        unsigned long mtime;
+
+        bool operator==(const BlockKey &other) const {
+            return index == other.index && mtime == other.mtime && file_size == other.file_size && path == other.path;
+        }
+    };
+
+    struct BlockKeyHash {
+        size_t operator()(const BlockKey &key) const {
+            return std::hash<std::string>()(key.path) ^ (std::hash<unsigned long>()(key.index) * 31)
+                ^ (std::hash<unsigned long>()(key.mtime) * 131);
+        }
+    };
+
+    struct Pending {
+        std::shared_future<Block> result;
+        // false for blocks of long prefetch runs, which fetch doesn't wait for
+        bool joinable;
+    };
+
+    // blocks of prefetch runs longer than that are not waited for
+    enum : size_t { MAX_JOINED_RUN = 4 };
+
+    // claimed blocks from begin up to the first gap
+    static size_t run_end(const std::vector<std::pair<unsigned long, std::promise<Block>>> &claimed, size_t begin) {
+        size_t end = begin + 1;
+        while (end < claimed.size() && claimed[end].first == claimed[end - 1].first + 1) {
+            ++end;
+        }
+        return end;
+    }
+
+    // m_blocks_mutex must be held
+    void insert(const BlockKey &key, Block block) {
+        const size_t cost = block->size() + sizeof(BlockKey) + key.path.size();
+        m_blocks.insert(key, std::move(block), cost);
+    }
+
+    // keeps the copy which came first. m_blocks_mutex must be held.
+    void insert_new(const BlockKey &key, Block block) {
+        if (m_blocks.contains(key)) {
+            ++m_duplicates;
+        } else {
+            insert(key, std::move(block));
+        }
+    }
+
+    const size_t m_block_size;
+    LruCache<BlockKey, Block, BlockKeyHash> m_blocks;
+    std::unordered_map<BlockKey, Pending, BlockKeyHash> m_pending;
+    // blocks are read and inserted concurrently if fuse is run in
+    // multithreaded mode
+    std::mutex m_blocks_mutex;
+    Counter m_hits;
+    Counter m_misses;
+    Counter m_joined;
+    Counter m_duplicates;
+    // contended acquisitions of m_blocks_mutex
+    Histogram m_lock_waits;
+};
+
+}
+
+#endif // SOAKFS_BLOCK_CACHE_HPP
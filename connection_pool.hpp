@@ -0,0 +1,167 @@
+/*******************************************************************************
+ * Copyright (c) 2012, Andrzej Zawadzki (azawadzki@gmail.com)
+ *
+ * soakfs is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * soakfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with soakfs; if not, see <http ://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#ifndef SOAKFS_CONNECTION_POOL_HPP
+#define SOAKFS_CONNECTION_POOL_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace soak {
+
+// Bounded set of reusable connections. A connection is used by one thread at
+// a time: it is checked out for the duration of a request and returned to the
+// pool afterwards, so that the next request can skip the connection setup
+// (and the TLS handshake in particular). Connections idle for longer than the
+// timeout are closed.
+template<typename Connection>
+class ConnectionPool {
+
+    typedef std::chrono::steady_clock clock;
+
+public:
+
+    typedef std::function<std::unique_ptr<Connection>()> factory_t;
+
+    // RAII handle of a checked out connection
+    class Lease {
+
+    public:
+
+        Lease(ConnectionPool &pool, std::unique_ptr<Connection> conn)
+        : m_pool(&pool)
+        , m_conn(std::move(conn)) {
+
+        }
+
+        Lease(Lease &&other)
+        : m_pool(other.m_pool)
+        , m_conn(std::move(other.m_conn)) {
+            other.m_pool = nullptr;
+        }
+
+        ~Lease() {
+            if (m_pool != nullptr) {
+                m_pool->release(std::move(m_conn));
+            }
+        }
+
+        Connection* operator->() const noexcept {
+            return m_conn.get();
+        }
+
+        Connection& operator*() const noexcept {
+            return *m_conn;
+        }
+
+        // closes the connection instead of returning it to the pool, e.g.
+        // after it failed in the middle of a request
+        void discard() {
+            m_conn.reset();
+        }
+
+    private:
+
+        Lease(const Lease&) = delete;
+        Lease& operator=(const Lease&) = delete;
+
+        ConnectionPool *m_pool;
+        std::unique_ptr<Connection> m_conn;
+    };
+
+    ConnectionPool(size_t max_size, std::chrono::seconds idle_timeout, factory_t factory)
+    : m_max_size(std::max<size_t>(max_size, 1))
+    , m_idle_timeout(idle_timeout)
+    , m_factory(factory)
+    , m_in_use(0) {
+
+    }
+
+    // blocks if all connections are in use
+    Lease acquire() {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        reap_idle();
+        m_released_cond.wait(lock, [this] { return !m_idle.empty() || m_in_use < m_max_size; });
+        ++m_in_use;
+        if (!m_idle.empty()) {
+            // take the most recently used connection, which is the least
+            // likely one to have been closed by the server
+            std::unique_ptr<Connection> conn { std::move(m_idle.back().conn) };
+            m_idle.pop_back();
+            return Lease(*this, std::move(conn));
+        }
+        lock.unlock();
+        try {
+            return Lease(*this, m_factory());
+        } catch (...) {
+            release(std::unique_ptr<Connection>());
+            throw;
+        }
+    }
+
+    // closes all idle connections
+    void clear() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_idle.clear();
+    }
+
+private:
+
+    struct IdleConnection {
+        std::unique_ptr<Connection> conn;
+        clock::time_point since;
+    };
+
+    void release(std::unique_ptr<Connection> conn) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            --m_in_use;
+            if (conn) {
+                m_idle.push_back(IdleConnection { std::move(conn), clock::now() });
+            }
+        }
+        m_released_cond.notify_one();
+    }
+
+    // must be called with m_mutex held
+    void reap_idle() {
+        const clock::time_point deadline { clock::now() - m_idle_timeout };
+        auto first_alive = std::find_if(m_idle.begin(), m_idle.end(),
+            [&deadline] (const IdleConnection &c) -> bool {
+                return c.since > deadline;
+            });
+        // connections are appended on release, so the stale ones come first
+        m_idle.erase(m_idle.begin(), first_alive);
+    }
+
+    const size_t m_max_size;
+    const std::chrono::seconds m_idle_timeout;
+    factory_t m_factory;
+    size_t m_in_use;
+    std::vector<IdleConnection> m_idle;
+    std::mutex m_mutex;
+    std::condition_variable m_released_cond;
+};
+
+}
+
+#endif // SOAKFS_CONNECTION_POOL_HPP
@@ -0,0 +1,193 @@
+/*******************************************************************************
+ * Copyright (c) 2012, Andrzej Zawadzki (azawadzki@gmail.com)
+ *
+ * soakfs is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * soakfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with soakfs; if not, see <http ://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#ifndef SOAKFS_CRAWLER_HPP
+#define SOAKFS_CRAWLER_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace soak {
+
+// Walks directory trees with a bounded number of concurrent listing fetches.
+// Every worker keeps its own queue of directories: it takes work from the back
+// of its queue (depth first, so that the queues stay short) and, once it runs
+// out, steals from the front of the other queues, where the shallowest and
+// thus most promising directories are. The crawl ends when all queues are
+// empty, or earlier if the depth or entry budget is exhausted.
+class Crawler {
+
+public:
+
+    // lists given directory, appending paths of its subdirectories to
+    // subdirs, and returns the number of entries in it
+    typedef std::function<size_t(const std::string &path, std::vector<std::string> &subdirs)> list_t;
+
+    Crawler(size_t threads, unsigned max_depth, size_t max_entries, list_t list)
+    : m_max_depth(max_depth)
+    , m_max_entries(max_entries)
+    , m_list(list)
+    , m_pending(0)
+    , m_entries(0)
+    , m_stopping(false) {
+        for (size_t i = 0; i < std::max<size_t>(threads, 1); ++i) {
+            m_queues.push_back(std::unique_ptr<Queue>(new Queue));
+        }
+    }
+
+    ~Crawler() {
+        stop();
+    }
+
+    // threads must not be started before fuse is initialized, see the comment
+    // in main()
+    void start(const std::vector<std::string> &roots) {
+        for (size_t i = 0; i < roots.size(); ++i) {
+            push(i % m_queues.size(), Job { roots[i], 0 });
+        }
+        for (size_t i = 0; i < m_queues.size(); ++i) {
+            m_threads.push_back(std::thread(&Crawler::run, this, i));
+        }
+    }
+
+    // blocks until the crawl is over
+    void wait() {
+        for (std::thread &t : m_threads) {
+            t.join();
+        }
+        m_threads.clear();
+    }
+
+    void stop() {
+        m_stopping = true;
+        m_work_cond.notify_all();
+        wait();
+    }
+
+    size_t entries() const noexcept {
+        return m_entries;
+    }
+
+private:
+
+    struct Job {
+        std::string path;
+        unsigned depth;
+    };
+
+    struct Queue {
+        std::deque<Job> jobs;
+        std::mutex mutex;
+    };
+
+    void run(size_t self) {
+        for (;;) {
+            Job job;
+            if (pop(self, job) || steal(self, job)) {
+                crawl(self, job);
+                if (--m_pending == 0) {
+                    m_work_cond.notify_all();
+                }
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(m_work_mutex);
+            if (m_stopping || m_pending == 0) {
+                return;
+            }
+            // a short timeout covers the race of new work being pushed between
+            // the unsuccessful steal and this wait
+            m_work_cond.wait_for(lock, std::chrono::milliseconds(10));
+        }
+    }
+
+    void crawl(size_t self, const Job &job) {
+        if (m_stopping || m_entries >= m_max_entries) {
+            return;
+        }
+        std::vector<std::string> subdirs;
+        try {
+            m_entries += m_list(job.path, subdirs);
+        } catch (...) {
+            // unreadable directory; skip the subtree
+            return;
+        }
+        if (job.depth >= m_max_depth) {
+            return;
+        }
+        for (const std::string &dir : subdirs) {
+            push(self, Job { dir, job.depth + 1 });
+        }
+        if (!subdirs.empty()) {
+            m_work_cond.notify_all();
+        }
+    }
+
+    void push(size_t queue, Job job) {
+        ++m_pending;
+        Queue &q = *m_queues[queue];
+        std::lock_guard<std::mutex> lock(q.mutex);
+        q.jobs.push_back(std::move(job));
+    }
+
+    bool pop(size_t self, Job &job) {
+        Queue &q = *m_queues[self];
+        std::lock_guard<std::mutex> lock(q.mutex);
+        if (q.jobs.empty()) {
+            return false;
+        }
+        job = std::move(q.jobs.back());
+        q.jobs.pop_back();
+        return true;
+    }
+
+    bool steal(size_t self, Job &job) {
+        for (size_t i = 1; i < m_queues.size(); ++i) {
+            Queue &q = *m_queues[(self + i) % m_queues.size()];
+            std::lock_guard<std::mutex> lock(q.mutex);
+            if (!q.jobs.empty()) {
+                job = std::move(q.jobs.front());
+                q.jobs.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    const unsigned m_max_depth;
+    const size_t m_max_entries;
+    list_t m_list;
+    std::vector<std::unique_ptr<Queue>> m_queues;
+    std::vector<std::thread> m_threads;
+    // jobs queued or being processed
+    std::atomic<size_t> m_pending;
+    std::atomic<size_t> m_entries;
+    std::atomic<bool> m_stopping;
+    std::mutex m_work_mutex;
+    std::condition_variable m_work_cond;
+};
+
+}
+
+#endif // SOAKFS_CRAWLER_HPP
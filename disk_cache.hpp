@@ -0,0 +1,292 @@
+/*******************************************************************************
+ * Copyright (c) 2012, Andrzej Zawadzki (azawadzki@gmail.com)
+ *
+ * soakfs is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * soakfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with soakfs; if not, see <http ://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#ifndef SOAKFS_DISK_CACHE_HPP
+#define SOAKFS_DISK_CACHE_HPP
+
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include "lru_cache.hpp"
+
+namespace soak {
+
+// Persistent counterpart of BlockCache. Every cached block lives in its own
+// file in <dir>/chunks, named with a sequential id, while <dir>/index keeps the
+// mapping from (path, block, file size, file mtime) to chunk ids. As in
+// BlockCache, blocks of a version of a file which changed on the server are
+// never served for another one, and age out like any other entry.
+//
+// Index format is one line per chunk, in LRU order:
+//     <id> <block> <file size> <file mtime> <chunk bytes> <path length> <path>
+class DiskCache {
+
+public:
+
+    typedef std::shared_ptr<const std::vector<char>> Block;
+
+    // a relative dir is resolved right away, as fuse changes the working
+    // directory to "/" when it daemonizes
+    DiskCache(const std::string &dir, size_t budget)
+    : m_dir(boost::filesystem::absolute(dir).string())
+    , m_chunks(budget, [this] (const ChunkKey&, Chunk &c) { m_evicted.push_back(c.id); })
+    , m_next_id(0)
+    , m_dirty(0) {
+        boost::filesystem::create_directories(chunk_dir());
+        load_index();
+    }
+
+    ~DiskCache() {
+        try {
+            flush();
+        } catch (...) {
+            // cache will be rebuilt on next mount
+        }
+    }
+
+    // returns empty pointer if the block of this version of the file is not
+    // cached
+    Block get(const std::string &path, unsigned long index, unsigned long file_size, unsigned long mtime) {
+        unsigned long id;
+        size_t bytes;
+        {
+            std::lock_guard<std::mutex> lock(m_chunks_mutex);
+            Chunk *chunk = m_chunks.find(ChunkKey { path, index, file_size, mtime });
+            if (chunk == nullptr) {
+                return Block();
+            }
+            id = chunk->id;
+            bytes = chunk->bytes;
+        }
+        // the chunk may be evicted in the meantime, which makes it a miss
+        std::ifstream in { chunk_path(id).c_str(), std::ios::binary };
+        std::shared_ptr<std::vector<char>> data { std::make_shared<std::vector<char>>(bytes) };
+        if (!in.read(data->data(), bytes)) {
+            std::vector<unsigned long> broken;
+            {
+                std::lock_guard<std::mutex> lock(m_chunks_mutex);
+                const ChunkKey key { path, index, file_size, mtime };
+                Chunk *chunk = m_chunks.find(key);
+                // unless it was replaced in the meantime
+                if (chunk != nullptr && chunk->id == id) {
+                    m_chunks.erase(key);
+                    broken.push_back(id);
+                    ++m_dirty;
+                }
+            }
+            remove_chunks(broken);
+            return Block();
+        }
+        return data;
+    }
+
+    // tells if get would most likely find the block, without reading it
+    bool contains(const std::string &path, unsigned long index, unsigned long file_size, unsigned long mtime) {
+        std::lock_guard<std::mutex> lock(m_chunks_mutex);
+        return m_chunks.contains(ChunkKey { path, index, file_size, mtime });
+    }
+
+    void put(const std::string &path, unsigned long index, unsigned long file_size, unsigned long mtime, const Block &data) {
+        if (data->size() > m_chunks.budget()) {
+            return;
+        }
+        unsigned long id;
+        {
+            std::lock_guard<std::mutex> lock(m_chunks_mutex);
+            id = m_next_id++;
+        }
+        // write to temporary file first, so that an interrupted write never
+        // leaves truncated chunk behind. Failures, e.g. a full disk, only
+        // mean the block isn't cached.
+        const std::string tmp { chunk_path(id) + ".tmp" };
+        bool written;
+        {
+            std::ofstream out { tmp.c_str(), std::ios::binary | std::ios::trunc };
+            written = static_cast<bool>(out.write(data->data(), data->size()));
+        }
+        boost::system::error_code ec;
+        if (written) {
+            boost::filesystem::rename(tmp, chunk_path(id), ec);
+        }
+        if (!written || ec) {
+            boost::filesystem::remove(tmp, ec);
+            return;
+        }
+        std::vector<unsigned long> evicted;
+        bool needs_flush;
+        {
+            std::lock_guard<std::mutex> lock(m_chunks_mutex);
+            const ChunkKey key { path, index, file_size, mtime };
+            Chunk *old = m_chunks.find(key);
+            if (old != nullptr) {
+                m_evicted.push_back(old->id);
+            }
+            m_chunks.insert(key, Chunk { id, data->size() }, chunk_cost(path, data->size()));
+            evicted.swap(m_evicted);
+            needs_flush = ++m_dirty >= FLUSH_INTERVAL;
+        }
+        remove_chunks(evicted);
+        if (needs_flush) {
+            flush();
+        }
+    }
+
+    // writes index to disk. The entries are copied first, so that lookups
+    // don't wait for the file to be written.
+    void flush() {
+        const std::lock_guard<std::mutex> flush_lock(m_flush_mutex);
+        std::vector<std::pair<ChunkKey, Chunk>> entries;
+        {
+            std::lock_guard<std::mutex> lock(m_chunks_mutex);
+            entries.reserve(m_chunks.size());
+            m_chunks.for_each([&entries] (const ChunkKey &key, const Chunk &c) {
+                entries.push_back(std::make_pair(key, c));
+            });
+            m_dirty = 0;
+        }
+        const std::string tmp { index_path() + ".tmp" };
+        bool written;
+        {
+            std::ofstream out { tmp.c_str(), std::ios::trunc };
+            for (const std::pair<ChunkKey, Chunk> &e : entries) {
+                out << e.second.id << ' ' << e.first.index << ' ' << e.first.file_size << ' ' << e.first.mtime << ' '
+                    << e.second.bytes << ' ' << e.first.path.size() << ' ' << e.first.path << '\n';
+            }
+            written = static_cast<bool>(out);
+        }
+        // the previous index stays if anything fails
+        boost::system::error_code ec;
+        if (written) {
+            boost::filesystem::rename(tmp, index_path(), ec);
+        }
+        if (!written || ec) {
+            boost::filesystem::remove(tmp, ec);
+        }
+    }
+
+private:
+
+    static const unsigned FLUSH_INTERVAL = 256;
+
+    struct ChunkKey {
+        std::string path;
+        unsigned long index;
+        unsigned long file_size;
+        unsigned long mtime;
+
+        bool operator==(const ChunkKey &other) const {
+            return index == other.index && mtime == other.mtime && file_size == other.file_size && path == other.path;
+        }
+    };
+
+    struct ChunkKeyHash {
+        size_t operator()(const ChunkKey &key) const {
+            return std::hash<std::string>()(key.path) ^ (std::hash<unsigned long>()(key.index) * 31)
+                ^ (std::hash<unsigned long>()(key.mtime) * 131);
+        }
+    };
+
+    struct Chunk {
+        unsigned long id;
+        size_t bytes;
+    };
+
+    void load_index() {
+        std::set<unsigned long> known;
+        std::ifstream in { index_path().c_str() };
+        std::string line;
+        while (std::getline(in, line)) {
+            std::istringstream fields { line };
+            unsigned long id, index, file_size, mtime;
+            size_t bytes, path_length;
+            if (!(fields >> id >> index >> file_size >> mtime >> bytes >> path_length) || fields.get() != ' ') {
+                continue;
+            }
+            std::string path(path_length, '\0');
+            if (!fields.read(&path[0], path_length)) {
+                continue;
+            }
+            boost::system::error_code ec;
+            if (boost::filesystem::file_size(chunk_path(id), ec) != bytes || ec) {
+                continue;
+            }
+            m_chunks.insert(ChunkKey { path, index, file_size, mtime }, Chunk { id, bytes }, chunk_cost(path, bytes));
+            known.insert(id);
+            m_next_id = std::max(m_next_id, id + 1);
+        }
+        // chunks which were evicted during load or are missing from the index
+        // (e.g. after a crash) would only waste space
+        for (unsigned long id : m_evicted) {
+            known.erase(id);
+        }
+        m_evicted.clear();
+        boost::filesystem::directory_iterator end;
+        for (boost::filesystem::directory_iterator iter { chunk_dir() }; iter != end; ++iter) {
+            std::istringstream name { iter->path().filename().string() };
+            unsigned long id;
+            if (!(name >> id) || !name.eof() || known.find(id) == known.end()) {
+                boost::system::error_code ec;
+                boost::filesystem::remove(iter->path(), ec);
+            }
+        }
+    }
+
+    void remove_chunks(const std::vector<unsigned long> &ids) const {
+        for (unsigned long id : ids) {
+            boost::system::error_code ec;
+            boost::filesystem::remove(chunk_path(id), ec);
+        }
+    }
+
+    static size_t chunk_cost(const std::string &path, size_t bytes) {
+        return bytes + sizeof(ChunkKey) + sizeof(Chunk) + path.size();
+    }
+
+    std::string chunk_dir() const {
+        return (boost::filesystem::path { m_dir } / "chunks").string();
+    }
+
+    std::string chunk_path(unsigned long id) const {
+        return (boost::filesystem::path { chunk_dir() } / std::to_string(id)).string();
+    }
+
+    std::string index_path() const {
+        return (boost::filesystem::path { m_dir } / "index").string();
+    }
+
+    const std::string m_dir;
+    LruCache<ChunkKey, Chunk, ChunkKeyHash> m_chunks;
+    // ids of chunks pushed out of m_chunks, whose files are still to be removed
+    std::vector<unsigned long> m_evicted;
+    unsigned long m_next_id;
+    unsigned m_dirty;
+    std::mutex m_chunks_mutex;
+    // only one index is written at a time
+    std::mutex m_flush_mutex;
+};
+
+}
+
+#endif // SOAKFS_DISK_CACHE_HPP
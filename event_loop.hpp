@@ -0,0 +1,167 @@
+/*******************************************************************************
+ * Copyright (c) 2012, Andrzej Zawadzki (azawadzki@gmail.com)
+ *
+ * soakfs is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * soakfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with soakfs; if not, see <http ://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#ifndef SOAKFS_EVENT_LOOP_HPP
+#define SOAKFS_EVENT_LOOP_HPP
+
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+namespace soak {
+
+// Readiness notifications of file descriptors, from epoll, and tasks posted by
+// other threads. The loop has no thread of its own: whoever owns it calls
+// poll() repeatedly, and everything but post() must be called from within
+// poll() or by its single caller between the calls.
+class EventLoop {
+
+public:
+
+    typedef std::function<void(uint32_t events)> handler_t;
+    typedef std::function<void()> task_t;
+
+    EventLoop()
+    : m_epoll(epoll_create1(EPOLL_CLOEXEC))
+    , m_wakeup(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {
+        if (m_epoll == -1 || m_wakeup == -1) {
+            close_fds();
+            throw std::runtime_error("unable to create event loop");
+        }
+        epoll_event event {};
+        event.events = EPOLLIN;
+        event.data.fd = m_wakeup;
+        if (epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_wakeup, &event) != 0) {
+            close_fds();
+            throw std::runtime_error("unable to create event loop");
+        }
+    }
+
+    ~EventLoop() {
+        close_fds();
+    }
+
+    // handler is called with the epoll events whenever fd is ready
+    void add(int fd, uint32_t events, handler_t handler) {
+        epoll_event event {};
+        event.events = events;
+        event.data.fd = fd;
+        if (epoll_ctl(m_epoll, EPOLL_CTL_ADD, fd, &event) != 0) {
+            throw std::runtime_error("unable to watch socket");
+        }
+        m_handlers[fd] = handler;
+    }
+
+    void modify(int fd, uint32_t events) {
+        epoll_event event {};
+        event.events = events;
+        event.data.fd = fd;
+        if (epoll_ctl(m_epoll, EPOLL_CTL_MOD, fd, &event) != 0) {
+            throw std::runtime_error("unable to watch socket");
+        }
+    }
+
+    // must be called before fd is closed
+    void remove(int fd) {
+        epoll_ctl(m_epoll, EPOLL_CTL_DEL, fd, nullptr);
+        m_handlers.erase(fd);
+    }
+
+    // runs task on the next call to poll(), waking it up if it's waiting.
+    // Can be called from any thread.
+    void post(task_t task) {
+        {
+            std::lock_guard<std::mutex> lock(m_tasks_mutex);
+            m_tasks.push_back(std::move(task));
+        }
+        const uint64_t one = 1;
+        ssize_t unused = write(m_wakeup, &one, sizeof(one));
+        (void) unused;
+    }
+
+    // runs handlers of ready descriptors and posted tasks, waiting up to
+    // timeout_ms milliseconds for any of them
+    void poll(int timeout_ms) {
+        epoll_event events[MAX_EVENTS];
+        const int n = epoll_wait(m_epoll, events, MAX_EVENTS, timeout_ms);
+        if (n < 0 && errno != EINTR) {
+            throw std::runtime_error("epoll_wait failed");
+        }
+        for (int i = 0; i < n; ++i) {
+            if (events[i].data.fd == m_wakeup) {
+                uint64_t count;
+                ssize_t unused = read(m_wakeup, &count, sizeof(count));
+                (void) unused;
+                continue;
+            }
+            // an earlier handler may have removed this one
+            const std::unordered_map<int, handler_t>::const_iterator it = m_handlers.find(events[i].data.fd);
+            if (it != m_handlers.end()) {
+                // a copy, as the handler may remove itself
+                const handler_t handler { it->second };
+                handler(events[i].events);
+            }
+        }
+        run_tasks();
+    }
+
+private:
+
+    enum {
+        MAX_EVENTS = 64
+    };
+
+    void run_tasks() {
+        std::vector<task_t> tasks;
+        {
+            std::lock_guard<std::mutex> lock(m_tasks_mutex);
+            tasks.swap(m_tasks);
+        }
+        for (const task_t &task : tasks) {
+            task();
+        }
+    }
+
+    void close_fds() {
+        if (m_epoll != -1) {
+            close(m_epoll);
+        }
+        if (m_wakeup != -1) {
+            close(m_wakeup);
+        }
+    }
+
+    EventLoop(const EventLoop&);
+    EventLoop& operator=(const EventLoop&);
+
+    const int m_epoll;
+    const int m_wakeup;
+    std::unordered_map<int, handler_t> m_handlers;
+    std::vector<task_t> m_tasks;
+    std::mutex m_tasks_mutex;
+};
+
+}
+
+#endif // SOAKFS_EVENT_LOOP_HPP
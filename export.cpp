@@ -0,0 +1,412 @@
+/*******************************************************************************
+ * Copyright (c) 2012, Andrzej Zawadzki (azawadzki@gmail.com)
+ *
+ * soakfs is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * soakfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with soakfs; if not, see <http ://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#include "soakfs_api.hpp"
+#ifdef SOAKFS_ASYNC_HTTP
+#include "async_download_policy.hpp"
+#else
+#include "sync_download_policy.hpp"
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+// Copies a subtree of the storage to local disk, talking to the server
+// directly rather than through a mount. Directories are listed by several
+// threads at once while files found so far are being downloaded, largest
+// first, so that a big file doesn't end up downloading alone at the end.
+// Files which exist locally with the same size and mtime are skipped, so an
+// interrupted run picks up where it stopped.
+
+#ifdef SOAKFS_ASYNC_HTTP
+typedef soak::DownloadPolicyAsync ExportPolicy;
+#else
+typedef soak::DownloadPolicySync ExportPolicy;
+#endif
+
+struct ExportConfig {
+    // number of persistent connections to the storage server
+    unsigned long connections { 16 };
+    // pieces of a chunk downloaded at once over separate connections, and
+    // their size, in KiB
+    unsigned long stripes { 4 };
+    unsigned long stripe_size { 4096 };
+    unsigned long request_timeout { 60 };
+    unsigned long retries { 3 };
+    // number of directories listed at once
+    unsigned long listing_threads { 8 };
+    // number of files downloaded at once
+    unsigned long threads { 8 };
+    // files are downloaded and written in pieces of this size, in MiB
+    unsigned long chunk_size { 16 };
+};
+
+template<typename DownloadPolicy>
+class Exporter {
+
+    typedef std::chrono::steady_clock clock;
+
+public:
+
+    typedef soak::Storage<DownloadPolicy> Storage;
+
+    static typename Storage::Options storage_options(const ExportConfig &config) {
+        typename Storage::Options options;
+        options.connections = config.connections;
+        options.stripes = config.stripes;
+        options.stripe_size = config.stripe_size * 1024;
+        options.requests.timeout = config.request_timeout;
+        options.requests.retries = config.retries;
+        return options;
+    }
+
+    Exporter(Storage &storage, const ExportConfig &config)
+    : m_storage(storage)
+    , m_config(config)
+    , m_listing(0)
+    , m_walk_done(false)
+    , m_finished(false)
+    , m_files_found(0)
+    , m_bytes_found(0)
+    , m_start(clock::now()) {
+
+    }
+
+    // copies remote, a directory, into local, which is created if needed.
+    // Returns the number of files and directories which failed.
+    unsigned long run(const std::string &remote, const std::string &local) {
+        m_dirs.push_back(Dir { remote, local });
+        std::vector<std::thread> threads;
+        for (unsigned long i = 0; i < std::max(m_config.listing_threads, 1ul); ++i) {
+            threads.push_back(std::thread(&Exporter::list_dirs, this));
+        }
+        for (unsigned long i = 0; i < std::max(m_config.threads, 1ul); ++i) {
+            threads.push_back(std::thread(&Exporter::download_files, this));
+        }
+        std::thread progress([this] {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            while (!m_finished_cond.wait_for(lock, std::chrono::seconds(PROGRESS_INTERVAL), [this] { return m_finished; })) {
+                report(std::cerr);
+            }
+        });
+        for (std::thread &t : threads) {
+            t.join();
+        }
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_finished = true;
+        m_finished_cond.notify_all();
+        lock.unlock();
+        progress.join();
+        lock.lock();
+        report(std::cout);
+        return m_failures.value();
+    }
+
+private:
+
+    struct Dir {
+        std::string remote;
+        std::string local;
+    };
+
+    struct Job {
+        std::string remote;
+        std::string local;
+        unsigned long size;
+        unsigned long mtime;
+
+        // largest first in a priority_queue
+        bool operator<(const Job &other) const noexcept {
+            return size < other.size;
+        }
+    };
+
+    // seconds between progress lines
+    enum {
+        PROGRESS_INTERVAL = 5
+    };
+
+    void list_dirs() {
+        for (;;) {
+            Dir dir;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_dirs_cond.wait(lock, [this] { return !m_dirs.empty() || m_listing == 0; });
+                if (m_dirs.empty()) {
+                    return;
+                }
+                dir = m_dirs.front();
+                m_dirs.pop_front();
+                ++m_listing;
+            }
+            std::vector<Dir> dirs;
+            std::vector<Job> jobs;
+            try {
+                if (mkdir(dir.local.c_str(), 0755) != 0 && errno != EEXIST) {
+                    throw std::runtime_error(dir.local + ": " + std::strerror(errno));
+                }
+                m_storage.ls(dir.remote,
+                    [this, &dir, &dirs] (const std::string &entry) {
+                        // trailing slash, used by the api to mark directories, is dropped
+                        const std::string name { entry.substr(0, entry.find_last_not_of('/') + 1) };
+                        if (valid_name(dir.remote, name)) {
+                            dirs.push_back(Dir { child(dir.remote, name), dir.local + "/" + name });
+                        }
+                    },
+                    [this, &dir, &jobs] (const soak::File &f) {
+                        if (valid_name(dir.remote, f.name)) {
+                            jobs.push_back(Job { child(dir.remote, f.name), dir.local + "/" + f.name, f.size, f.mtime });
+                        }
+                    });
+            } catch (const std::exception &e) {
+                fail(dir.remote, e.what());
+                jobs.clear();
+                dirs.clear();
+            }
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_dirs.insert(m_dirs.end(), dirs.begin(), dirs.end());
+            for (const Job &job : jobs) {
+                m_files.push(job);
+                m_bytes_found += job.size;
+            }
+            m_files_found += jobs.size();
+            --m_listing;
+            if (m_dirs.empty() && m_listing == 0) {
+                m_walk_done = true;
+            }
+            m_dirs_cond.notify_all();
+            m_files_cond.notify_all();
+        }
+    }
+
+    void download_files() {
+        std::vector<char> buffer(std::max(m_config.chunk_size, 1ul) * 1024 * 1024);
+        for (;;) {
+            Job job;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_files_cond.wait(lock, [this] { return !m_files.empty() || m_walk_done; });
+                if (m_files.empty()) {
+                    return;
+                }
+                job = m_files.top();
+                m_files.pop();
+            }
+            try {
+                export_file(job, buffer);
+            } catch (const std::exception &e) {
+                unlink(part_path(job).c_str());
+                fail(job.remote, e.what());
+            }
+        }
+    }
+
+    // downloads into a temporary file, which replaces the local one once it's
+    // complete and has the remote mtime
+    void export_file(const Job &job, std::vector<char> &buffer) {
+        struct stat st;
+        if (stat(job.local.c_str(), &st) == 0 && S_ISREG(st.st_mode)
+                && static_cast<unsigned long>(st.st_size) == job.size
+                && static_cast<unsigned long>(st.st_mtime) == job.mtime) {
+            ++m_files_skipped;
+            m_bytes_skipped.add(job.size);
+            return;
+        }
+        const std::string part { part_path(job) };
+        const int fd = open(part.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd == -1) {
+            throw std::runtime_error(part + ": " + std::strerror(errno));
+        }
+        try {
+            write_file(fd, job, buffer);
+        } catch (...) {
+            close(fd);
+            throw;
+        }
+        if (close(fd) != 0) {
+            throw std::runtime_error(part + ": " + std::strerror(errno));
+        }
+        if (rename(part.c_str(), job.local.c_str()) != 0) {
+            throw std::runtime_error(job.local + ": " + std::strerror(errno));
+        }
+        ++m_files_done;
+    }
+
+    void write_file(int fd, const Job &job, std::vector<char> &buffer) {
+        if (job.size > 0) {
+            // keeps large files from fragmenting, and fails early if they
+            // won't fit; filesystems which can't preallocate just don't
+            const int ret = posix_fallocate(fd, 0, job.size);
+            if (ret == ENOSPC) {
+                throw std::runtime_error(job.local + ": " + std::strerror(ret));
+            }
+        }
+        const std::string url { m_storage.file_url(job.remote) };
+        for (unsigned long offset = 0; offset < job.size; offset += buffer.size()) {
+            const unsigned long size = std::min<unsigned long>(buffer.size(), job.size - offset);
+            m_storage.download_url(url, buffer.data(), std::pair<long, long>(offset, offset + size - 1));
+            for (unsigned long written = 0; written < size; ) {
+                const ssize_t n = pwrite(fd, buffer.data() + written, size - written, offset + written);
+                if (n < 0 && errno != EINTR) {
+                    throw std::runtime_error(job.local + ": " + std::strerror(errno));
+                }
+                written += std::max<ssize_t>(n, 0);
+            }
+            m_bytes_done.add(size);
+        }
+        const timespec times[2] { { static_cast<time_t>(job.mtime), 0 }, { static_cast<time_t>(job.mtime), 0 } };
+        futimens(fd, times);
+    }
+
+    static std::string part_path(const Job &job) {
+        return job.local + ".soakfs-part";
+    }
+
+    static std::string child(const std::string &dir, const std::string &name) {
+        return dir.empty() || dir[dir.size() - 1] == '/' ? dir + name : dir + "/" + name;
+    }
+
+    // names which would escape the local directory are refused
+    bool valid_name(const std::string &dir, const std::string &name) {
+        if (name.empty() || name == "." || name == ".." || name.find('/') != std::string::npos) {
+            fail(child(dir, name), "invalid name");
+            return false;
+        }
+        return true;
+    }
+
+    void fail(const std::string &path, const std::string &reason) {
+        ++m_failures;
+        std::lock_guard<std::mutex> lock(m_output_mutex);
+        std::cerr << path << ": " << reason << std::endl;
+    }
+
+    // m_mutex must be held
+    void report(std::ostream &out) {
+        const double seconds = std::chrono::duration<double>(clock::now() - m_start).count();
+        const double mib = m_bytes_done.value() / (1024.0 * 1024.0);
+        std::lock_guard<std::mutex> lock(m_output_mutex);
+        out << std::fixed << std::setprecision(1)
+            << "files " << m_files_done.value() + m_files_skipped.value() << "/" << m_files_found
+            << (m_walk_done ? "" : "+")
+            << " (" << m_files_skipped.value() << " skipped, " << m_failures.value() << " failed)  "
+            << mib << "/" << (m_bytes_found - m_bytes_skipped.value()) / (1024.0 * 1024.0) << " MiB  "
+            << (seconds > 0 ? mib / seconds : 0) << " MiB/s" << std::endl;
+    }
+
+    Storage &m_storage;
+    const ExportConfig m_config;
+
+    // directories waiting to be listed and files waiting to be downloaded
+    std::mutex m_mutex;
+    std::condition_variable m_dirs_cond;
+    std::condition_variable m_files_cond;
+    std::condition_variable m_finished_cond;
+    std::deque<Dir> m_dirs;
+    std::priority_queue<Job> m_files;
+    unsigned long m_listing;
+    bool m_walk_done;
+    bool m_finished;
+    unsigned long m_files_found;
+    unsigned long long m_bytes_found;
+
+    soak::Counter m_files_done;
+    soak::Counter m_files_skipped;
+    soak::Counter m_bytes_done;
+    soak::Counter m_bytes_skipped;
+    soak::Counter m_failures;
+    std::mutex m_output_mutex;
+    const clock::time_point m_start;
+};
+
+static bool parse_args(int argc, char *argv[], ExportConfig &config, std::vector<std::string> &paths) {
+    const struct {
+        const char *name;
+        unsigned long *value;
+    } numbers[] = {
+        { "connections", &config.connections },
+        { "stripes", &config.stripes },
+        { "stripe_size", &config.stripe_size },
+        { "request_timeout", &config.request_timeout },
+        { "retries", &config.retries },
+        { "listing_threads", &config.listing_threads },
+        { "threads", &config.threads },
+        { "chunk_size", &config.chunk_size },
+    };
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg { argv[i] };
+        const size_t eq = arg.find('=');
+        if (eq == std::string::npos) {
+            paths.push_back(arg);
+            continue;
+        }
+        const std::string key { arg.substr(0, eq) };
+        bool known = false;
+        for (const auto &n : numbers) {
+            if (key == n.name) {
+                *n.value = std::strtoul(arg.c_str() + eq + 1, nullptr, 10);
+                known = true;
+            }
+        }
+        if (!known) {
+            std::cerr << "unknown argument " << arg << std::endl;
+            return false;
+        }
+    }
+    return paths.size() == 2 && config.chunk_size > 0;
+}
+
+int main(int argc, char *argv[]) {
+    ExportConfig config;
+    std::vector<std::string> paths;
+    if (!parse_args(argc, argv, config, paths)) {
+        std::cerr << "usage: " << argv[0] << " [key=value...] <remote directory> <local directory>" << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::string username;
+    std::cout << "Username: ";
+    std::cin >> username;
+    std::string password { getpass("Password: ") };
+    try {
+        typedef Exporter<ExportPolicy> ExportPolicyExporter;
+        ExportPolicyExporter::Storage storage { username, password, ExportPolicyExporter::storage_options(config) };
+        storage.start();
+        ExportPolicyExporter exporter { storage, config };
+        return exporter.run(paths[0], paths[1]) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    } catch (const soak::AuthException&) {
+        std::cerr << "Unable to login" << std::endl;
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+    }
+    return EXIT_FAILURE;
+}
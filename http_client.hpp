@@ -0,0 +1,433 @@
+/*******************************************************************************
+ * Copyright (c) 2012, Andrzej Zawadzki (azawadzki@gmail.com)
+ *
+ * soakfs is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * soakfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with soakfs; if not, see <http ://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#ifndef SOAKFS_HTTP_CLIENT_HPP
+#define SOAKFS_HTTP_CLIENT_HPP
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include <pthread.h>
+#include <signal.h>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+
+#include "soakfs_api.hpp"
+
+// Pieces of HTTP/1.1 over TLS shared by the transports, which own their
+// sockets so that they can give up on requests the server stopped answering.
+
+namespace soak {
+
+
+// Parses an HTTP/1.1 response as it arrives, passing the body of successful
+// responses on to a sink.
+class HttpResponseParser {
+
+public:
+
+    HttpResponseParser() {
+        reset();
+    }
+
+    void reset() {
+        m_head.clear();
+        m_line.clear();
+        m_head_done = false;
+        m_complete = false;
+        m_status = 0;
+        m_keep_alive = false;
+        m_encoding.clear();
+        m_body = NONE;
+        m_chunk = SIZE;
+        m_remaining = 0;
+    }
+
+    // returns the number of bytes used; the rest, if any, doesn't belong to
+    // the response
+    size_t feed(const char *data, size_t size, const Sink &sink) {
+        size_t used = 0;
+        while (used < size && !m_complete) {
+            if (!m_head_done) {
+                used += feed_head(data + used, size - used);
+                continue;
+            }
+            if (m_body == CHUNKED && m_chunk != DATA) {
+                used += feed_line(data + used, size - used);
+                continue;
+            }
+            size_t n = size - used;
+            if (m_body != UNTIL_CLOSE) {
+                n = std::min<unsigned long long>(n, m_remaining);
+                m_remaining -= n;
+            }
+            if (successful()) {
+                sink(data + used, n);
+            }
+            used += n;
+            if (m_body != UNTIL_CLOSE && m_remaining == 0) {
+                if (m_body == CHUNKED) {
+                    m_chunk = DATA_END;
+                } else {
+                    m_complete = true;
+                }
+            }
+        }
+        return used;
+    }
+
+    // to be called when the server closes the connection
+    void on_close() {
+        if (m_head_done && m_body == UNTIL_CLOSE) {
+            m_complete = true;
+        }
+    }
+
+    bool complete() const noexcept {
+        return m_complete;
+    }
+
+    int status() const noexcept {
+        return m_status;
+    }
+
+    bool successful() const noexcept {
+        return m_status >= 200 && m_status < 300;
+    }
+
+    // tells if the connection can be used for another request
+    bool keep_alive() const noexcept {
+        return m_keep_alive;
+    }
+
+    // lowercase, empty if the response named none
+    const std::string& content_encoding() const noexcept {
+        return m_encoding;
+    }
+
+private:
+
+    enum Body {
+        NONE,
+        LENGTH,
+        CHUNKED,
+        UNTIL_CLOSE
+    };
+
+    enum Chunk {
+        SIZE,
+        DATA,
+        DATA_END,
+        TRAILER
+    };
+
+    // headers and chunk size lines longer than that are rejected
+    static const size_t MAX_HEAD = 64 * 1024;
+
+    size_t feed_head(const char *data, size_t size) {
+        const size_t before = m_head.size();
+        m_head.append(data, size);
+        const size_t end = m_head.find("\r\n\r\n", before >= 3 ? before - 3 : 0);
+        if (end == std::string::npos) {
+            if (m_head.size() > MAX_HEAD) {
+                throw std::runtime_error("response headers too long");
+            }
+            return size;
+        }
+        m_head.resize(end + 4);
+        parse_head();
+        const size_t used = end + 4 - before;
+        if (m_status >= 100 && m_status < 200) {
+            // interim response, the real one follows
+            reset();
+        }
+        return used;
+    }
+
+    void parse_head() {
+        const size_t line_end = m_head.find("\r\n");
+        const std::string status_line { m_head.substr(0, line_end) };
+        if (status_line.compare(0, 5, "HTTP/") != 0 || status_line.size() < 12) {
+            throw std::runtime_error("malformed response");
+        }
+        m_status = std::atoi(status_line.c_str() + 9);
+        m_keep_alive = status_line.compare(0, 8, "HTTP/1.0") != 0;
+        bool chunked = false;
+        bool has_length = false;
+        unsigned long long length = 0;
+        for (size_t begin = line_end + 2; begin < m_head.size(); ) {
+            const size_t end = m_head.find("\r\n", begin);
+            const size_t colon = m_head.find(':', begin);
+            if (colon != std::string::npos && colon < end) {
+                const std::string name { lowercase(m_head.substr(begin, colon - begin)) };
+                const std::string value { lowercase(trim(m_head.substr(colon + 1, end - colon - 1))) };
+                if (name == "content-length") {
+                    has_length = true;
+                    length = std::strtoull(value.c_str(), nullptr, 10);
+                } else if (name == "transfer-encoding") {
+                    chunked = value.find("chunked") != std::string::npos;
+                } else if (name == "content-encoding") {
+                    m_encoding = value;
+                } else if (name == "connection") {
+                    if (value.find("close") != std::string::npos) {
+                        m_keep_alive = false;
+                    } else if (value.find("keep-alive") != std::string::npos) {
+                        m_keep_alive = true;
+                    }
+                }
+            }
+            begin = end + 2;
+        }
+        m_head_done = true;
+        if (m_status == 204 || m_status == 304 || (m_status >= 100 && m_status < 200)) {
+            m_complete = m_status >= 200;
+        } else if (chunked) {
+            m_body = CHUNKED;
+        } else if (has_length) {
+            m_body = LENGTH;
+            m_remaining = length;
+            m_complete = length == 0;
+        } else {
+            m_body = UNTIL_CLOSE;
+            m_keep_alive = false;
+        }
+    }
+
+    // chunk sizes, chunk terminators and trailers
+    size_t feed_line(const char *data, size_t size) {
+        const char *newline = static_cast<const char*>(std::memchr(data, '\n', size));
+        if (newline == nullptr) {
+            m_line.append(data, size);
+            if (m_line.size() > MAX_HEAD) {
+                throw std::runtime_error("malformed chunked response");
+            }
+            return size;
+        }
+        m_line.append(data, newline - data);
+        if (!m_line.empty() && *m_line.rbegin() == '\r') {
+            m_line.resize(m_line.size() - 1);
+        }
+        switch (m_chunk) {
+        case SIZE: {
+            char *end;
+            m_remaining = std::strtoull(m_line.c_str(), &end, 16);
+            if (end == m_line.c_str()) {
+                throw std::runtime_error("malformed chunked response");
+            }
+            m_chunk = m_remaining == 0 ? TRAILER : DATA;
+            break;
+        }
+        case DATA_END:
+            m_chunk = SIZE;
+            break;
+        case TRAILER:
+            m_complete = m_line.empty();
+            break;
+        case DATA:
+            break;
+        }
+        m_line.clear();
+        return newline - data + 1;
+    }
+
+    static std::string lowercase(std::string s) {
+        for (char &c : s) {
+            if (c >= 'A' && c <= 'Z') {
+                c += 'a' - 'A';
+            }
+        }
+        return s;
+    }
+
+    static std::string trim(const std::string &s) {
+        const size_t begin = s.find_first_not_of(" \t");
+        const size_t end = s.find_last_not_of(" \t");
+        return begin == std::string::npos ? std::string() : s.substr(begin, end - begin + 1);
+    }
+
+    std::string m_head;
+    std::string m_line;
+    bool m_head_done;
+    bool m_complete;
+    int m_status;
+    bool m_keep_alive;
+    std::string m_encoding;
+    Body m_body;
+    Chunk m_chunk;
+    unsigned long long m_remaining;
+};
+
+// server and path of a url
+struct HttpTarget {
+    bool tls;
+    std::string host;
+    std::string port;
+    // host and port as given in the url
+    std::string authority;
+    std::string path;
+
+    std::string key() const {
+        return (tls ? "https://" : "http://") + host + ":" + port;
+    }
+};
+
+inline HttpTarget parse_http_url(const std::string &url) {
+    HttpTarget target;
+    size_t start;
+    if (url.compare(0, 8, "https://") == 0) {
+        target.tls = true;
+        start = 8;
+    } else if (url.compare(0, 7, "http://") == 0) {
+        target.tls = false;
+        start = 7;
+    } else {
+        throw std::invalid_argument(url + ": unsupported url");
+    }
+    const size_t slash = url.find('/', start);
+    target.authority = url.substr(start, slash == std::string::npos ? std::string::npos : slash - start);
+    target.path = slash == std::string::npos ? "/" : url.substr(slash);
+    const size_t colon = target.authority.rfind(':');
+    target.host = target.authority.substr(0, colon);
+    target.port = colon == std::string::npos ? (target.tls ? "443" : "80") : target.authority.substr(colon + 1);
+    return target;
+}
+
+// request line and headers of a GET. Listings are requested compressed,
+// which makes them several times smaller. File contents are not, so that
+// ranges keep their offsets.
+inline std::string http_request_head(const HttpTarget &target, const std::string &auth, std::pair<long, long> range, bool listing) {
+    std::string head;
+    head.reserve(256 + target.path.size());
+    head += "GET " + target.path + " HTTP/1.1\r\n";
+    head += "Host: " + target.authority + "\r\n";
+    head += "Authorization: " + auth + "\r\n";
+    if (range.first != UNINITIALIZED || range.second != UNINITIALIZED) {
+        head += "Range: bytes=";
+        if (range.first != UNINITIALIZED) {
+            head += std::to_string(range.first);
+        }
+        head += "-";
+        if (range.second != UNINITIALIZED) {
+            head += std::to_string(range.second);
+        }
+        head += "\r\n";
+    }
+    if (listing) {
+        head += "Accept-Encoding: gzip, deflate\r\n";
+    }
+    head += "\r\n";
+    return head;
+}
+
+inline void check_http_status(const std::string &url, int status) {
+    if (status == 401) {
+        throw AuthException();
+    }
+    if (status == 404) {
+        throw NotFoundException(url);
+    }
+    if (status < 200 || status >= 300) {
+        throw HttpStatusException(url, status);
+    }
+}
+
+// verifies servers against the system's trusted certificates
+inline SSL_CTX* create_tls_context() {
+    SSL_library_init();
+    SSL_load_error_strings();
+    SSL_CTX *ctx = SSL_CTX_new(SSLv23_client_method());
+    if (ctx == nullptr) {
+        throw std::runtime_error("unable to create TLS context");
+    }
+    SSL_CTX_set_options(ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3 | SSL_OP_NO_COMPRESSION);
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, nullptr);
+    if (SSL_CTX_set_default_verify_paths(ctx) != 1) {
+        SSL_CTX_free(ctx);
+        throw std::runtime_error("unable to load trusted certificates");
+    }
+    return ctx;
+}
+
+// TLS connection to host over fd, which must already be connected. The
+// handshake is left to the caller.
+inline SSL* create_tls_connection(SSL_CTX *ctx, int fd, const std::string &host) {
+    SSL *ssl = SSL_new(ctx);
+    if (ssl == nullptr || SSL_set_fd(ssl, fd) != 1) {
+        if (ssl != nullptr) {
+            SSL_free(ssl);
+        }
+        throw std::runtime_error("unable to create TLS connection");
+    }
+    SSL_set_tlsext_host_name(ssl, const_cast<char*>(host.c_str()));
+    X509_VERIFY_PARAM_set1_host(SSL_get0_param(ssl), host.c_str(), 0);
+    return ssl;
+}
+
+inline std::string tls_error() {
+    char message[256];
+    ERR_error_string_n(ERR_get_error(), message, sizeof(message));
+    return message;
+}
+
+// blocks SIGPIPE, raised by writes to connections closed by the server,
+// for the lifetime of the object. OpenSSL writes to sockets on its own,
+// so MSG_NOSIGNAL isn't enough. A SIGPIPE raised in the meantime is
+// consumed.
+class SigpipeGuard {
+
+public:
+
+    SigpipeGuard() {
+        sigemptyset(&m_sigpipe);
+        sigaddset(&m_sigpipe, SIGPIPE);
+        sigset_t pending;
+        sigpending(&pending);
+        m_was_pending = sigismember(&pending, SIGPIPE) == 1;
+        pthread_sigmask(SIG_BLOCK, &m_sigpipe, &m_previous);
+    }
+
+    ~SigpipeGuard() {
+        if (!m_was_pending) {
+            sigset_t pending;
+            sigpending(&pending);
+            if (sigismember(&pending, SIGPIPE) == 1) {
+                const timespec zero { 0, 0 };
+                sigtimedwait(&m_sigpipe, nullptr, &zero);
+            }
+        }
+        pthread_sigmask(SIG_SETMASK, &m_previous, nullptr);
+    }
+
+private:
+
+    SigpipeGuard(const SigpipeGuard&);
+    SigpipeGuard& operator=(const SigpipeGuard&);
+
+    sigset_t m_sigpipe;
+    sigset_t m_previous;
+    bool m_was_pending;
+};
+
+}
+
+#endif // SOAKFS_HTTP_CLIENT_HPP
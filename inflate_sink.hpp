@@ -0,0 +1,175 @@
+/*******************************************************************************
+ * Copyright (c) 2012, Andrzej Zawadzki (azawadzki@gmail.com)
+ *
+ * soakfs is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * soakfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with soakfs; if not, see <http ://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#ifndef SOAKFS_INFLATE_SINK_HPP
+#define SOAKFS_INFLATE_SINK_HPP
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <stdexcept>
+#include <string>
+
+#include <zlib.h>
+
+namespace soak {
+
+// Decompresses a response body on the fly, passing the result on to another
+// sink. How the body is encoded is asked for once it starts to arrive, that
+// is after the headers were parsed: gzip and deflate are decoded, identity is
+// passed through and anything else is refused. Servers disagree on what
+// deflate means, so a zlib stream is expected and a raw one accepted.
+class InflateSink {
+
+public:
+
+    typedef std::function<void(const char *data, size_t size)> sink_t;
+    // returns the Content-Encoding of the response
+    typedef std::function<std::string()> encoding_t;
+
+    InflateSink(const sink_t &sink, const encoding_t &encoding)
+    : m_sink(sink)
+    , m_encoding(encoding)
+    , m_state(WAITING)
+    , m_gzip(false)
+    , m_header_size(0) {
+        std::memset(&m_stream, 0, sizeof(m_stream));
+    }
+
+    ~InflateSink() {
+        if (m_state == INFLATING || m_state == FINISHED) {
+            inflateEnd(&m_stream);
+        }
+    }
+
+    void operator()(const char *data, size_t size) {
+        if (m_state == WAITING) {
+            start(m_encoding());
+        }
+        if (m_state == DEFLATE_HEADER) {
+            // the header may be split between chunks
+            const size_t n = std::min(size, sizeof(m_header) - m_header_size);
+            std::memcpy(m_header + m_header_size, data, n);
+            m_header_size += n;
+            if (m_header_size < sizeof(m_header)) {
+                return;
+            }
+            // a zlib header: deflate method, window of at most 32 KiB and a
+            // check sum of both bytes divisible by 31
+            const unsigned char b0 = m_header[0];
+            const unsigned char b1 = m_header[1];
+            const bool zlib = (b0 & 0x0f) == 8 && (b0 >> 4) <= 7 && ((b0 << 8) | b1) % 31 == 0;
+            init(zlib ? MAX_WBITS : -MAX_WBITS);
+            feed(m_header, m_header_size);
+            data += n;
+            size -= n;
+        }
+        feed(data, size);
+    }
+
+    // to be called once the whole body was received
+    void finish() {
+        if (m_state == INFLATING || (m_state == DEFLATE_HEADER && m_header_size > 0)) {
+            throw std::runtime_error("truncated compressed response");
+        }
+    }
+
+private:
+
+    enum State {
+        WAITING,
+        PLAIN,
+        DEFLATE_HEADER,
+        INFLATING,
+        FINISHED
+    };
+
+    void start(const std::string &encoding) {
+        if (encoding.empty() || encoding == "identity") {
+            m_state = PLAIN;
+        } else if (encoding == "gzip" || encoding == "x-gzip") {
+            m_gzip = true;
+            // 16 added to the window size expects a gzip header
+            init(16 + MAX_WBITS);
+        } else if (encoding == "deflate") {
+            m_state = DEFLATE_HEADER;
+        } else {
+            throw std::runtime_error("unsupported content encoding: " + encoding);
+        }
+    }
+
+    void init(int window_bits) {
+        if (inflateInit2(&m_stream, window_bits) != Z_OK) {
+            throw std::runtime_error("unable to initialize zlib");
+        }
+        m_state = INFLATING;
+    }
+
+    void feed(const char *data, size_t size) {
+        if (m_state == PLAIN) {
+            if (size > 0) {
+                m_sink(data, size);
+            }
+            return;
+        }
+        m_stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+        m_stream.avail_in = size;
+        while (m_stream.avail_in > 0) {
+            if (m_state == FINISHED) {
+                if (!m_gzip) {
+                    throw std::runtime_error("corrupted compressed response");
+                }
+                // another gzip member follows
+                if (inflateReset(&m_stream) != Z_OK) {
+                    throw std::runtime_error("unable to reset zlib");
+                }
+                m_state = INFLATING;
+            }
+            m_stream.next_out = reinterpret_cast<Bytef*>(m_out);
+            m_stream.avail_out = sizeof(m_out);
+            const int ret = inflate(&m_stream, Z_NO_FLUSH);
+            if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+                throw std::runtime_error("corrupted compressed response");
+            }
+            const size_t produced = sizeof(m_out) - m_stream.avail_out;
+            if (produced > 0) {
+                m_sink(m_out, produced);
+            }
+            if (ret == Z_STREAM_END) {
+                m_state = FINISHED;
+            } else if (ret == Z_BUF_ERROR && produced == 0) {
+                // no progress is possible without more input
+                break;
+            }
+        }
+    }
+
+    InflateSink(const InflateSink&);
+    InflateSink& operator=(const InflateSink&);
+
+    sink_t m_sink;
+    encoding_t m_encoding;
+    State m_state;
+    bool m_gzip;
+    z_stream m_stream;
+    char m_header[2];
+    size_t m_header_size;
+    char m_out[16 * 1024];
+};
+
+}
+
+#endif // SOAKFS_INFLATE_SINK_HPP
@@ -0,0 +1,100 @@
+/*******************************************************************************
+ * Copyright (c) 2012, Andrzej Zawadzki (azawadzki@gmail.com)
+ *
+ * soakfs is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * soakfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with soakfs; if not, see <http ://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#ifndef SOAKFS_INODE_TABLE_HPP
+#define SOAKFS_INODE_TABLE_HPP
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace soak {
+
+// Inode numbers handed to the kernel by the low level fuse frontend. An inode
+// lives for as long as the kernel holds lookups of it; afterwards the same
+// path may get a different number.
+class InodeTable {
+
+public:
+
+    enum : uint64_t {
+        ROOT = 1
+    };
+
+    InodeTable()
+    : m_next(ROOT + 1) {
+        // root is never forgotten
+        m_inodes[ROOT] = Inode { "/", 1 };
+        m_numbers["/"] = ROOT;
+    }
+
+    // returns inode number of path, assigning one if needed, and counts the
+    // lookup
+    uint64_t lookup(const std::string &path) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto iter = m_numbers.find(path);
+        if (iter != m_numbers.end()) {
+            ++m_inodes[iter->second].lookups;
+            return iter->second;
+        }
+        const uint64_t ino = m_next++;
+        m_inodes[ino] = Inode { path, 1 };
+        m_numbers[path] = ino;
+        return ino;
+    }
+
+    // returns false if there's no such inode
+    bool path(uint64_t ino, std::string &path) const {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto iter = m_inodes.find(ino);
+        if (iter == m_inodes.end()) {
+            return false;
+        }
+        path = iter->second.path;
+        return true;
+    }
+
+    void forget(uint64_t ino, uint64_t lookups) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto iter = m_inodes.find(ino);
+        if (iter == m_inodes.end() || ino == ROOT) {
+            return;
+        }
+        if (iter->second.lookups > lookups) {
+            iter->second.lookups -= lookups;
+            return;
+        }
+        m_numbers.erase(iter->second.path);
+        m_inodes.erase(iter);
+    }
+
+private:
+
+    struct Inode {
+        std::string path;
+        uint64_t lookups;
+    };
+
+    uint64_t m_next;
+    std::unordered_map<uint64_t, Inode> m_inodes;
+    std::unordered_map<std::string, uint64_t> m_numbers;
+    mutable std::mutex m_mutex;
+};
+
+}
+
+#endif // SOAKFS_INODE_TABLE_HPP
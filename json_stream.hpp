@@ -0,0 +1,355 @@
+/*******************************************************************************
+ * Copyright (c) 2012, Andrzej Zawadzki (azawadzki@gmail.com)
+ *
+ * soakfs is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * soakfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with soakfs; if not, see <http ://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#ifndef SOAKFS_JSON_STREAM_HPP
+#define SOAKFS_JSON_STREAM_HPP
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace soak {
+
+class JsonException : public std::runtime_error {
+
+public:
+
+    JsonException(const std::string &what)
+    : std::runtime_error("malformed json: " + what) {
+
+    }
+};
+
+// Receives events from JsonStreamParser. Strings are passed unescaped;
+// numbers and literals (true, false, null) are passed as they appear in the
+// document.
+class JsonHandler {
+
+public:
+
+    enum ValueType {
+        STRING,
+        NUMBER,
+        LITERAL
+    };
+
+    virtual ~JsonHandler() {
+
+    }
+
+    virtual void start_object() = 0;
+    virtual void end_object() = 0;
+    virtual void start_array() = 0;
+    virtual void end_array() = 0;
+    virtual void key(const std::string &name) = 0;
+    virtual void value(const std::string &value, ValueType type) = 0;
+};
+
+// Incremental, event based JSON parser. The document can be fed in pieces
+// split at arbitrary points, so it can be parsed while it's still being
+// downloaded, and no tree of the whole document is ever built.
+class JsonStreamParser {
+
+public:
+
+    explicit JsonStreamParser(JsonHandler &handler)
+    : m_handler(handler)
+    , m_state(VALUE)
+    , m_string_is_key(false)
+    , m_unicode(0)
+    , m_unicode_digits(0)
+    , m_high_surrogate(0) {
+
+    }
+
+    void feed(const char *data, size_t size) {
+        for (size_t i = 0; i < size; ++i) {
+            consume(data[i]);
+        }
+    }
+
+    // throws if the document is incomplete
+    void finish() {
+        if (m_state == NUMBER || m_state == LITERAL) {
+            end_scalar();
+        }
+        if (m_state != AFTER_VALUE || !m_stack.empty()) {
+            throw JsonException("unexpected end of document");
+        }
+        m_state = DONE;
+    }
+
+private:
+
+    static const size_t MAX_DEPTH = 512;
+
+    enum State {
+        VALUE,
+        FIRST_VALUE_OR_END,
+        FIRST_KEY_OR_END,
+        KEY,
+        COLON,
+        AFTER_VALUE,
+        STRING,
+        ESCAPE,
+        UNICODE,
+        NUMBER,
+        LITERAL,
+        DONE
+    };
+
+    static bool is_space(char c) noexcept {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+    }
+
+    void consume(char c) {
+        switch (m_state) {
+            case STRING:
+                if (c == '"') {
+                    end_string();
+                } else if (c == '\\') {
+                    m_state = ESCAPE;
+                } else {
+                    m_token += c;
+                }
+                return;
+            case ESCAPE:
+                unescape(c);
+                return;
+            case UNICODE:
+                unicode_digit(c);
+                return;
+            case NUMBER:
+                if ((c >= '0' && c <= '9') || c == '.' || c == 'e' || c == 'E' || c == '+' || c == '-') {
+                    m_token += c;
+                    return;
+                }
+                end_scalar();
+                break;
+            case LITERAL:
+                if (c >= 'a' && c <= 'z') {
+                    m_token += c;
+                    return;
+                }
+                end_scalar();
+                break;
+            default:
+                break;
+        }
+        if (is_space(c)) {
+            return;
+        }
+        switch (m_state) {
+            case FIRST_VALUE_OR_END:
+                if (c == ']') {
+                    close(']');
+                    return;
+                }
+                // fall through
+            case VALUE:
+                start_value(c);
+                return;
+            case FIRST_KEY_OR_END:
+                if (c == '}') {
+                    close('}');
+                    return;
+                }
+                // fall through
+            case KEY:
+                if (c != '"') {
+                    throw JsonException("expected object key");
+                }
+                m_string_is_key = true;
+                m_state = STRING;
+                return;
+            case COLON:
+                if (c != ':') {
+                    throw JsonException("expected ':'");
+                }
+                m_state = VALUE;
+                return;
+            case AFTER_VALUE:
+                if (m_stack.empty()) {
+                    throw JsonException("trailing data");
+                }
+                if (c == ',') {
+                    m_state = m_stack.back() == '{' ? KEY : VALUE;
+                } else if (c == '}' || c == ']') {
+                    close(c);
+                } else {
+                    throw JsonException("expected ',' or end of container");
+                }
+                return;
+            default:
+                throw JsonException("trailing data");
+        }
+    }
+
+    void start_value(char c) {
+        m_token.clear();
+        if (c == '{' || c == '[') {
+            if (m_stack.size() >= MAX_DEPTH) {
+                throw JsonException("nested too deeply");
+            }
+            m_stack.push_back(c);
+            if (c == '{') {
+                m_state = FIRST_KEY_OR_END;
+                m_handler.start_object();
+            } else {
+                m_state = FIRST_VALUE_OR_END;
+                m_handler.start_array();
+            }
+        } else if (c == '"') {
+            m_string_is_key = false;
+            m_state = STRING;
+        } else if (c == '-' || (c >= '0' && c <= '9')) {
+            m_token += c;
+            m_state = NUMBER;
+        } else if (c == 't' || c == 'f' || c == 'n') {
+            m_token += c;
+            m_state = LITERAL;
+        } else {
+            throw JsonException("unexpected character");
+        }
+    }
+
+    void close(char c) {
+        const char open = c == '}' ? '{' : '[';
+        if (m_stack.empty() || m_stack.back() != open) {
+            throw JsonException("mismatched brackets");
+        }
+        m_stack.pop_back();
+        m_state = AFTER_VALUE;
+        if (c == '}') {
+            m_handler.end_object();
+        } else {
+            m_handler.end_array();
+        }
+    }
+
+    void end_string() {
+        if (m_high_surrogate != 0) {
+            append_utf8(0xfffd);
+            m_high_surrogate = 0;
+        }
+        if (m_string_is_key) {
+            m_state = COLON;
+            m_handler.key(m_token);
+        } else {
+            m_state = AFTER_VALUE;
+            m_handler.value(m_token, JsonHandler::STRING);
+        }
+        m_token.clear();
+    }
+
+    void end_scalar() {
+        if (m_state == LITERAL && m_token != "true" && m_token != "false" && m_token != "null") {
+            throw JsonException("unknown literal " + m_token);
+        }
+        const JsonHandler::ValueType type = m_state == NUMBER ? JsonHandler::NUMBER : JsonHandler::LITERAL;
+        m_state = AFTER_VALUE;
+        m_handler.value(m_token, type);
+        m_token.clear();
+    }
+
+    void unescape(char c) {
+        m_state = STRING;
+        switch (c) {
+            case '"': m_token += '"'; break;
+            case '\\': m_token += '\\'; break;
+            case '/': m_token += '/'; break;
+            case 'b': m_token += '\b'; break;
+            case 'f': m_token += '\f'; break;
+            case 'n': m_token += '\n'; break;
+            case 'r': m_token += '\r'; break;
+            case 't': m_token += '\t'; break;
+            case 'u':
+                m_state = UNICODE;
+                m_unicode = 0;
+                m_unicode_digits = 0;
+                break;
+            default:
+                throw JsonException("invalid escape sequence");
+        }
+    }
+
+    void unicode_digit(char c) {
+        uint32_t digit;
+        if (c >= '0' && c <= '9') {
+            digit = c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            digit = c - 'a' + 10;
+        } else if (c >= 'A' && c <= 'F') {
+            digit = c - 'A' + 10;
+        } else {
+            throw JsonException("invalid unicode escape");
+        }
+        m_unicode = m_unicode * 16 + digit;
+        if (++m_unicode_digits < 4) {
+            return;
+        }
+        m_state = STRING;
+        if (m_unicode >= 0xd800 && m_unicode < 0xdc00) {
+            // high half of a surrogate pair; wait for the low one
+            if (m_high_surrogate != 0) {
+                append_utf8(0xfffd);
+            }
+            m_high_surrogate = m_unicode;
+        } else if (m_unicode >= 0xdc00 && m_unicode < 0xe000 && m_high_surrogate != 0) {
+            append_utf8(0x10000 + ((m_high_surrogate - 0xd800) << 10) + (m_unicode - 0xdc00));
+            m_high_surrogate = 0;
+        } else {
+            if (m_high_surrogate != 0) {
+                append_utf8(0xfffd);
+                m_high_surrogate = 0;
+            }
+            append_utf8(m_unicode);
+        }
+    }
+
+    void append_utf8(uint32_t cp) {
+        if (cp < 0x80) {
+            m_token += static_cast<char>(cp);
+        } else if (cp < 0x800) {
+            m_token += static_cast<char>(0xc0 | (cp >> 6));
+            m_token += static_cast<char>(0x80 | (cp & 0x3f));
+        } else if (cp < 0x10000) {
+            m_token += static_cast<char>(0xe0 | (cp >> 12));
+            m_token += static_cast<char>(0x80 | ((cp >> 6) & 0x3f));
+            m_token += static_cast<char>(0x80 | (cp & 0x3f));
+        } else {
+            m_token += static_cast<char>(0xf0 | (cp >> 18));
+            m_token += static_cast<char>(0x80 | ((cp >> 12) & 0x3f));
+            m_token += static_cast<char>(0x80 | ((cp >> 6) & 0x3f));
+            m_token += static_cast<char>(0x80 | (cp & 0x3f));
+        }
+    }
+
+    JsonHandler &m_handler;
+    State m_state;
+    // '{' and '[' of currently open containers
+    std::vector<char> m_stack;
+    std::string m_token;
+    bool m_string_is_key;
+    uint32_t m_unicode;
+    unsigned m_unicode_digits;
+    uint32_t m_high_surrogate;
+};
+
+}
+
+#endif // SOAKFS_JSON_STREAM_HPP
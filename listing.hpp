@@ -0,0 +1,374 @@
+/*******************************************************************************
+ * Copyright (c) 2012, Andrzej Zawadzki (azawadzki@gmail.com)
+ *
+ * soakfs is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * soakfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with soakfs; if not, see <http ://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#ifndef SOAKFS_LISTING_HPP
+#define SOAKFS_LISTING_HPP
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace soak {
+
+// Contents of a single directory, stored column-wise to keep huge listings
+// small and fast to scan: names are packed into a single arena and the other
+// attributes into arrays indexed by entry number, with no allocation per
+// entry. Entries are indexed by name with an open addressing hash table built
+// once, after the last entry is added, so that lookups take constant time and
+// don't allocate.
+class Listing {
+
+public:
+
+    // view of a single entry, valid for as long as the listing isn't modified
+    // or destroyed
+    struct Entry {
+        // NUL terminated
+        const char *name;
+        size_t name_length;
+        bool dir;
+        // meaningful for files only
+        unsigned long size;
+        unsigned long ctime;
+        unsigned long mtime;
+    };
+
+    // trailing slash, used by the api to mark directories, is dropped
+    void add_dir(const std::string &name) {
+        size_t length = name.size();
+        if (length > 0 && name[length - 1] == '/') {
+            --length;
+        }
+        add(name.data(), length, DIR_SIZE, 0, 0);
+    }
+
+    void add_file(const std::string &name, unsigned long size, unsigned long ctime, unsigned long mtime) {
+        add(name.data(), name.size(), size, ctime, mtime);
+    }
+
+    // must be called after all entries are added and before any lookup.
+    // Spare capacity left after adding is released.
+    void build_index() {
+        size_t slots = 8;
+        while (slots < count() * 2) {
+            slots *= 2;
+        }
+        m_slots.assign(slots, EMPTY);
+        for (uint32_t i = 0; i < count(); ++i) {
+            uint32_t &slot = m_slots[find_slot(name(i), name_length(i))];
+            if (slot == EMPTY) {
+                // in the unlikely case of duplicated names first entry wins
+                slot = i;
+            }
+        }
+        m_names.shrink_to_fit();
+        m_name_offsets.shrink_to_fit();
+        m_sizes.shrink_to_fit();
+        m_ctimes.shrink_to_fit();
+        m_mtimes.shrink_to_fit();
+    }
+
+    // returns false if there's no such entry
+    bool find(const char *name, size_t length, Entry &entry) const {
+        if (m_slots.empty()) {
+            return false;
+        }
+        const uint32_t slot = m_slots[find_slot(name, length)];
+        if (slot == EMPTY) {
+            return false;
+        }
+        entry = this->entry(slot);
+        return true;
+    }
+
+    bool find(const std::string &name, Entry &entry) const {
+        return find(name.data(), name.size(), entry);
+    }
+
+    size_t count() const noexcept {
+        return m_name_offsets.size();
+    }
+
+    Entry entry(size_t i) const {
+        const bool dir = m_sizes[i] == DIR_SIZE;
+        return Entry { name(i), name_length(i), dir, dir ? 0 : static_cast<unsigned long>(m_sizes[i]), m_ctimes[i], m_mtimes[i] };
+    }
+
+    // tells if both listings hold the same entries in the same order
+    bool same_entries(const Listing &other) const {
+        return m_names == other.m_names && m_name_offsets == other.m_name_offsets && m_sizes == other.m_sizes
+            && m_ctimes == other.m_ctimes && m_mtimes == other.m_mtimes;
+    }
+
+    // appends the indexed listing to out in the format read by deserialize:
+    // entry count, arena size and slot count as 64-bit numbers followed by
+    // the arrays, each padded to 8 bytes. Loading it costs a few copies and
+    // no hashing.
+    void serialize(std::string &out) const {
+        const uint64_t header[] = { count(), m_names.size(), m_slots.size() };
+        append(out, header, sizeof(header));
+        append(out, m_names.data(), m_names.size());
+        append(out, m_name_offsets.data(), m_name_offsets.size() * sizeof(uint32_t));
+        append(out, m_sizes.data(), m_sizes.size() * sizeof(uint64_t));
+        append(out, m_ctimes.data(), m_ctimes.size() * sizeof(uint32_t));
+        append(out, m_mtimes.data(), m_mtimes.size() * sizeof(uint32_t));
+        append(out, m_slots.data(), m_slots.size() * sizeof(uint32_t));
+    }
+
+    // returns false if data doesn't hold a consistent listing written by
+    // serialize
+    bool deserialize(const char *data, size_t size) {
+        uint64_t header[3];
+        if (size < sizeof(header)) {
+            return false;
+        }
+        std::memcpy(header, data, sizeof(header));
+        const uint64_t count = header[0];
+        const uint64_t names = header[1];
+        const uint64_t slots = header[2];
+        if (count > 0xffffffffu || names > 0xffffffffu || slots > 0xffffffffu || count > names
+                || slots < 8 || (slots & (slots - 1)) != 0 || slots < count * 2) {
+            return false;
+        }
+        if (size != sizeof(header) + padded(names) + padded(count * 4) + count * 8 + 2 * padded(count * 4) + padded(slots * 4)) {
+            return false;
+        }
+        const char *p = data + sizeof(header);
+        extract(p, m_names, names);
+        extract(p, m_name_offsets, count);
+        extract(p, m_sizes, count);
+        extract(p, m_ctimes, count);
+        extract(p, m_mtimes, count);
+        extract(p, m_slots, slots);
+        // names must be NUL terminated and slots must point at entries, so
+        // that a damaged listing can't cause reads out of bounds
+        if (names > 0 && m_names.back() != '\0') {
+            return false;
+        }
+        for (size_t i = 0; i < count; ++i) {
+            if (m_name_offsets[i] >= names || (i > 0 && m_name_offsets[i] <= m_name_offsets[i - 1])) {
+                return false;
+            }
+        }
+        for (uint32_t slot : m_slots) {
+            if (slot != EMPTY && slot >= count) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    size_t memory_usage() const noexcept {
+        return sizeof(Listing) + m_names.capacity() + m_name_offsets.capacity() * sizeof(uint32_t)
+            + m_sizes.capacity() * sizeof(uint64_t) + m_ctimes.capacity() * sizeof(uint32_t)
+            + m_mtimes.capacity() * sizeof(uint32_t) + m_slots.capacity() * sizeof(uint32_t);
+    }
+
+private:
+
+    enum : uint32_t {
+        EMPTY = 0xffffffff
+    };
+
+    enum : uint64_t {
+        // size recorded for directories
+        DIR_SIZE = 0xffffffffffffffffull
+    };
+
+    void add(const char *name, size_t length, uint64_t size, unsigned long ctime, unsigned long mtime) {
+        if (m_names.size() + length + 1 > 0xffffffffu) {
+            throw std::length_error("listing too large");
+        }
+        m_name_offsets.push_back(m_names.size());
+        m_names.insert(m_names.end(), name, name + length);
+        m_names.push_back('\0');
+        m_sizes.push_back(size);
+        m_ctimes.push_back(to_time(ctime));
+        m_mtimes.push_back(to_time(mtime));
+    }
+
+    // times are seconds since the epoch, which fit in 32 bits until 2106
+    static uint32_t to_time(unsigned long t) noexcept {
+        return t > 0xffffffffu ? 0xffffffffu : t;
+    }
+
+    const char* name(size_t i) const noexcept {
+        return m_names.data() + m_name_offsets[i];
+    }
+
+    size_t name_length(size_t i) const noexcept {
+        const size_t end = i + 1 < m_name_offsets.size() ? m_name_offsets[i + 1] : m_names.size();
+        // without the NUL
+        return end - m_name_offsets[i] - 1;
+    }
+
+    static size_t padded(size_t size) noexcept {
+        return (size + 7) & ~size_t(7);
+    }
+
+    static void append(std::string &out, const void *data, size_t size) {
+        out.append(static_cast<const char*>(data), size);
+        out.append(padded(size) - size, '\0');
+    }
+
+    template<typename T>
+    static void extract(const char *&p, std::vector<T> &array, size_t count) {
+        array.resize(count);
+        std::memcpy(array.data(), p, count * sizeof(T));
+        p += padded(count * sizeof(T));
+    }
+
+    // FNV-1a
+    static uint32_t hash(const char *name, size_t length) noexcept {
+        uint32_t h = 2166136261u;
+        for (size_t i = 0; i < length; ++i) {
+            h = (h ^ static_cast<unsigned char>(name[i])) * 16777619u;
+        }
+        return h;
+    }
+
+    // returns slot holding given name or the empty slot where it belongs.
+    // Table is never more than half full, so the probing always terminates.
+    size_t find_slot(const char *name, size_t length) const {
+        const size_t mask = m_slots.size() - 1;
+        for (size_t i = hash(name, length) & mask; ; i = (i + 1) & mask) {
+            if (m_slots[i] == EMPTY) {
+                return i;
+            }
+            if (name_length(m_slots[i]) == length && std::memcmp(this->name(m_slots[i]), name, length) == 0) {
+                return i;
+            }
+        }
+    }
+
+    // names of all entries, each followed by NUL
+    std::vector<char> m_names;
+    std::vector<uint32_t> m_name_offsets;
+    // DIR_SIZE for directories
+    std::vector<uint64_t> m_sizes;
+    std::vector<uint32_t> m_ctimes;
+    std::vector<uint32_t> m_mtimes;
+    std::vector<uint32_t> m_slots;
+};
+
+// Listing which is still being downloaded. Entries become visible to readers
+// as soon as they are parsed, so that e.g. readdir can hand the first entries
+// of a huge directory to the kernel before the rest arrives.
+class GrowingListing {
+
+public:
+
+    GrowingListing()
+    : m_building(std::make_shared<Listing>())
+    , m_view(m_building)
+    , m_done(false) {
+
+    }
+
+    void add_dir(const std::string &name) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_building->add_dir(name);
+        }
+        m_cond.notify_all();
+    }
+
+    void add_file(const std::string &name, unsigned long size, unsigned long ctime, unsigned long mtime) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_building->add_file(name, size, ctime, mtime);
+        }
+        m_cond.notify_all();
+    }
+
+    // marks the download as finished and returns the indexed listing
+    std::shared_ptr<const Listing> finish() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_building->build_index();
+            m_done = true;
+        }
+        m_cond.notify_all();
+        return m_building;
+    }
+
+    // completes the listing with one obtained elsewhere, e.g. from the cache.
+    // Ignored if anything was already added.
+    void complete(std::shared_ptr<const Listing> listing) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_done || m_building->count() > 0) {
+                return;
+            }
+            m_view = std::move(listing);
+            m_done = true;
+        }
+        m_cond.notify_all();
+    }
+
+    void fail(std::exception_ptr error) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_done) {
+                return;
+            }
+            m_error = error;
+            m_done = true;
+        }
+        m_cond.notify_all();
+    }
+
+    // calls visit(entry, index) for entries starting at given index, waiting
+    // for them to arrive if needed, until the listing ends or visit returns
+    // false. Rethrows the download error, if there was one. Entries are
+    // valid only during the call to visit, as the listing keeps growing.
+    template<typename Visitor>
+    void visit_from(size_t index, Visitor visit) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        for (size_t i = index; ; ++i) {
+            m_cond.wait(lock, [this, i] { return i < m_view->count() || m_done; });
+            if (i >= m_view->count()) {
+                if (m_error) {
+                    std::rethrow_exception(m_error);
+                }
+                return;
+            }
+            if (!visit(m_view->entry(i), i)) {
+                return;
+            }
+        }
+    }
+
+private:
+
+    std::shared_ptr<Listing> m_building;
+    // listing seen by readers; m_building unless completed from elsewhere
+    std::shared_ptr<const Listing> m_view;
+    bool m_done;
+    std::exception_ptr m_error;
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+};
+
+}
+
+#endif // SOAKFS_LISTING_HPP
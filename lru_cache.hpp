@@ -0,0 +1,184 @@
+/*******************************************************************************
+ * Copyright (c) 2012, Andrzej Zawadzki (azawadzki@gmail.com)
+ *
+ * soakfs is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * soakfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with soakfs; if not, see <http ://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#ifndef SOAKFS_LRU_CACHE_HPP
+#define SOAKFS_LRU_CACHE_HPP
+
+#include <cstddef>
+#include <functional>
+#include <list>
+#include <unordered_map>
+#include <utility>
+
+namespace soak {
+
+// Map which keeps the sum of its entries' costs below a budget by dropping the
+// least recently used entries. It does no locking on its own, so concurrent
+// users need to guard it.
+template<typename Key, typename Value, typename Hash = std::hash<Key>>
+class LruCache {
+
+    struct Entry {
+        Key key;
+        Value value;
+        size_t cost;
+    };
+
+    typedef std::list<Entry> entries_t;
+
+    // the index refers to keys stored in the list, so that every key is
+    // kept once
+    typedef std::reference_wrapper<const Key> KeyRef;
+
+    struct KeyRefHash {
+        size_t operator()(KeyRef key) const {
+            return Hash()(key.get());
+        }
+    };
+
+    struct KeyRefEqual {
+        bool operator()(KeyRef a, KeyRef b) const {
+            return a.get() == b.get();
+        }
+    };
+
+public:
+
+    // called for entries dropped to make room for new ones
+    typedef std::function<void(const Key&, Value&)> evict_t;
+
+    explicit LruCache(size_t budget, evict_t on_evict = evict_t())
+    : m_budget(budget)
+    , m_cost(0)
+    , m_on_evict(on_evict) {
+
+    }
+
+    // returns nullptr on miss. A hit marks the entry as the most recently used.
+    Value* find(const Key &key) {
+        auto iter = m_index.find(std::cref(key));
+        if (iter == m_index.end()) {
+            return nullptr;
+        }
+        m_entries.splice(m_entries.begin(), m_entries, iter->second);
+        return &iter->second->value;
+    }
+
+    // unlike find, leaves the order of entries alone
+    bool contains(const Key &key) const {
+        return m_index.count(std::cref(key)) > 0;
+    }
+
+    // entries which would not fit into the budget even on their own are not
+    // stored at all.
+    void insert(const Key &key, Value value, size_t cost) {
+        erase(key);
+        if (cost > m_budget) {
+            return;
+        }
+        m_entries.push_front(Entry { key, std::move(value), cost });
+        m_index.insert(std::make_pair(std::cref(m_entries.front().key), m_entries.begin()));
+        m_cost += cost;
+        shrink(m_budget);
+    }
+
+    void erase(const Key &key) {
+        auto iter = m_index.find(std::cref(key));
+        if (iter != m_index.end()) {
+            m_cost -= iter->second->cost;
+            // the index refers to the key in the list, so it goes first
+            const typename entries_t::iterator entry { iter->second };
+            m_index.erase(iter);
+            m_entries.erase(entry);
+        }
+    }
+
+    template<typename Predicate>
+    void erase_if(Predicate pred) {
+        for (auto iter = m_entries.begin(); iter != m_entries.end(); ) {
+            if (pred(iter->key, iter->value)) {
+                m_cost -= iter->cost;
+                m_index.erase(std::cref(iter->key));
+                iter = m_entries.erase(iter);
+            } else {
+                ++iter;
+            }
+        }
+    }
+
+    // visits entries from the least to the most recently used one
+    template<typename Visitor>
+    void for_each(Visitor visit) const {
+        for (auto iter = m_entries.rbegin(); iter != m_entries.rend(); ++iter) {
+            visit(iter->key, iter->value);
+        }
+    }
+
+    // the least recently used entry, or nullptr if there are none
+    const Value* oldest() const {
+        return m_entries.empty() ? nullptr : &m_entries.back().value;
+    }
+
+    // drops the least recently used entry and returns its cost
+    size_t evict_oldest() {
+        if (m_entries.empty()) {
+            return 0;
+        }
+        const size_t cost { m_entries.back().cost };
+        evict_back();
+        return cost;
+    }
+
+    size_t size() const noexcept {
+        return m_index.size();
+    }
+
+    size_t cost() const noexcept {
+        return m_cost;
+    }
+
+    size_t budget() const noexcept {
+        return m_budget;
+    }
+
+private:
+
+    void shrink(size_t limit) {
+        while (m_cost > limit && !m_entries.empty()) {
+            evict_back();
+        }
+    }
+
+    void evict_back() {
+        Entry &victim = m_entries.back();
+        if (m_on_evict) {
+            m_on_evict(victim.key, victim.value);
+        }
+        m_cost -= victim.cost;
+        m_index.erase(std::cref(victim.key));
+        m_entries.pop_back();
+    }
+
+    const size_t m_budget;
+    size_t m_cost;
+    evict_t m_on_evict;
+    entries_t m_entries;
+    std::unordered_map<KeyRef, typename entries_t::iterator, KeyRefHash, KeyRefEqual> m_index;
+};
+
+}
+
+#endif // SOAKFS_LRU_CACHE_HPP
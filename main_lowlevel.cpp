@@ -0,0 +1,284 @@
+/*******************************************************************************
+ * Copyright (c) 2012, Andrzej Zawadzki (azawadzki@gmail.com)
+ *
+ * soakfs is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * soakfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with soakfs; if not, see <http ://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#include "soakfs.hpp"
+#include "inode_table.hpp"
+#include "task_pool.hpp"
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <sys/uio.h>
+
+#include <fuse3/fuse_lowlevel.h>
+
+// Frontend using the low level fuse api. Requests are addressed by inode
+// numbers, which are translated to paths once, and anything which may need
+// the network is handed to a pool of workers. They reply when the download
+// is done, so the session loop never waits for the server.
+class SoakFSLowLevel {
+
+public:
+
+    SoakFSLowLevel(SoakFS *fs, const SoakFSConfig &config)
+    : m_fs { fs }
+    , m_timeout(config.dir_cache_ttl)
+    , m_negative_timeout(config.negative_ttl)
+    , m_max_read(config.max_read * 1024)
+    , m_workers { config.threads } {
+
+    }
+
+    static const fuse_lowlevel_ops& operations() {
+        static fuse_lowlevel_ops ops;
+        ops.init    = &SoakFSLowLevel::init;
+        ops.destroy = &SoakFSLowLevel::destroy;
+        ops.lookup  = &SoakFSLowLevel::lookup;
+        ops.forget  = &SoakFSLowLevel::forget;
+        ops.getattr = &SoakFSLowLevel::getattr;
+        ops.readdir = &SoakFSLowLevel::readdir;
+        ops.open    = &SoakFSLowLevel::open;
+        ops.read    = &SoakFSLowLevel::read;
+        ops.release = &SoakFSLowLevel::release;
+        return ops;
+    }
+
+private:
+
+    static SoakFSLowLevel& get(fuse_req_t req) {
+        return *reinterpret_cast<SoakFSLowLevel*>(fuse_req_userdata(req));
+    }
+
+    static void init(void *userdata, fuse_conn_info *conn) {
+        SoakFSLowLevel &self = *reinterpret_cast<SoakFSLowLevel*>(userdata);
+        conn->max_read = self.m_max_read;
+        self.m_fs->start_workers();
+        self.m_workers.start();
+    }
+
+    static void destroy(void *userdata) {
+        SoakFSLowLevel &self = *reinterpret_cast<SoakFSLowLevel*>(userdata);
+        self.m_workers.stop();
+        self.m_fs.reset();
+    }
+
+    static void lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+        const std::string child { name };
+        get(req).dispatch(req, parent, [req, child] (SoakFSLowLevel &self, const std::string &parent_path) {
+            const std::string path { parent_path == "/" ? "/" + child : parent_path + "/" + child };
+            fuse_entry_param entry;
+            memset(&entry, 0, sizeof(fuse_entry_param));
+            const int ret = self.m_fs->getattr(path, &entry.attr);
+            if (ret == -ENOENT) {
+                // inode 0 lets the kernel remember that the name is missing
+                entry.entry_timeout = self.m_negative_timeout;
+                fuse_reply_entry(req, &entry);
+                return;
+            }
+            if (ret < 0) {
+                fuse_reply_err(req, -ret);
+                return;
+            }
+            entry.ino = self.m_inodes.lookup(path);
+            entry.attr.st_ino = entry.ino;
+            entry.attr_timeout = self.m_timeout;
+            entry.entry_timeout = self.m_timeout;
+            if (fuse_reply_entry(req, &entry) != 0) {
+                // request was interrupted, so the kernel doesn't count it
+                self.m_inodes.forget(entry.ino, 1);
+            }
+        });
+    }
+
+    static void forget(fuse_req_t req, fuse_ino_t ino, uint64_t lookups) {
+        get(req).m_inodes.forget(ino, lookups);
+        fuse_reply_none(req);
+    }
+
+    static void getattr(fuse_req_t req, fuse_ino_t ino, fuse_file_info*) {
+        get(req).dispatch(req, ino, [req, ino] (SoakFSLowLevel &self, const std::string &path) {
+            struct stat stbuf;
+            const int ret = self.m_fs->getattr(path, &stbuf);
+            if (ret < 0) {
+                fuse_reply_err(req, -ret);
+                return;
+            }
+            stbuf.st_ino = ino;
+            fuse_reply_attr(req, &stbuf, self.m_timeout);
+        });
+    }
+
+    static void readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, fuse_file_info*) {
+        get(req).dispatch(req, ino, [req, size, offset] (SoakFSLowLevel &self, const std::string &path) {
+            std::vector<char> buf(size);
+            size_t used = 0;
+            const int ret = self.m_fs->readdir(path, offset,
+                [req, &buf, &used] (const char *name, const struct stat *stbuf, off_t next) -> bool {
+                    const size_t n = fuse_add_direntry(req, buf.data() + used, buf.size() - used, name, stbuf, next);
+                    if (n > buf.size() - used) {
+                        return true;
+                    }
+                    used += n;
+                    return false;
+                });
+            if (ret < 0) {
+                fuse_reply_err(req, -ret);
+            } else {
+                fuse_reply_buf(req, buf.data(), used);
+            }
+        });
+    }
+
+    static void open(fuse_req_t req, fuse_ino_t ino, fuse_file_info *fi) {
+        // opening resolves the file, possibly fetching its listing, so it
+        // runs on a worker with its own copy of fi
+        const fuse_file_info info = *fi;
+        get(req).dispatch(req, ino, [req, info] (SoakFSLowLevel &self, const std::string &path) {
+            fuse_file_info opened = info;
+            uint64_t fh;
+            bool direct_io;
+            const int ret = self.m_fs->open(path, opened.flags, fh, direct_io);
+            if (ret < 0) {
+                fuse_reply_err(req, -ret);
+                return;
+            }
+            opened.fh = fh;
+            opened.direct_io = direct_io;
+            // files are only replaced by newer versions, which change their
+            // listing and thus attributes, so the page cache can be kept
+            opened.keep_cache = !direct_io;
+            if (fuse_reply_open(req, &opened) != 0) {
+                // the open was interrupted, no release will follow
+                self.m_fs->release(fh);
+            }
+        });
+    }
+
+    static void read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, fuse_file_info *fi) {
+        // fi is only valid until this call returns
+        const uint64_t fh = fi->fh;
+        get(req).dispatch(req, ino, [req, size, offset, fh] (SoakFSLowLevel &self, const std::string &path) {
+            // pieces of cached blocks are handed to the kernel as they are,
+            // without gathering them in one buffer first
+            std::vector<soak::BlockCache::Block> blocks;
+            std::vector<iovec> pieces;
+            const int ret = self.m_fs->read(path, size, offset, fh,
+                [&blocks, &pieces] (const soak::BlockCache::Block &block, size_t block_offset, size_t n) {
+                    blocks.push_back(block);
+                    pieces.push_back(iovec { const_cast<char*>(block->data() + block_offset), n });
+                });
+            if (ret < 0) {
+                fuse_reply_err(req, -ret);
+            } else {
+                fuse_reply_iov(req, pieces.data(), pieces.size());
+            }
+        });
+    }
+
+    static void release(fuse_req_t req, fuse_ino_t, fuse_file_info *fi) {
+        get(req).m_fs->release(fi->fh);
+        fuse_reply_err(req, 0);
+    }
+
+    // resolves the inode and runs the request on a worker. Inline if the
+    // workers aren't running.
+    template<typename Handler>
+    void dispatch(fuse_req_t req, fuse_ino_t ino, Handler handler) {
+        soak::TaskPool::task_t task { [this, req, ino, handler] {
+            std::string path;
+            if (!m_inodes.path(ino, path)) {
+                fuse_reply_err(req, ENOENT);
+                return;
+            }
+            try {
+                handler(*this, path);
+            } catch (...) {
+                fuse_reply_err(req, EIO);
+            }
+        } };
+        if (!m_workers.post(task)) {
+            task();
+        }
+    }
+
+    std::unique_ptr<SoakFS> m_fs;
+    soak::InodeTable m_inodes;
+    const double m_timeout;
+    const double m_negative_timeout;
+    const unsigned m_max_read;
+    // declared last, so that they're stopped before anything they use is
+    // destroyed
+    soak::TaskPool m_workers;
+};
+
+static const fuse_opt soakfs_opts[] = {
+    SOAKFS_COMMON_OPTS,
+    SOAKFS_OPT("threads=%lu", threads),
+    SOAKFS_OPT("max_read=%lu", max_read),
+    FUSE_OPT_END
+};
+
+int main(int argc, char *argv[]) {
+    fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    SoakFSConfig config;
+    if (fuse_opt_parse(&args, &config, soakfs_opts, nullptr) == -1) {
+        return EXIT_FAILURE;
+    }
+    fuse_cmdline_opts opts;
+    if (fuse_parse_cmdline(&args, &opts) != 0) {
+        return EXIT_FAILURE;
+    }
+    if (opts.show_help || opts.mountpoint == nullptr) {
+        std::cout << "usage: " << argv[0] << " [options] <mountpoint>" << std::endl;
+        fuse_cmdline_help();
+        fuse_lowlevel_help();
+        free(opts.mountpoint);
+        fuse_opt_free_args(&args);
+        return opts.show_help ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    SoakFS *fs { soakfs_login(config) };
+    if (fs == nullptr) {
+        free(opts.mountpoint);
+        fuse_opt_free_args(&args);
+        return EXIT_FAILURE;
+    }
+    // the kernel needs to learn the limit at mount time as well
+    const std::string max_read { "-omax_read=" + std::to_string(config.max_read * 1024) };
+    fuse_opt_add_arg(&args, max_read.c_str());
+    SoakFSLowLevel ll { fs, config };
+    int ret = EXIT_FAILURE;
+    fuse_session *se = fuse_session_new(&args, &SoakFSLowLevel::operations(), sizeof(fuse_lowlevel_ops), &ll);
+    if (se != nullptr) {
+        if (fuse_set_signal_handlers(se) == 0) {
+            if (fuse_session_mount(se, opts.mountpoint) == 0) {
+                fuse_daemonize(opts.foreground);
+                // a single thread is enough, as requests which may block are
+                // handed to the workers
+                ret = fuse_session_loop(se) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+                fuse_session_unmount(se);
+            }
+            fuse_remove_signal_handlers(se);
+        }
+        fuse_session_destroy(se);
+    }
+    free(opts.mountpoint);
+    fuse_opt_free_args(&args);
+    return ret;
+}
@@ -0,0 +1,417 @@
+/*******************************************************************************
+ * Copyright (c) 2012, Andrzej Zawadzki (azawadzki@gmail.com)
+ *
+ * soakfs is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * soakfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with soakfs; if not, see <http ://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#ifndef SOAKFS_METADATA_CACHE_HPP
+#define SOAKFS_METADATA_CACHE_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "lru_cache.hpp"
+#include "stats.hpp"
+
+namespace soak {
+
+// Cache of directory listings keyed by path. Besides listings it remembers
+// paths known not to exist (negative entries), so that repeated probes for
+// missing files don't need any work. Both kinds of entries expire after their
+// own time to live and share one memory budget.
+//
+// It does no locking on its own, so concurrent users need to guard it.
+template<typename Listing>
+class MetadataCache {
+
+public:
+
+    typedef std::chrono::steady_clock clock;
+
+    typedef std::shared_ptr<const Listing> ListingPtr;
+    typedef std::function<size_t(const Listing&)> cost_t;
+
+    enum Lookup {
+        MISS,
+        FOUND,
+        NOT_FOUND
+    };
+
+    // ttl of zero keeps listings until they are evicted; negative_ttl of zero
+    // disables negative entries
+    MetadataCache(size_t budget, std::chrono::seconds ttl, std::chrono::seconds negative_ttl, cost_t cost)
+    : m_entries(budget)
+    , m_ttl(ttl)
+    , m_negative_ttl(negative_ttl)
+    , m_cost(cost) {
+
+    }
+
+    // on FOUND listing is set to the cached value. Expired entries are
+    // reported as MISS, but the stale listing is still handed out in
+    // listing, so that the caller can compare it with the fresh one.
+    Lookup find(const std::string &path, ListingPtr &listing) {
+        Entry *entry = m_entries.find(path);
+        if (entry == nullptr) {
+            return MISS;
+        }
+        entry->used = clock::now();
+        listing = entry->listing;
+        if (entry->expires != clock::time_point() && entry->expires <= clock::now()) {
+            return MISS;
+        }
+        return listing ? FOUND : NOT_FOUND;
+    }
+
+    void insert(const std::string &path, ListingPtr listing) {
+        const clock::time_point now { clock::now() };
+        const clock::time_point expires { m_ttl.count() == 0 ? clock::time_point() : now + m_ttl };
+        const size_t cost = entry_cost(path) + m_cost(*listing);
+        m_entries.insert(path, Entry { std::move(listing), expires, now }, cost);
+    }
+
+    void insert_negative(const std::string &path) {
+        if (m_negative_ttl.count() == 0) {
+            return;
+        }
+        const clock::time_point now { clock::now() };
+        m_entries.insert(path, Entry { ListingPtr(), now + m_negative_ttl, now }, entry_cost(path));
+    }
+
+    void erase(const std::string &path) {
+        m_entries.erase(path);
+    }
+
+    // when the least recently used entry was last looked up, or the maximum
+    // time point if there are no entries
+    clock::time_point oldest_use() const {
+        const Entry *oldest = m_entries.oldest();
+        return oldest == nullptr ? clock::time_point::max() : oldest->used;
+    }
+
+    // drops the least recently used entry and returns its cost
+    size_t evict_oldest() {
+        return m_entries.evict_oldest();
+    }
+
+    size_t size() const noexcept {
+        return m_entries.size();
+    }
+
+    size_t cost() const noexcept {
+        return m_entries.cost();
+    }
+
+private:
+
+    struct Entry {
+        // null for negative entries
+        ListingPtr listing;
+        clock::time_point expires;
+        clock::time_point used;
+    };
+
+    static size_t entry_cost(const std::string &path) {
+        // rough estimate of the bookkeeping overhead of a single entry: the
+        // key, list and hash map nodes
+        return sizeof(std::string) + path.size() + sizeof(Entry) + 6 * sizeof(void*);
+    }
+
+    LruCache<std::string, Entry> m_entries;
+    const std::chrono::seconds m_ttl;
+    const std::chrono::seconds m_negative_ttl;
+    cost_t m_cost;
+};
+
+// Thread safe front of MetadataCache. Paths are spread over independently
+// locked shards, so threads working on different directories rarely contend,
+// and no lock is held while a listing is being fetched. Concurrent misses on
+// the same path are merged: one caller fetches the listing and the others
+// wait for its result. A miss on a path which isn't cached at all first asks
+// the restore callback, which may have the listing saved elsewhere than on the
+// server, e.g. in a snapshot; such a listing is served at once and handed to
+// the revalidate callback, which is expected to refresh it in the background.
+// The memory budget is shared by all shards, so that a single listing may take
+// up to all of it; once the shards use more in total, the least recently used
+// entries of all shards are dropped.
+template<typename Listing>
+class ConcurrentMetadataCache {
+
+    typedef std::chrono::steady_clock clock;
+
+public:
+
+    typedef typename MetadataCache<Listing>::ListingPtr ListingPtr;
+    typedef typename MetadataCache<Listing>::cost_t cost_t;
+    // fetches listing of given path; gets the expired listing, if there is
+    // one. Returns null if the path doesn't exist.
+    typedef std::function<ListingPtr(const std::string &path, const ListingPtr &stale)> fetch_t;
+    // returns null if there's no saved listing of the path
+    typedef std::function<ListingPtr(const std::string &path)> restore_t;
+    // must not block; called without any lock held
+    typedef std::function<void(const std::string &path)> revalidate_t;
+
+    ConcurrentMetadataCache(size_t shards, size_t budget, std::chrono::seconds ttl, std::chrono::seconds negative_ttl, cost_t cost,
+            restore_t restore = restore_t(), revalidate_t revalidate = revalidate_t())
+    : m_budget(budget)
+    , m_cost(0)
+    , m_restore(restore)
+    , m_revalidate(revalidate) {
+        shards = std::max<size_t>(shards, 1);
+        for (size_t i = 0; i < shards; ++i) {
+            m_shards.push_back(std::unique_ptr<Shard>(new Shard(budget, ttl, negative_ttl, cost)));
+        }
+    }
+
+    // returns null if the path is known not to exist
+    ListingPtr get(const std::string &path, const fetch_t &fetch) {
+        Shard &shard = shard_for(path);
+        ListingPtr stale;
+        std::promise<ListingPtr> promise;
+        {
+            std::unique_lock<std::mutex> lock { timed_lock(shard.mutex, m_lock_waits) };
+            switch (shard.cache.find(path, stale)) {
+                case MetadataCache<Listing>::FOUND:
+                    ++m_hits;
+                    return stale;
+                case MetadataCache<Listing>::NOT_FOUND:
+                    ++m_negative_hits;
+                    return ListingPtr();
+                case MetadataCache<Listing>::MISS:
+                    break;
+            }
+            auto pending = shard.pending.find(path);
+            if (pending != shard.pending.end()) {
+                ++m_joined;
+                std::shared_future<ListingPtr> result { pending->second };
+                lock.unlock();
+                return result.get();
+            }
+            ++m_misses;
+            shard.pending[path] = promise.get_future().share();
+        }
+        return load(shard, path, stale, fetch, promise, true);
+    }
+
+    // fetches the listing even if it's cached, e.g. to confirm an unverified
+    // one. Does nothing if the listing is being fetched already.
+    void refresh(const std::string &path, const fetch_t &fetch) {
+        Shard &shard = shard_for(path);
+        ListingPtr stale;
+        std::promise<ListingPtr> promise;
+        {
+            const std::unique_lock<std::mutex> lock { timed_lock(shard.mutex, m_lock_waits) };
+            if (shard.pending.count(path) > 0) {
+                return;
+            }
+            // the cached listing is handed out no matter if it has expired
+            shard.cache.find(path, stale);
+            ++m_refreshes;
+            shard.pending[path] = promise.get_future().share();
+        }
+        load(shard, path, stale, fetch, promise, false);
+    }
+
+    // returns cached listing, or null if it's not cached or has expired.
+    // Only hits are counted, as a miss is followed by get.
+    ListingPtr find(const std::string &path) {
+        Shard &shard = shard_for(path);
+        ListingPtr listing;
+        {
+            const std::unique_lock<std::mutex> lock { timed_lock(shard.mutex, m_lock_waits) };
+            if (shard.cache.find(path, listing) != MetadataCache<Listing>::FOUND) {
+                return ListingPtr();
+            }
+        }
+        ++m_hits;
+        return listing;
+    }
+
+    bool is_known_missing(const std::string &path) {
+        Shard &shard = shard_for(path);
+        ListingPtr unused;
+        {
+            const std::unique_lock<std::mutex> lock { timed_lock(shard.mutex, m_lock_waits) };
+            if (shard.cache.find(path, unused) != MetadataCache<Listing>::NOT_FOUND) {
+                return false;
+            }
+        }
+        ++m_negative_hits;
+        return true;
+    }
+
+    void insert_negative(const std::string &path) {
+        Shard &shard = shard_for(path);
+        {
+            const std::unique_lock<std::mutex> lock { timed_lock(shard.mutex, m_lock_waits) };
+            const size_t before { shard.cache.cost() };
+            shard.cache.insert_negative(path);
+            charge(shard, before);
+        }
+        trim(shard);
+    }
+
+    // writes counters as "name value" lines; joined counts callers which
+    // waited for a fetch started by someone else
+    void report(std::ostream &out, const std::string &prefix) {
+        size_t entries = 0;
+        size_t cost = 0;
+        for (const std::unique_ptr<Shard> &shard : m_shards) {
+            std::lock_guard<std::mutex> lock(shard->mutex);
+            entries += shard->cache.size();
+            cost += shard->cache.cost();
+        }
+        out << prefix << "_hits " << m_hits.value() << "\n"
+            << prefix << "_negative_hits " << m_negative_hits.value() << "\n"
+            << prefix << "_misses " << m_misses.value() << "\n"
+            << prefix << "_joined " << m_joined.value() << "\n"
+            << prefix << "_refreshes " << m_refreshes.value() << "\n"
+            << prefix << "_restores " << m_restores.value() << "\n"
+            << prefix << "_entries " << entries << "\n"
+            << prefix << "_bytes " << cost << "\n";
+        m_lock_waits.write(out, prefix + "_lock_wait");
+    }
+
+private:
+
+    struct Shard {
+        Shard(size_t budget, std::chrono::seconds ttl, std::chrono::seconds negative_ttl, cost_t cost)
+        : cache(budget, ttl, negative_ttl, cost) {
+
+        }
+
+        MetadataCache<Listing> cache;
+        std::unordered_map<std::string, std::shared_future<ListingPtr>> pending;
+        std::mutex mutex;
+    };
+
+    Shard& shard_for(const std::string &path) {
+        return *m_shards[std::hash<std::string>()(path) % m_shards.size()];
+    }
+
+    // fetches the listing registered as pending with promise and hands it
+    // to the waiting callers. With restore set, a path which isn't cached is
+    // looked up with the restore callback first.
+    ListingPtr load(Shard &shard, const std::string &path, const ListingPtr &stale, const fetch_t &fetch,
+            std::promise<ListingPtr> &promise, bool restore) {
+        try {
+            ListingPtr restored;
+            if (restore && !stale && m_restore) {
+                restored = m_restore(path);
+            }
+            ListingPtr fresh { restored ? restored : fetch(path, stale) };
+            {
+                const std::unique_lock<std::mutex> lock { timed_lock(shard.mutex, m_lock_waits) };
+                const size_t before { shard.cache.cost() };
+                if (fresh) {
+                    shard.cache.insert(path, fresh);
+                } else {
+                    shard.cache.insert_negative(path);
+                }
+                charge(shard, before);
+                shard.pending.erase(path);
+                promise.set_value(fresh);
+            }
+            trim(shard);
+            if (restored) {
+                ++m_restores;
+                revalidate(path);
+            }
+            return fresh;
+        } catch (...) {
+            const std::unique_lock<std::mutex> lock { timed_lock(shard.mutex, m_lock_waits) };
+            shard.pending.erase(path);
+            promise.set_exception(std::current_exception());
+            throw;
+        }
+    }
+
+    // accounts the change of the cost of the locked shard since it was before
+    void charge(const Shard &shard, size_t before) {
+        // relies on unsigned wrap around when the shard shrank
+        m_cost += shard.cache.cost() - before;
+    }
+
+    // drops the least recently used entries of all shards until they fit
+    // into the budget again. The most recent entry of the shard changed last
+    // is kept, so that a listing which takes most of the budget stays cached.
+    void trim(const Shard &changed) {
+        while (m_cost > m_budget) {
+            Shard *victim = nullptr;
+            clock::time_point oldest { clock::time_point::max() };
+            // the shard to drop entries from is the one with the oldest entry;
+            // it's drained until it's not the oldest one anymore
+            clock::time_point runner_up { clock::time_point::max() };
+            for (const std::unique_ptr<Shard> &shard : m_shards) {
+                const std::unique_lock<std::mutex> lock { timed_lock(shard->mutex, m_lock_waits) };
+                if (shard->cache.size() <= keep(*shard, changed)) {
+                    continue;
+                }
+                const clock::time_point used { shard->cache.oldest_use() };
+                if (used < oldest) {
+                    runner_up = oldest;
+                    oldest = used;
+                    victim = shard.get();
+                } else if (used < runner_up) {
+                    runner_up = used;
+                }
+            }
+            if (victim == nullptr) {
+                return;
+            }
+            const std::unique_lock<std::mutex> lock { timed_lock(victim->mutex, m_lock_waits) };
+            while (m_cost > m_budget && victim->cache.size() > keep(*victim, changed)
+                    && victim->cache.oldest_use() <= runner_up) {
+                m_cost -= victim->cache.evict_oldest();
+            }
+        }
+    }
+
+    static size_t keep(const Shard &shard, const Shard &changed) {
+        return &shard == &changed ? 1 : 0;
+    }
+
+    void revalidate(const std::string &path) {
+        if (m_revalidate) {
+            m_revalidate(path);
+        }
+    }
+
+    std::vector<std::unique_ptr<Shard>> m_shards;
+    const size_t m_budget;
+    // sum of the costs of all shards
+    std::atomic<size_t> m_cost;
+    restore_t m_restore;
+    revalidate_t m_revalidate;
+    Counter m_hits;
+    Counter m_negative_hits;
+    Counter m_misses;
+    Counter m_joined;
+    Counter m_refreshes;
+    Counter m_restores;
+    // contended acquisitions of shard locks
+    Histogram m_lock_waits;
+};
+
+}
+
+#endif // SOAKFS_METADATA_CACHE_HPP
@@ -0,0 +1,444 @@
+/*******************************************************************************
+ * Copyright (c) 2012, Andrzej Zawadzki (azawadzki@gmail.com)
+ *
+ * soakfs is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * soakfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with soakfs; if not, see <http ://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#ifndef SOAKFS_METADATA_SNAPSHOT_HPP
+#define SOAKFS_METADATA_SNAPSHOT_HPP
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "listing.hpp"
+
+namespace soak {
+
+// On-disk copy of directory listings and urls of device root directories,
+// which lets a new mount serve metadata before anything is fetched from the
+// server. Records are only ever appended, as listings are fetched; a later
+// record of the same path supersedes the earlier ones, which are dropped when
+// most of the file consists of them. A record equal to the latest one of its
+// path is not appended again. The file found at startup stays mapped, and
+// listings are read from it one by one, when they are first needed.
+//
+// Format, in native byte order, with every part padded to 8 bytes:
+//     header:  "SOAKSNAP" <version> <byte order mark> <account length> 0 <account>
+//     record:  <type> <checksum> <path length> 0 <payload length> <path> <payload>
+// Numbers are 32 bits long except for the 64-bit payload length. Listing
+// payloads are written by Listing::serialize, so loading them takes a few
+// copies out of the mapped file. Roots payloads are a count followed by
+// name and url pairs, all strings prefixed with their 32-bit length.
+//
+// A snapshot of another account or format version is discarded, and so is a
+// damaged tail, e.g. after a crash in the middle of an append.
+class MetadataSnapshot {
+
+public:
+
+    // names and encoded url components of root directories of a device
+    typedef std::vector<std::pair<std::string, std::string>> RootDirs;
+    typedef std::function<void(const std::string &device, const RootDirs &dirs)> roots_t;
+
+    MetadataSnapshot(const std::string &file, const std::string &account)
+    : m_file(file)
+    , m_account(account)
+    , m_fd(-1)
+    , m_map(nullptr)
+    , m_map_size(0)
+    , m_end(0)
+    , m_failed(false) {
+        m_fd = ::open(file.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        if (m_fd == -1) {
+            throw std::runtime_error(file + ": " + strerror(errno));
+        }
+        try {
+            map();
+            scan();
+        } catch (...) {
+            unmap();
+            ::close(m_fd);
+            throw;
+        }
+    }
+
+    ~MetadataSnapshot() {
+        unmap();
+        ::close(m_fd);
+    }
+
+    // visits the latest roots records. Afterwards the file is compacted if
+    // most of it is superseded. Meant to be called once, before anything is
+    // put.
+    void load(roots_t on_roots) {
+        size_t live = header().size();
+        for (const std::pair<const std::string, Record> &r : m_records) {
+            if (r.second.type == MISSING) {
+                continue;
+            }
+            live += r.second.size;
+            if (r.second.type == ROOTS) {
+                RootDirs dirs;
+                if (read_roots(payload(r.first, r.second), payload_size(r.first, r.second), dirs)) {
+                    on_roots(r.first.substr(1), dirs);
+                }
+            }
+        }
+        if (m_end > COMPACTION_THRESHOLD && m_end > 2 * live) {
+            compact();
+        }
+    }
+
+    // returns the saved listing of path, or null if there's none. Each
+    // listing is handed out once, as afterwards it's cached or superseded by
+    // the one fetched from the server.
+    std::shared_ptr<const Listing> take_listing(const std::string &path) {
+        const char *data;
+        size_t size;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            auto iter = m_records.find(key(LISTING, path));
+            if (iter == m_records.end() || iter->second.type != LISTING || iter->second.offset == 0) {
+                return std::shared_ptr<const Listing>();
+            }
+            data = payload(iter->first, iter->second);
+            size = payload_size(iter->first, iter->second);
+            iter->second.offset = 0;
+        }
+        // the mapping lives as long as the snapshot, so no lock is needed
+        std::shared_ptr<Listing> listing { std::make_shared<Listing>() };
+        if (!listing->deserialize(data, size)) {
+            return std::shared_ptr<const Listing>();
+        }
+        return listing;
+    }
+
+    void put_listing(const std::string &path, const Listing &listing) {
+        std::string payload;
+        listing.serialize(payload);
+        append(LISTING, path, payload);
+    }
+
+    // path no longer exists
+    void put_missing(const std::string &path) {
+        append(MISSING, path, std::string());
+    }
+
+    // device must end with '/'
+    void put_roots(const std::string &device, const RootDirs &dirs) {
+        std::string payload;
+        append_number(payload, dirs.size());
+        for (const std::pair<std::string, std::string> &dir : dirs) {
+            append_string(payload, dir.first);
+            append_string(payload, dir.second);
+        }
+        append(ROOTS, device, payload);
+    }
+
+private:
+
+    enum : uint32_t {
+        VERSION = 1,
+        BYTE_ORDER_MARK = 0x01020304,
+        // record types
+        ROOTS = 1,
+        LISTING = 2,
+        MISSING = 3
+    };
+
+    // files smaller than this are never compacted
+    static const size_t COMPACTION_THRESHOLD = 1024 * 1024;
+
+    struct RecordHeader {
+        uint32_t type;
+        uint32_t checksum;
+        uint32_t path_length;
+        uint32_t reserved;
+        uint64_t payload_length;
+    };
+
+    // latest record of a path; keyed by path prefixed with 'R' for roots and
+    // 'L' for listings, as a device and its root listing share the path
+    struct Record {
+        uint32_t type;
+        // in the mapped file, or 0 if the record was appended since the file
+        // was mapped or its listing was taken already
+        size_t offset;
+        // including the header and padding
+        size_t size;
+        uint32_t checksum;
+    };
+
+    static size_t padded(size_t size) noexcept {
+        return (size + 7) & ~size_t(7);
+    }
+
+    static void append_padded(std::string &out, const void *data, size_t size) {
+        out.append(static_cast<const char*>(data), size);
+        out.append(padded(size) - size, '\0');
+    }
+
+    static void append_number(std::string &out, uint32_t n) {
+        out.append(reinterpret_cast<const char*>(&n), sizeof(n));
+    }
+
+    static void append_string(std::string &out, const std::string &s) {
+        append_number(out, s.size());
+        out += s;
+    }
+
+    static bool read_number(const char *&p, const char *end, uint32_t &n) {
+        if (static_cast<size_t>(end - p) < sizeof(n)) {
+            return false;
+        }
+        std::memcpy(&n, p, sizeof(n));
+        p += sizeof(n);
+        return true;
+    }
+
+    static bool read_string(const char *&p, const char *end, std::string &s) {
+        uint32_t length;
+        if (!read_number(p, end, length) || static_cast<size_t>(end - p) < length) {
+            return false;
+        }
+        s.assign(p, length);
+        p += length;
+        return true;
+    }
+
+    static bool read_roots(const char *payload, size_t size, RootDirs &dirs) {
+        const char *p = payload;
+        const char *end = payload + size;
+        uint32_t count;
+        if (!read_number(p, end, count)) {
+            return false;
+        }
+        for (; count > 0; --count) {
+            std::pair<std::string, std::string> dir;
+            if (!read_string(p, end, dir.first) || !read_string(p, end, dir.second)) {
+                return false;
+            }
+            dirs.push_back(std::move(dir));
+        }
+        return true;
+    }
+
+    // FNV-1a
+    static uint32_t checksum(uint32_t h, const char *data, size_t size) noexcept {
+        for (size_t i = 0; i < size; ++i) {
+            h = (h ^ static_cast<unsigned char>(data[i])) * 16777619u;
+        }
+        return h;
+    }
+
+    static std::string key(uint32_t type, const std::string &path) {
+        return (type == ROOTS ? "R" : "L") + path;
+    }
+
+    // payload of a record in the mapped file; key tells the path length
+    const char* payload(const std::string &key, const Record &r) const {
+        return m_map + r.offset + sizeof(RecordHeader) + padded(key.size() - 1);
+    }
+
+    static size_t payload_size(const std::string &key, const Record &r) {
+        return r.size - sizeof(RecordHeader) - padded(key.size() - 1);
+    }
+
+    std::string header() const {
+        const uint32_t fields[] = { VERSION, BYTE_ORDER_MARK, static_cast<uint32_t>(m_account.size()), 0 };
+        std::string out { "SOAKSNAP" };
+        out.append(reinterpret_cast<const char*>(fields), sizeof(fields));
+        append_padded(out, m_account.data(), m_account.size());
+        return out;
+    }
+
+    void map() {
+        struct stat st;
+        if (fstat(m_fd, &st) != 0) {
+            throw std::runtime_error(m_file + ": " + strerror(errno));
+        }
+        if (st.st_size == 0) {
+            return;
+        }
+        void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, m_fd, 0);
+        if (map == MAP_FAILED) {
+            throw std::runtime_error(m_file + ": " + strerror(errno));
+        }
+        m_map = static_cast<const char*>(map);
+        m_map_size = st.st_size;
+    }
+
+    void unmap() {
+        if (m_map != nullptr) {
+            munmap(const_cast<char*>(m_map), m_map_size);
+            m_map = nullptr;
+            m_map_size = 0;
+        }
+    }
+
+    // indexes valid records and cuts off whatever follows them
+    void scan() {
+        const std::string expected { header() };
+        if (m_map_size < expected.size() || std::memcmp(m_map, expected.data(), expected.size()) != 0) {
+            // other account, version or no snapshot at all
+            m_end = 0;
+            truncate();
+            if (!write_at(m_fd, 0, expected.data(), expected.size())) {
+                throw std::runtime_error(m_file + ": " + strerror(errno));
+            }
+            m_end = expected.size();
+            unmap();
+            return;
+        }
+        size_t offset = expected.size();
+        while (m_map_size - offset >= sizeof(RecordHeader)) {
+            RecordHeader h;
+            std::memcpy(&h, m_map + offset, sizeof(h));
+            const size_t size = sizeof(h) + padded(h.path_length) + padded(h.payload_length);
+            if ((h.type != ROOTS && h.type != LISTING && h.type != MISSING) || h.payload_length > m_map_size
+                    || size > m_map_size - offset) {
+                break;
+            }
+            const char *path = m_map + offset + sizeof(h);
+            const char *payload = path + padded(h.path_length);
+            if (checksum(checksum(2166136261u, path, h.path_length), payload, h.payload_length) != h.checksum) {
+                break;
+            }
+            m_records[key(h.type, std::string(path, h.path_length))] = Record { h.type, offset, size, h.checksum };
+            offset += size;
+        }
+        m_end = offset;
+        if (m_end < m_map_size) {
+            truncate();
+        }
+    }
+
+    void truncate() {
+        if (ftruncate(m_fd, m_end) != 0) {
+            throw std::runtime_error(m_file + ": " + strerror(errno));
+        }
+    }
+
+    // returns false on failure
+    static bool write_at(int fd, size_t offset, const char *data, size_t size) {
+        size_t written = 0;
+        while (written < size) {
+            const ssize_t n = pwrite(fd, data + written, size - written, offset + written);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                return false;
+            }
+            written += n;
+        }
+        return true;
+    }
+
+    void append(uint32_t type, const std::string &path, const std::string &payload) {
+        RecordHeader h;
+        h.type = type;
+        h.checksum = checksum(checksum(2166136261u, path.data(), path.size()), payload.data(), payload.size());
+        h.path_length = path.size();
+        h.reserved = 0;
+        h.payload_length = payload.size();
+        std::string record;
+        record.reserve(sizeof(h) + padded(path.size()) + padded(payload.size()));
+        record.append(reinterpret_cast<const char*>(&h), sizeof(h));
+        append_padded(record, path.data(), path.size());
+        append_padded(record, payload.data(), payload.size());
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_failed) {
+            return;
+        }
+        const std::string k { key(type, path) };
+        const auto latest = m_records.find(k);
+        if (latest != m_records.end() && latest->second.size != 0 && latest->second.type == type
+                && latest->second.checksum == h.checksum) {
+            // same as the latest record, e.g. a listing fetched again after
+            // it was evicted from memory
+            return;
+        }
+        if (!write_at(m_fd, m_end, record.data(), record.size())) {
+            // e.g. disk full. The snapshot is still consistent up to m_end,
+            // but it would go stale, so nothing more is written.
+            m_failed = true;
+            if (ftruncate(m_fd, m_end) != 0) {
+                // the partial record is left behind, and cut off by the
+                // checksum check of the next load()
+            }
+            return;
+        }
+        m_records[k] = Record { type, 0, record.size(), h.checksum };
+        m_end += record.size();
+    }
+
+    // rewrites the file with the latest records only. The new file replaces
+    // the old one at once, so a crash leaves either of them intact. On
+    // failure the old file is kept.
+    void compact() {
+        const std::string tmp { m_file + ".tmp" };
+        const int fd = ::open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (fd == -1) {
+            return;
+        }
+        const std::string h { header() };
+        bool ok = write_at(fd, 0, h.data(), h.size());
+        size_t end = h.size();
+        for (const std::pair<const std::string, Record> &r : m_records) {
+            if (ok && r.second.type != MISSING) {
+                ok = write_at(fd, end, m_map + r.second.offset, r.second.size);
+                end += r.second.size;
+            }
+        }
+        if (!ok || rename(tmp.c_str(), m_file.c_str()) != 0) {
+            ::unlink(tmp.c_str());
+            ::close(fd);
+            return;
+        }
+        ::close(m_fd);
+        m_fd = fd;
+        m_end = end;
+    }
+
+    const std::string m_file;
+    const std::string m_account;
+    int m_fd;
+    // file contents as found at startup
+    const char *m_map;
+    size_t m_map_size;
+    std::unordered_map<std::string, Record> m_records;
+    // size of the valid part of the file, where the next record goes
+    size_t m_end;
+    bool m_failed;
+    std::mutex m_mutex;
+};
+
+}
+
+#endif // SOAKFS_METADATA_SNAPSHOT_HPP
@@ -0,0 +1,352 @@
+/*******************************************************************************
+ * Copyright (c) 2012, Andrzej Zawadzki (azawadzki@gmail.com)
+ *
+ * soakfs is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * soakfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with soakfs; if not, see <http ://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#ifndef SOAKFS_MOCK_DOWNLOAD_POLICY_HPP
+#define SOAKFS_MOCK_DOWNLOAD_POLICY_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <zlib.h>
+
+#include "inflate_sink.hpp"
+#include "soakfs_api.hpp"
+
+namespace soak {
+
+// Stand-in for the storage server, serving a synthetic tree from memory with
+// simulated latency and bandwidth. The tree consists of:
+//   dev<i>/d<j>/d<j>/.../f<k>  devices with `dirs` root directories, each
+//                              branching into `dirs` subdirectories down to
+//                              `depth` levels, with `files` files everywhere
+//   big/d0/f<k>                a single directory holding `huge_dir` files
+// All files are `file_size` bytes long and their contents depend only on
+// their path and offset.
+class MockDownloadPolicy {
+
+public:
+
+    struct Options {
+        Options()
+        : connections(8)
+        , idle_timeout(30)
+        , stripe_size(1024 * 1024)
+        , stripes(4)
+        , devices(1)
+        , dirs(4)
+        , files(16)
+        , depth(3)
+        , huge_dir(20000)
+        , file_size(4 * 1024 * 1024)
+        , latency(20000)
+        , bandwidth(10 * 1024 * 1024)
+        , slow(0)
+        , slow_latency(1000000)
+        , gzip(0) {
+
+        }
+
+        // same meaning as for real policies; connections limits the
+        // number of requests served at once
+        RequestRunner::Settings requests;
+        size_t connections;
+        unsigned idle_timeout;
+        size_t stripe_size;
+        size_t stripes;
+
+        unsigned long devices;
+        unsigned long dirs;
+        unsigned long files;
+        unsigned long depth;
+        unsigned long huge_dir;
+        unsigned long file_size;
+        // time to first byte of every response, in microseconds
+        unsigned long latency;
+        // per request, in bytes per second; 0 means unlimited
+        unsigned long bandwidth;
+        // percentage of responses delayed by slow_latency microseconds
+        // more, like requests stalled by an overloaded server
+        unsigned long slow;
+        unsigned long slow_latency;
+        // non-zero sends listings gzip compressed, as a server honoring
+        // Accept-Encoding would
+        unsigned long gzip;
+    };
+
+    MockDownloadPolicy(const std::string&, const std::string&, const Options &options = Options())
+    : m_options(options)
+    , m_active(0)
+    , m_requests(0)
+    , m_bytes(0) {
+
+    }
+
+    unsigned long requests() const noexcept {
+        return m_requests;
+    }
+
+    unsigned long bytes() const noexcept {
+        return m_bytes;
+    }
+
+    // byte of the file contents at given offset; seed is the hash of the path
+    static char content(unsigned seed, unsigned long offset) noexcept {
+        return static_cast<char>(((offset * 2654435761u) >> 13) ^ seed);
+    }
+
+    static unsigned hash(const std::string &path) noexcept {
+        unsigned h = 2166136261u;
+        for (char c : path) {
+            h = (h ^ static_cast<unsigned char>(c)) * 16777619u;
+        }
+        return h;
+    }
+
+protected:
+
+    void load(const std::string &url, const Sink &sink, std::pair<long, long> range) {
+        Slot slot { *this };
+        const unsigned long n = m_requests++;
+        const std::string path { path_of(url) };
+        if (is_listing_url(url)) {
+            if (!m_options.gzip) {
+                respond(listing(path, url), sink, n);
+                return;
+            }
+            InflateSink inflated { sink, [] { return std::string("gzip"); } };
+            respond(compress(listing(path, url)), std::ref(inflated), n);
+            inflated.finish();
+            return;
+        }
+        if (!file_exists(path)) {
+            throw NotFoundException(url);
+        }
+        const unsigned long first = range.first == UNINITIALIZED ? 0 : range.first;
+        const unsigned long last = range.second == UNINITIALIZED ? m_options.file_size - 1
+            : std::min<unsigned long>(range.second, m_options.file_size - 1);
+        if (first > last) {
+            throw HttpStatusException(url, 416);
+        }
+        std::string body(last - first + 1, '\0');
+        const unsigned seed = hash(path);
+        for (unsigned long i = 0; i < body.size(); ++i) {
+            body[i] = content(seed, first + i);
+        }
+        respond(body, sink, n);
+    }
+
+    void start() {
+
+    }
+
+    void kill_running_threads() {
+
+    }
+
+    // simulated requests end on their own soon enough
+    void abort() {
+
+    }
+
+private:
+
+    // holds one of the simulated connections for the duration of a request
+    struct Slot {
+        explicit Slot(MockDownloadPolicy &policy)
+        : policy(policy) {
+            std::unique_lock<std::mutex> lock(policy.m_mutex);
+            policy.m_slot_cond.wait(lock, [&policy] { return policy.m_active < std::max<size_t>(policy.m_options.connections, 1); });
+            ++policy.m_active;
+        }
+
+        ~Slot() {
+            {
+                std::lock_guard<std::mutex> lock(policy.m_mutex);
+                --policy.m_active;
+            }
+            policy.m_slot_cond.notify_one();
+        }
+
+        MockDownloadPolicy &policy;
+    };
+
+    // part of url following the storage root
+    static std::string path_of(const std::string &url) {
+        const std::string marker { "/storage/" };
+        const size_t root = url.find(marker);
+        const size_t start = root == std::string::npos ? std::string::npos : url.find('/', root + marker.size());
+        if (start == std::string::npos) {
+            throw NotFoundException(url);
+        }
+        return url.substr(start + 1);
+    }
+
+    static std::vector<std::string> split(const std::string &path) {
+        std::vector<std::string> parts;
+        size_t begin = 0;
+        for (size_t slash = path.find('/'); slash != std::string::npos; slash = path.find('/', begin)) {
+            parts.push_back(path.substr(begin, slash - begin));
+            begin = slash + 1;
+        }
+        if (begin < path.size()) {
+            parts.push_back(path.substr(begin));
+        }
+        return parts;
+    }
+
+    // tells if name is prefix followed by a number lower than limit
+    static bool is_indexed(const std::string &name, const std::string &prefix, size_t limit) {
+        if (name.size() <= prefix.size() || name.compare(0, prefix.size(), prefix) != 0) {
+            return false;
+        }
+        char *end;
+        const unsigned long n = std::strtoul(name.c_str() + prefix.size(), &end, 10);
+        return *end == '\0' && n < limit;
+    }
+
+    bool is_big(const std::vector<std::string> &parts) const {
+        return !parts.empty() && parts[0] == "big";
+    }
+
+    // checks device and directory components of parts[0, count)
+    bool dirs_exist(const std::vector<std::string> &parts, size_t count) const {
+        if (count == 0) {
+            return true;
+        }
+        if (is_big(parts)) {
+            return count == 1 || (count == 2 && parts[1] == "d0");
+        }
+        if (!is_indexed(parts[0], "dev", m_options.devices) || count - 1 > m_options.depth) {
+            return false;
+        }
+        for (size_t i = 1; i < count; ++i) {
+            if (!is_indexed(parts[i], "d", m_options.dirs)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool file_exists(const std::string &path) const {
+        const std::vector<std::string> parts { split(path) };
+        if (parts.size() < 3 || !dirs_exist(parts, parts.size() - 1)) {
+            return false;
+        }
+        return is_indexed(parts.back(), "f", is_big(parts) ? m_options.huge_dir : m_options.files);
+    }
+
+    std::string listing(const std::string &path, const std::string &url) const {
+        const std::vector<std::string> parts { split(path) };
+        if (!dirs_exist(parts, parts.size())) {
+            throw NotFoundException(url);
+        }
+        std::string json { "{\"dirs\": [" };
+        std::string files;
+        if (parts.empty()) {
+            json = "{\"devices\": [";
+            for (size_t i = 0; i < m_options.devices; ++i) {
+                json += "[\"dev" + std::to_string(i) + "\", \"dev" + std::to_string(i) + "/\"], ";
+            }
+            json += "[\"big\", \"big/\"]";
+        } else if (parts.size() == 1) {
+            // root directories of a device are named without the slash
+            const size_t count = is_big(parts) ? 1 : m_options.dirs;
+            for (size_t i = 0; i < count; ++i) {
+                json += std::string(i > 0 ? ", " : "") + "[\"d" + std::to_string(i) + "\", \"d" + std::to_string(i) + "/\"]";
+            }
+        } else {
+            const size_t dir_count = is_big(parts) || parts.size() - 1 >= m_options.depth ? 0 : m_options.dirs;
+            for (size_t i = 0; i < dir_count; ++i) {
+                json += std::string(i > 0 ? ", " : "") + "[\"d" + std::to_string(i) + "/\", \"d" + std::to_string(i) + "/\"]";
+            }
+            const size_t file_count = is_big(parts) ? m_options.huge_dir : m_options.files;
+            for (size_t i = 0; i < file_count; ++i) {
+                const std::string name { "f" + std::to_string(i) };
+                files += std::string(i > 0 ? ", " : "") + "{\"name\": \"" + name + "\", \"url\": \"" + name
+                    + "\", \"size\": " + std::to_string(m_options.file_size) + ", \"ctime\": 1356998400, \"mtime\": 1356998400}";
+            }
+        }
+        return json + "], \"files\": [" + files + "]}";
+    }
+
+    static std::string compress(const std::string &data) {
+        z_stream stream;
+        std::memset(&stream, 0, sizeof(stream));
+        // 16 added to the window size writes a gzip header
+        if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            throw std::runtime_error("unable to initialize zlib");
+        }
+        std::string compressed(deflateBound(&stream, data.size()), '\0');
+        stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+        stream.avail_in = data.size();
+        stream.next_out = reinterpret_cast<Bytef*>(&compressed[0]);
+        stream.avail_out = compressed.size();
+        const int ret = deflate(&stream, Z_FINISH);
+        compressed.resize(compressed.size() - stream.avail_out);
+        deflateEnd(&stream);
+        if (ret != Z_STREAM_END) {
+            throw std::runtime_error("unable to compress listing");
+        }
+        return compressed;
+    }
+
+    // hands the body to sink in network sized pieces, paced to the
+    // configured latency and bandwidth. Request n may be a slow one.
+    void respond(const std::string &body, const Sink &sink, unsigned long n) {
+        const size_t CHUNK = 16 * 1024;
+        const bool slow = hash(std::to_string(n)) % 100 < m_options.slow;
+        const unsigned long latency = m_options.latency + (slow ? m_options.slow_latency : 0);
+        // gives up like a socket with a receive timeout would
+        const unsigned long timeout = m_options.requests.timeout * 1000000ul;
+        if (timeout > 0 && latency > timeout) {
+            std::this_thread::sleep_for(std::chrono::microseconds(timeout));
+            throw TimeoutException();
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(latency));
+        const std::chrono::steady_clock::time_point start { std::chrono::steady_clock::now() };
+        for (size_t sent = 0; sent < body.size(); ) {
+            const size_t chunk = std::min(CHUNK, body.size() - sent);
+            if (m_options.bandwidth > 0) {
+                const unsigned long long due = (sent + chunk) * 1000000ull / m_options.bandwidth;
+                std::this_thread::sleep_until(start + std::chrono::microseconds(due));
+            }
+            sink(body.data() + sent, chunk);
+            sent += chunk;
+            m_bytes += chunk;
+        }
+    }
+
+    const Options m_options;
+    size_t m_active;
+    std::mutex m_mutex;
+    std::condition_variable m_slot_cond;
+    std::atomic<unsigned long> m_requests;
+    std::atomic<unsigned long> m_bytes;
+};
+
+}
+
+#endif // SOAKFS_MOCK_DOWNLOAD_POLICY_HPP
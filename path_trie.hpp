@@ -0,0 +1,117 @@
+/*******************************************************************************
+ * Copyright (c) 2012, Andrzej Zawadzki (azawadzki@gmail.com)
+ *
+ * soakfs is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * soakfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with soakfs; if not, see <http ://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#ifndef SOAKFS_PATH_TRIE_HPP
+#define SOAKFS_PATH_TRIE_HPP
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace soak {
+
+// Character level trie mapping path prefixes to values. Lookups find the
+// longest stored prefix of a path which ends at a component boundary in a
+// single pass over the path, no matter how many prefixes are stored.
+//
+// It does no locking on its own, so concurrent users need to guard it.
+template<typename Value>
+class PathTrie {
+
+public:
+
+    PathTrie()
+    : m_nodes(1) {
+
+    }
+
+    // replaces the value if the prefix is already stored
+    void insert(const std::string &prefix, Value value) {
+        uint32_t node = 0;
+        for (char c : prefix) {
+            uint32_t next = child(node, c);
+            if (next == NONE) {
+                next = m_nodes.size();
+                m_nodes[node].children.push_back(std::make_pair(c, next));
+                m_nodes.push_back(Node());
+            }
+            node = next;
+        }
+        if (m_nodes[node].value == NONE) {
+            m_nodes[node].value = m_values.size();
+            m_values.push_back(std::move(value));
+        } else {
+            m_values[m_nodes[node].value] = std::move(value);
+        }
+    }
+
+    // returns value of the longest prefix of path which either ends with '/'
+    // or is followed by '/' or the end of path, and stores its length in
+    // length. Returns nullptr if there's no such prefix.
+    Value* longest_prefix(const std::string &path, size_t &length) {
+        Value *found = nullptr;
+        uint32_t node = 0;
+        for (size_t i = 0; ; ) {
+            const uint32_t value = m_nodes[node].value;
+            if (value != NONE && (i == path.size() || path[i] == '/' || (i > 0 && path[i - 1] == '/'))) {
+                found = &m_values[value];
+                length = i;
+            }
+            if (i == path.size()) {
+                return found;
+            }
+            node = child(node, path[i++]);
+            if (node == NONE) {
+                return found;
+            }
+        }
+    }
+
+private:
+
+    enum : uint32_t {
+        NONE = 0xffffffff
+    };
+
+    struct Node {
+        Node()
+        : value(NONE) {
+
+        }
+
+        // names in a single directory rarely share more than a few leading
+        // characters, so a short vector beats any map here
+        std::vector<std::pair<char, uint32_t>> children;
+        uint32_t value;
+    };
+
+    uint32_t child(uint32_t node, char c) const noexcept {
+        for (const std::pair<char, uint32_t> &child : m_nodes[node].children) {
+            if (child.first == c) {
+                return child.second;
+            }
+        }
+        return NONE;
+    }
+
+    std::vector<Node> m_nodes;
+    std::vector<Value> m_values;
+};
+
+}
+
+#endif // SOAKFS_PATH_TRIE_HPP
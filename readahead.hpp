@@ -0,0 +1,201 @@
+/*******************************************************************************
+ * Copyright (c) 2012, Andrzej Zawadzki (azawadzki@gmail.com)
+ *
+ * soakfs is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * soakfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with soakfs; if not, see <http ://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#ifndef SOAKFS_READAHEAD_HPP
+#define SOAKFS_READAHEAD_HPP
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace soak {
+
+// Access pattern detector kept for every open file. It watches which blocks
+// are read and decides how many of the following blocks are worth fetching
+// in advance, and whether whole blocks are worth fetching at all. The window doubles with each sequential read and is halved on
+// a seek, so random access quickly stops generating extra traffic. Once the
+// window has grown, it's topped up only after half of it has been read, so
+// that blocks are requested in runs long enough to be fetched together.
+class ReadAhead {
+
+public:
+
+    struct Advice {
+        // blocks [from, to) to prefetch; empty if nothing needs to be done
+        unsigned long from;
+        unsigned long to;
+        // the read continued the previous one
+        bool sequential;
+    };
+
+    explicit ReadAhead(unsigned long max_window)
+    : m_max_window(max_window)
+    , m_window(0)
+    , m_next_block(0)
+    , m_prefetched_until(0) {
+
+    }
+
+    // registers read of blocks [first, last] and returns what to do about it
+    Advice on_read(unsigned long first, unsigned long last) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        // the kernel may re-read the tail of the previous block, so a read
+        // starting there still counts as sequential
+        const bool sequential = m_next_block != 0
+            && (first == m_next_block || first + 1 == m_next_block);
+        if (sequential) {
+            m_window = std::min(m_max_window, m_window == 0 ? 1 : m_window * 2);
+        } else {
+            m_window /= 2;
+            m_prefetched_until = 0;
+        }
+        m_next_block = last + 1;
+        if (!sequential || m_window == 0) {
+            return Advice { 0, 0, sequential };
+        }
+        const unsigned long from = std::max(last + 1, m_prefetched_until);
+        const unsigned long to = last + 1 + m_window;
+        if (from >= to || 2 * (from - (last + 1)) > m_window) {
+            return Advice { 0, 0, true };
+        }
+        m_prefetched_until = to;
+        return Advice { from, to, true };
+    }
+
+private:
+
+    const unsigned long m_max_window;
+    unsigned long m_window;
+    unsigned long m_next_block;
+    unsigned long m_prefetched_until;
+    // fuse may deliver reads of the same open file concurrently
+    std::mutex m_mutex;
+};
+
+// Pool of background workers fetching runs of blocks requested by ReadAhead.
+// The queue is bounded; jobs which don't fit are dropped, as prefetching is
+// only an optimization and the foreground read will fetch the blocks anyway.
+class Prefetcher {
+
+public:
+
+    struct Job {
+        std::string path;
+        std::string url;
+        unsigned long file_size;
+        unsigned long file_mtime;
+        // blocks [first_block, end_block)
+        unsigned long first_block;
+        unsigned long end_block;
+    };
+
+    typedef std::function<void(const Job&)> fetch_t;
+
+    Prefetcher(size_t workers, size_t max_queued, fetch_t fetch)
+    : m_worker_count(workers)
+    , m_max_queued(max_queued)
+    , m_fetch(fetch)
+    , m_stopping(false) {
+
+    }
+
+    ~Prefetcher() {
+        stop();
+    }
+
+    // threads must not be started before fuse is initialized, see the comment
+    // in main()
+    void start() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (size_t i = m_workers.size(); i < m_worker_count; ++i) {
+            m_workers.push_back(std::thread(&Prefetcher::run, this));
+        }
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stopping = true;
+            m_jobs.clear();
+        }
+        m_jobs_cond.notify_all();
+        for (std::thread &t : m_workers) {
+            t.join();
+        }
+        m_workers.clear();
+    }
+
+    void schedule(const std::string &path, const std::string &url, unsigned long file_size, unsigned long file_mtime,
+            unsigned long first_block, unsigned long end_block) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_stopping || m_workers.empty() || m_jobs.size() >= m_max_queued) {
+                return;
+            }
+            if (!m_queued.insert(std::make_pair(path, first_block)).second) {
+                // already waiting for a worker
+                return;
+            }
+            m_jobs.push_back(Job { path, url, file_size, file_mtime, first_block, end_block });
+        }
+        m_jobs_cond.notify_one();
+    }
+
+private:
+
+    void run() {
+        for (;;) {
+            Job job;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_jobs_cond.wait(lock, [this] { return m_stopping || !m_jobs.empty(); });
+                if (m_stopping) {
+                    return;
+                }
+                job = std::move(m_jobs.front());
+                m_jobs.pop_front();
+                m_queued.erase(std::make_pair(job.path, job.first_block));
+            }
+            try {
+                m_fetch(job);
+            } catch (...) {
+                // failed prefetch is not an error; the data will be requested
+                // again when it's actually read
+            }
+        }
+    }
+
+    const size_t m_worker_count;
+    const size_t m_max_queued;
+    fetch_t m_fetch;
+    bool m_stopping;
+    std::deque<Job> m_jobs;
+    std::set<std::pair<std::string, unsigned long>> m_queued;
+    std::vector<std::thread> m_workers;
+    std::mutex m_mutex;
+    std::condition_variable m_jobs_cond;
+};
+
+}
+
+#endif // SOAKFS_READAHEAD_HPP
@@ -0,0 +1,449 @@
+/*******************************************************************************
+ * Copyright (c) 2012, Andrzej Zawadzki (azawadzki@gmail.com)
+ *
+ * soakfs is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * soakfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with soakfs; if not, see <http ://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#ifndef SOAKFS_REQUEST_RUNNER_HPP
+#define SOAKFS_REQUEST_RUNNER_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "stats.hpp"
+#include "task_pool.hpp"
+
+namespace soak {
+
+// thrown when a request received no data for longer than its timeout
+class TimeoutException : public std::runtime_error {
+
+public:
+
+    TimeoutException()
+    : std::runtime_error("request timed out") {
+
+    }
+};
+
+// Runs requests to the server with a deadline, hedging and retries.
+//
+// Transports end attempts which receive no data for `timeout` seconds
+// themselves, failing them with TimeoutException, as only they can give their
+// connection back. Attempts of blocking transports run on the calling thread,
+// unless they are hedged: an attempt which hasn't received its first byte
+// within the given percentile of first byte times seen so far gets a twin,
+// which runs on another connection. The first one to receive data wins and the
+// other is stopped as soon as it receives anything. Hedged attempts of
+// blocking transports run on a fixed set of threads, those of asynchronous
+// ones report back when done; either way the caller stops waiting for them
+// after `timeout` seconds without data too, counted from when they begin
+// running rather than from when they were queued. Attempts which fail or time out
+// before any data reached the caller are repeated after a jittered,
+// exponentially growing pause.
+//
+// Attempts abandoned by their request keep running until the transport
+// ends them, and are not waited for.
+class RequestRunner {
+
+    typedef std::chrono::steady_clock clock;
+
+public:
+
+    typedef std::function<void(const char *data, size_t size)> sink_t;
+    // performs a single attempt of a request, passing the response body to
+    // the sink. May be called several times at once, from other threads, and
+    // may outlive the call to run().
+    typedef std::function<void(const sink_t &sink)> attempt_t;
+    // reports the end of an attempt, with null on success
+    typedef std::function<void(std::exception_ptr error)> done_t;
+    // starts an attempt without waiting for it, like attempt_t otherwise.
+    // done is called exactly once, possibly before the call returns.
+    typedef std::function<void(const sink_t &sink, const done_t &done)> async_attempt_t;
+    // tells if a failed attempt may be repeated
+    typedef std::function<bool(const std::exception_ptr &error)> retryable_t;
+
+    struct Settings {
+        Settings()
+        : timeout(60)
+        , hedge_percentile(0)
+        , retries(2) {
+
+        }
+
+        // seconds an attempt may go without receiving data; 0 disables the
+        // deadline
+        unsigned timeout;
+        // percentile of time to first byte, 1-99, after which an attempt is
+        // hedged; 0 disables hedging
+        unsigned hedge_percentile;
+        // how many times a failed request is repeated
+        unsigned retries;
+    };
+
+    // threads run hedged attempts of blocking transports; further ones wait
+    // for a free thread
+    RequestRunner(const Settings &settings, retryable_t retryable, size_t threads)
+    : m_settings(settings)
+    , m_retryable(retryable)
+    , m_random(std::random_device()())
+    , m_started(false)
+    , m_pool(std::max<size_t>(threads, 1)) {
+
+    }
+
+    // starts the threads of blocking attempts, like all threads not before
+    // fuse is initialized. Attempts aren't hedged until then.
+    void start() {
+        m_pool.start();
+        m_started = true;
+    }
+
+    // first_bytes collects times to first byte of the attempts and sets the
+    // hedging threshold, so requests with different latencies, e.g. listings
+    // and file contents, should use separate histograms. sink is called from
+    // one thread at a time and never after run() returns.
+    void run(const attempt_t &attempt, const sink_t &sink, Histogram &first_bytes) {
+        ++m_requests;
+        if (!m_started || m_settings.hedge_percentile == 0) {
+            run_inline(attempt, sink, first_bytes);
+            return;
+        }
+        race(on_pool(attempt), sink, first_bytes);
+    }
+
+    // same as run, for transports which don't need a thread per attempt. The
+    // caller still waits for the request to end.
+    void run_async(const async_attempt_t &attempt, const sink_t &sink, Histogram &first_bytes) {
+        ++m_requests;
+        race([attempt] (const sink_t &attempt_sink, const done_t &done, const began_t &began) {
+            began();
+            attempt(attempt_sink, done);
+        }, sink, first_bytes);
+    }
+
+    void report(std::ostream &out, const std::string &prefix) const {
+        out << prefix << "_hedged " << m_hedged.value() << "\n"
+            << prefix << "_retried " << m_retried.value() << "\n"
+            << prefix << "_timeouts " << m_timeouts.value() << "\n";
+    }
+
+private:
+
+    typedef std::function<void()> began_t;
+    // like async_attempt_t, but calls began once the attempt starts running,
+    // which may be later than the call for attempts waiting for a thread
+    typedef std::function<void(const sink_t &sink, const done_t &done, const began_t &began)> queued_attempt_t;
+
+    // stops an attempt which lost the race, from within its sink
+    struct Abandoned : public std::exception {
+        const char* what() const noexcept {
+            return "request abandoned";
+        }
+    };
+
+    // state shared by the caller and the attempts of a single request
+    struct Race {
+        explicit Race(const sink_t &sink)
+        : sink(&sink)
+        , winner(-1)
+        , running(0)
+        , waiting(0)
+        , done(false)
+        , winner_failed(false)
+        , closed(false)
+        , progress(clock::now()) {
+
+        }
+
+        std::mutex mutex;
+        std::condition_variable cond;
+        // valid until closed, i.e. until the caller leaves run()
+        const sink_t *sink;
+        // attempt which received data first
+        int winner;
+        unsigned running;
+        // attempts started but not running yet, which can't time out
+        unsigned waiting;
+        bool done;
+        bool winner_failed;
+        bool closed;
+        // failure of the winner or, if there's none, of the latest attempt
+        std::exception_ptr error;
+        // time data was last received, or the latest attempt started
+        clock::time_point progress;
+        // time each attempt began running, by index; the epoch while it
+        // waits for a thread
+        std::vector<clock::time_point> started;
+    };
+
+    enum : uint64_t {
+        // first byte times needed before the percentile is trusted
+        HEDGE_MIN_SAMPLES = 20,
+        // percentage of requests which may be hedged, so that a server slow
+        // for everyone isn't sent twice as many requests
+        HEDGE_BUDGET = 10,
+        BACKOFF_BASE_MS = 100,
+        BACKOFF_MAX_MS = 5000
+    };
+
+    void run_inline(const attempt_t &attempt, const sink_t &sink, Histogram &first_bytes) {
+        for (unsigned retries = 0; ; ++retries) {
+            const clock::time_point start { clock::now() };
+            bool received = false;
+            try {
+                attempt([&sink, &first_bytes, &received, start] (const char *data, size_t size) {
+                    if (!received) {
+                        first_bytes.add(elapsed_us(start));
+                        received = true;
+                    }
+                    sink(data, size);
+                });
+                return;
+            } catch (...) {
+                if (is_timeout(std::current_exception())) {
+                    ++m_timeouts;
+                }
+                if (received || retries >= m_settings.retries || !m_retryable(std::current_exception())) {
+                    throw;
+                }
+            }
+            ++m_retried;
+            std::this_thread::sleep_for(backoff(retries + 1));
+        }
+    }
+
+    void race(const queued_attempt_t &attempt, const sink_t &sink, Histogram &first_bytes) {
+        const std::shared_ptr<Race> race { std::make_shared<Race>(sink) };
+        std::unique_lock<std::mutex> lock(race->mutex);
+        try {
+            race_attempts(race, lock, attempt, first_bytes);
+        } catch (...) {
+            race->closed = true;
+            throw;
+        }
+        race->closed = true;
+    }
+
+    // waits for the race to end, starting hedges and retries as needed. lock
+    // holds race->mutex.
+    void race_attempts(const std::shared_ptr<Race> &race, std::unique_lock<std::mutex> &lock, const queued_attempt_t &attempt,
+            Histogram &first_bytes) {
+        const clock::duration timeout { std::chrono::seconds(m_settings.timeout) };
+        int attempts = 0;
+        unsigned retries = 0;
+        start(race, lock, attempts++, attempt, first_bytes);
+        clock::time_point hedge_at { hedge_deadline(first_bytes) };
+        while (!race->done) {
+            const clock::time_point now { clock::now() };
+            const bool failed = race->winner_failed || (race->winner == -1 && race->running == 0);
+            const bool timed_out = !failed && m_settings.timeout > 0 && race->running > race->waiting
+                && now >= race->progress + timeout;
+            if (failed || timed_out) {
+                std::exception_ptr error { race->error };
+                if (timed_out) {
+                    error = std::make_exception_ptr(TimeoutException());
+                }
+                if (timed_out || is_timeout(error)) {
+                    ++m_timeouts;
+                }
+                // once data reached the sink, the request can't be repeated
+                if (race->winner != -1 || retries >= m_settings.retries || !m_retryable(error)) {
+                    std::rethrow_exception(error);
+                }
+                ++retries;
+                ++m_retried;
+                race->error = std::exception_ptr();
+                lock.unlock();
+                std::this_thread::sleep_for(backoff(retries));
+                lock.lock();
+                // a stalled attempt may have woken up in the meantime
+                if (race->winner == -1) {
+                    start(race, lock, attempts++, attempt, first_bytes);
+                }
+                continue;
+            }
+            if (now >= hedge_at) {
+                hedge_at = clock::time_point::max();
+                if (race->winner == -1 && m_hedged.value() * 100 < m_requests.value() * HEDGE_BUDGET) {
+                    ++m_hedged;
+                    start(race, lock, attempts++, attempt, first_bytes);
+                }
+                continue;
+            }
+            clock::time_point wake { hedge_at };
+            if (m_settings.timeout > 0 && race->running > race->waiting) {
+                wake = std::min(wake, race->progress + timeout);
+            }
+            if (wake == clock::time_point::max()) {
+                race->cond.wait(lock);
+            } else {
+                race->cond.wait_until(lock, wake);
+            }
+        }
+    }
+
+    // queues a blocking attempt for one of the threads. Attempts still queued
+    // when the runner stops fail, so that no request waits for them.
+    queued_attempt_t on_pool(const attempt_t &attempt) {
+        return [this, attempt] (const sink_t &sink, const done_t &done, const began_t &began) {
+            const bool queued = m_pool.post([attempt, sink, done, began] {
+                began();
+                std::exception_ptr error;
+                try {
+                    attempt(sink);
+                } catch (...) {
+                    error = std::current_exception();
+                }
+                done(error);
+            }, [done] {
+                done(std::make_exception_ptr(std::runtime_error("request runner stopped")));
+            });
+            if (!queued) {
+                throw std::runtime_error("request runner stopped");
+            }
+        };
+    }
+
+    // starts an attempt. lock holds race->mutex, and is released while the
+    // attempt is being started, as it may finish right away. The attempt's
+    // deadline and time to first byte count from when it begins running.
+    void start(const std::shared_ptr<Race> &race, std::unique_lock<std::mutex> &lock, int index,
+            const queued_attempt_t &attempt, Histogram &first_bytes) {
+        ++race->running;
+        ++race->waiting;
+        race->started.push_back(clock::time_point());
+        Histogram *latencies = &first_bytes;
+        const began_t began {
+            [race, index] {
+                std::lock_guard<std::mutex> lock(race->mutex);
+                --race->waiting;
+                race->started[index] = clock::now();
+                if (race->winner == -1) {
+                    race->progress = race->started[index];
+                }
+                race->cond.notify_all();
+            }
+        };
+        const sink_t sink {
+            [race, index, latencies] (const char *data, size_t size) {
+                std::lock_guard<std::mutex> lock(race->mutex);
+                if (race->closed || (race->winner != -1 && race->winner != index)) {
+                    throw Abandoned();
+                }
+                if (race->winner == -1) {
+                    race->winner = index;
+                    latencies->add(elapsed_us(race->started[index]));
+                }
+                race->progress = clock::now();
+                (*race->sink)(data, size);
+            }
+        };
+        // may be called after the runner is gone
+        const done_t done {
+            [race, index] (std::exception_ptr error) {
+                finish(*race, index, error);
+            }
+        };
+        lock.unlock();
+        try {
+            attempt(sink, done, began);
+        } catch (...) {
+            done(std::current_exception());
+        }
+        lock.lock();
+    }
+
+    static void finish(Race &race, int index, std::exception_ptr error) {
+        std::lock_guard<std::mutex> lock(race.mutex);
+        if (race.started[index] == clock::time_point()) {
+            // dropped before it began
+            --race.waiting;
+        }
+        if (!error) {
+            if (race.winner == -1 && !race.closed) {
+                // empty response
+                race.winner = index;
+            }
+            race.done = race.done || race.winner == index;
+        } else if (race.winner == index) {
+            race.winner_failed = true;
+            race.error = error;
+        } else if (race.winner == -1) {
+            race.error = error;
+        }
+        --race.running;
+        race.cond.notify_all();
+    }
+
+    static bool is_timeout(const std::exception_ptr &error) {
+        try {
+            std::rethrow_exception(error);
+        } catch (const TimeoutException&) {
+            return true;
+        } catch (...) {
+            return false;
+        }
+    }
+
+    clock::time_point hedge_deadline(const Histogram &first_bytes) const {
+        if (m_settings.hedge_percentile == 0 || first_bytes.count() < HEDGE_MIN_SAMPLES) {
+            return clock::time_point::max();
+        }
+        const double p = std::min(m_settings.hedge_percentile, 99u) / 100.0;
+        return clock::now() + std::chrono::microseconds(first_bytes.percentile(p));
+    }
+
+    // pause before the given retry: half of an exponentially growing delay,
+    // plus a random part of the other half, so that requests failed by the
+    // same hiccup don't come back all at once
+    clock::duration backoff(unsigned retry) {
+        const unsigned long ms = std::min<unsigned long>(BACKOFF_BASE_MS << std::min(retry - 1, 16u), BACKOFF_MAX_MS);
+        std::lock_guard<std::mutex> lock(m_random_mutex);
+        std::uniform_int_distribution<unsigned long> jitter(0, ms / 2);
+        return std::chrono::milliseconds(ms - ms / 2 + jitter(m_random));
+    }
+
+    static uint64_t elapsed_us(clock::time_point start) {
+        return std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - start).count();
+    }
+
+    const Settings m_settings;
+    retryable_t m_retryable;
+    std::minstd_rand m_random;
+    std::mutex m_random_mutex;
+    Counter m_requests;
+    Counter m_hedged;
+    Counter m_retried;
+    Counter m_timeouts;
+    std::atomic<bool> m_started;
+    // declared last, so that its threads are stopped first; queued attempts
+    // are failed and running ones joined
+    TaskPool m_pool;
+};
+
+}
+
+#endif // SOAKFS_REQUEST_RUNNER_HPP
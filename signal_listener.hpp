@@ -0,0 +1,143 @@
+/*******************************************************************************
+ * Copyright (c) 2012, Andrzej Zawadzki (azawadzki@gmail.com)
+ *
+ * soakfs is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * soakfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with soakfs; if not, see <http ://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#ifndef SOAKFS_SIGNAL_LISTENER_HPP
+#define SOAKFS_SIGNAL_LISTENER_HPP
+
+#include <atomic>
+#include <functional>
+#include <stdexcept>
+#include <thread>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+
+namespace soak {
+
+// Runs a callback on its own thread whenever the process receives a signal.
+// The signal handler only writes a byte to a pipe, so the callback is free to
+// lock, allocate and do i/o. There may be only one listener at a time.
+class SignalListener {
+
+public:
+
+    typedef std::function<void()> callback_t;
+
+    SignalListener(int signum, callback_t callback)
+    : m_signum(signum)
+    , m_callback(callback)
+    , m_running(false) {
+        m_pipe[0] = m_pipe[1] = -1;
+    }
+
+    ~SignalListener() {
+        stop();
+    }
+
+    // threads must not be started before fuse is initialized, see the comment
+    // in main()
+    void start() {
+        if (m_running) {
+            return;
+        }
+        if (pipe(m_pipe) != 0) {
+            throw std::runtime_error("unable to create signal pipe");
+        }
+        fcntl(m_pipe[0], F_SETFD, FD_CLOEXEC);
+        fcntl(m_pipe[1], F_SETFD, FD_CLOEXEC);
+        // a handler must never block, even if the thread lags behind
+        fcntl(m_pipe[1], F_SETFL, O_NONBLOCK);
+        write_fd() = m_pipe[1];
+        struct sigaction action;
+        action.sa_handler = &SignalListener::on_signal;
+        sigemptyset(&action.sa_mask);
+        action.sa_flags = SA_RESTART;
+        sigaction(m_signum, &action, &m_previous);
+        m_thread = std::thread(&SignalListener::run, this);
+        m_running = true;
+    }
+
+    void stop() {
+        if (!m_running) {
+            return;
+        }
+        sigaction(m_signum, &m_previous, nullptr);
+        const char quit = QUIT;
+        // the write end is non-blocking; a full pipe is being drained
+        while (write(m_pipe[1], &quit, 1) != 1 && (errno == EINTR || errno == EAGAIN)) {
+        }
+        m_thread.join();
+        write_fd() = -1;
+        close(m_pipe[0]);
+        close(m_pipe[1]);
+        m_running = false;
+    }
+
+private:
+
+    enum : char {
+        SIGNALED = 's',
+        QUIT = 'q'
+    };
+
+    static std::atomic<int>& write_fd() {
+        static std::atomic<int> fd { -1 };
+        return fd;
+    }
+
+    static void on_signal(int) {
+        const int saved_errno = errno;
+        const int fd = write_fd();
+        if (fd != -1) {
+            const char signaled = SIGNALED;
+            // a full pipe already holds a pending notification
+            ssize_t unused = write(fd, &signaled, 1);
+            (void) unused;
+        }
+        errno = saved_errno;
+    }
+
+    void run() {
+        for (;;) {
+            char c;
+            const ssize_t n = read(m_pipe[0], &c, 1);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n != 1 || c == QUIT) {
+                return;
+            }
+            try {
+                m_callback();
+            } catch (...) {
+                // nobody to report to; the next signal may succeed
+            }
+        }
+    }
+
+    const int m_signum;
+    callback_t m_callback;
+    bool m_running;
+    int m_pipe[2];
+    struct sigaction m_previous;
+    std::thread m_thread;
+};
+
+}
+
+#endif // SOAKFS_SIGNAL_LISTENER_HPP
@@ -0,0 +1,851 @@
+/*******************************************************************************
+ * Copyright (c) 2012, Andrzej Zawadzki (azawadzki@gmail.com)
+ *
+ * soakfs is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * soakfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with soakfs; if not, see <http ://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#ifndef SOAKFS_HPP
+#define SOAKFS_HPP
+
+#include "soakfs_api.hpp"
+#ifdef SOAKFS_ASYNC_HTTP
+#include "async_download_policy.hpp"
+#else
+#include "sync_download_policy.hpp"
+#endif
+#include "block_cache.hpp"
+#include "crawler.hpp"
+#include "disk_cache.hpp"
+#include "listing.hpp"
+#include "metadata_cache.hpp"
+#include "metadata_snapshot.hpp"
+#include "readahead.hpp"
+#include "signal_listener.hpp"
+#include "stats.hpp"
+#include "task_pool.hpp"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <unordered_map>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <boost/filesystem.hpp>
+
+// tunables settable with -o switches at mount time
+struct SoakFSConfig {
+    // size of aligned file blocks which are downloaded and cached, in KiB
+    unsigned long block_size { 128 };
+    // memory budget for cached file blocks, in MiB
+    unsigned long cache_size { 64 };
+    // upper limit of the sequential read-ahead window, in blocks; 0 disables
+    // read-ahead
+    unsigned long readahead { 32 };
+    // number of background workers fetching read-ahead blocks
+    unsigned long readahead_threads { 4 };
+    // directory of the persistent block cache; the cache is disabled if not set
+    char *cache_dir { nullptr };
+    // disk space budget of the persistent block cache, in MiB
+    unsigned long disk_cache_size { 1024 };
+    // number of persistent connections to the storage server
+    unsigned long connections { 8 };
+    // seconds after which an unused connection is closed
+    unsigned long idle_timeout { 30 };
+    // ranges of at least two stripes, e.g. runs of read-ahead blocks, are
+    // downloaded in pieces of this size over several connections at once,
+    // in KiB; 0 disables striping
+    unsigned long stripe_size { 1024 };
+    // maximal number of pieces of one range downloaded at once
+    unsigned long stripes { 4 };
+    // seconds a request may go without receiving data before it fails, or is
+    // repeated if nothing was received yet; 0 waits forever
+    unsigned long request_timeout { 60 };
+    // percentile of time to first byte after which a second copy of a request
+    // is sent and the first to answer is used, e.g. 95; 0 disables hedging
+    unsigned long hedge { 0 };
+    // how many times a request which failed before receiving anything is
+    // repeated, with a growing, randomized pause
+    unsigned long retries { 2 };
+    // memory budget for cached directory listings, in MiB
+    unsigned long dir_cache_size { 64 };
+    // seconds after which a cached listing is fetched again; 0 keeps listings
+    // until they are evicted
+    unsigned long dir_cache_ttl { 300 };
+    // seconds for which a path is remembered as missing; 0 disables it
+    unsigned long negative_ttl { 30 };
+    // number of independently locked parts of the listing cache
+    unsigned long dir_cache_shards { 16 };
+    // number of workers downloading listings requested by readdir, and of
+    // workers refreshing listings taken from the snapshot
+    unsigned long listing_threads { 4 };
+    // file keeping listings and device root urls between mounts. They are
+    // served right after mounting and refreshed in the background when first
+    // used. Disabled if not set.
+    char *snapshot { nullptr };
+    // colon separated list of directories (devices or any subtrees, "/" for
+    // everything) whose listings are fetched in the background after mounting
+    char *warmup { nullptr };
+    // how many levels below each warm-up directory are crawled
+    unsigned long warmup_depth { 8 };
+    // crawl stops after this many entries were listed
+    unsigned long warmup_entries { 100000 };
+    // number of listings fetched concurrently by the crawl
+    unsigned long warmup_threads { 4 };
+    // file to which the report also readable from /.soakfs-stats is
+    // appended on SIGUSR1; signal is ignored if not set
+    char *stats_file { nullptr };
+    // low level frontend only: number of workers serving requests, so that
+    // slow downloads don't hold up the fuse session loop
+    unsigned long threads { 16 };
+    // low level frontend only: largest read request accepted from the
+    // kernel, in KiB
+    unsigned long max_read { 1024 };
+};
+
+#define SOAKFS_OPT(t, p) { t, offsetof(SoakFSConfig, p), 0 }
+
+// -o switches understood by both frontends
+#define SOAKFS_COMMON_OPTS \
+    SOAKFS_OPT("block_size=%lu", block_size), \
+    SOAKFS_OPT("cache_size=%lu", cache_size), \
+    SOAKFS_OPT("readahead=%lu", readahead), \
+    SOAKFS_OPT("readahead_threads=%lu", readahead_threads), \
+    SOAKFS_OPT("cache_dir=%s", cache_dir), \
+    SOAKFS_OPT("disk_cache_size=%lu", disk_cache_size), \
+    SOAKFS_OPT("connections=%lu", connections), \
+    SOAKFS_OPT("idle_timeout=%lu", idle_timeout), \
+    SOAKFS_OPT("stripe_size=%lu", stripe_size), \
+    SOAKFS_OPT("stripes=%lu", stripes), \
+    SOAKFS_OPT("request_timeout=%lu", request_timeout), \
+    SOAKFS_OPT("hedge=%lu", hedge), \
+    SOAKFS_OPT("retries=%lu", retries), \
+    SOAKFS_OPT("dir_cache_size=%lu", dir_cache_size), \
+    SOAKFS_OPT("dir_cache_ttl=%lu", dir_cache_ttl), \
+    SOAKFS_OPT("negative_ttl=%lu", negative_ttl), \
+    SOAKFS_OPT("dir_cache_shards=%lu", dir_cache_shards), \
+    SOAKFS_OPT("listing_threads=%lu", listing_threads), \
+    SOAKFS_OPT("snapshot=%s", snapshot), \
+    SOAKFS_OPT("warmup=%s", warmup), \
+    SOAKFS_OPT("warmup_depth=%lu", warmup_depth), \
+    SOAKFS_OPT("warmup_entries=%lu", warmup_entries), \
+    SOAKFS_OPT("warmup_threads=%lu", warmup_threads), \
+    SOAKFS_OPT("stats_file=%s", stats_file)
+
+// Filesystem logic shared by the fuse frontends. Everything here is path
+// based and independent of the fuse api version; the frontends translate
+// their requests and replies. DownloadPolicy is replaced in benchmarks.
+//
+// Besides the storage contents the mount holds a hidden, read-only
+// /.soakfs-stats file with runtime counters, see report().
+template<typename DownloadPolicy>
+class BasicSoakFS {
+
+    typedef soak::Storage<DownloadPolicy> Storage;
+    typedef soak::Listing LsData;
+    typedef soak::ConcurrentMetadataCache<LsData> MetadataCache;
+    typedef MetadataCache::ListingPtr LsDataPtr;
+    typedef std::shared_ptr<soak::GrowingListing> LsStreamPtr;
+    typedef soak::BlockCache BlockCache;
+
+    // state of a single open() call, kept in fuse_file_info::fh. The file is
+    // resolved once, so reads need neither its listing nor its url, and they
+    // all see the attributes the file had when it was opened, even if its
+    // directory is refreshed in the meantime.
+    struct OpenFile {
+        explicit OpenFile(unsigned long max_readahead)
+        : size(0)
+        , mtime(0)
+        , readahead { max_readahead } {
+
+        }
+
+        std::string url;
+        // size and mtime as of open; cached blocks are keyed by them, so
+        // reads through the handle never mix two versions of the file
+        unsigned long size;
+        unsigned long mtime;
+        soak::ReadAhead readahead;
+        // contents of a virtual file, taken at open time so that consecutive
+        // reads see the same snapshot
+        BlockCache::Block contents;
+    };
+
+public:
+
+    typedef typename Storage::Options StorageOptions;
+
+    // settings of options which have their counterpart in config are
+    // overridden by it
+    BasicSoakFS(const std::string &user, const std::string &password, const SoakFSConfig &config,
+            StorageOptions options = StorageOptions())
+    : m_storage { new Storage { user, password, storage_options(config, options) } }
+    , m_data { config.dir_cache_shards, config.dir_cache_size * 1024 * 1024, std::chrono::seconds(config.dir_cache_ttl),
+        std::chrono::seconds(config.negative_ttl), &BasicSoakFS::ls_data_cost,
+        [this] (const std::string &d) { return m_snapshot ? m_snapshot->take_listing(d) : LsDataPtr(); },
+        [this] (const std::string &d) { revalidate(d); } }
+    , m_blocks { config.block_size * 1024, config.cache_size * 1024 * 1024 }
+    , m_listing_pool { config.listing_threads }
+    , m_revalidation_pool { config.listing_threads }
+    , m_max_readahead { config.readahead }
+    , m_prefetcher { config.readahead_threads, config.readahead * config.readahead_threads,
+        [this] (const soak::Prefetcher::Job &job) {
+            m_blocks.prefetch(job.path, job.first_block, job.end_block, job.file_size, job.file_mtime,
+                [this, &job] (unsigned long first, unsigned long last) {
+                    return load_blocks(job.path, job.url, job.file_size, job.file_mtime, first, last);
+                });
+        } }
+    , m_started { std::chrono::steady_clock::now() } {
+        if (config.cache_dir != nullptr) {
+            m_disk_cache.reset(new soak::DiskCache { config.cache_dir, config.disk_cache_size * 1024 * 1024 });
+        }
+        if (config.snapshot != nullptr) {
+            m_snapshot.reset(new soak::MetadataSnapshot { config.snapshot, user });
+            m_snapshot->load([this] (const std::string &device, const soak::MetadataSnapshot::RootDirs &dirs) {
+                m_storage->import_device_roots(device, dirs);
+            });
+            m_storage->on_device_roots([this] (const std::string &device, const soak::MetadataSnapshot::RootDirs &dirs) {
+                m_snapshot->put_roots(device, dirs);
+            });
+        }
+        if (config.warmup != nullptr) {
+            m_warmup_roots = split_paths(config.warmup);
+            m_crawler.reset(new soak::Crawler { config.warmup_threads, static_cast<unsigned>(config.warmup_depth),
+                config.warmup_entries, [this] (const std::string &dir, std::vector<std::string> &subdirs) {
+                    return warm_up(dir, subdirs);
+                } });
+        }
+        if (config.stats_file != nullptr) {
+            // resolved now, as fuse changes the working directory to "/" when
+            // it daemonizes
+            const std::string stats_file { boost::filesystem::absolute(config.stats_file).string() };
+            m_stats_listener.reset(new soak::SignalListener { SIGUSR1, [this, stats_file] {
+                std::ofstream out(stats_file.c_str(), std::ios::app);
+                const time_t now = time(nullptr);
+                out << "# " << ctime(&now) << stats() << std::flush;
+            } });
+        }
+    }
+
+    // called once fuse is up and it's safe to spawn threads
+    void start_workers() {
+        m_storage->start();
+        m_listing_pool.start();
+        m_revalidation_pool.start();
+        if (m_max_readahead > 0) {
+            m_prefetcher.start();
+        }
+        if (m_crawler) {
+            m_crawler->start(m_warmup_roots);
+        }
+        if (m_stats_listener) {
+            m_stats_listener->start();
+        }
+    }
+    
+    int getattr(const std::string &path_string, struct stat *stbuf) {
+        const soak::ScopedTimer timer { m_getattr_times };
+        memset(stbuf, 0, sizeof(struct stat));
+        // we don't need to load any data for root dir, so let's treat this
+        // special case separately
+        if (path_string == "/") { stbuf->st_mode = S_IFDIR | 0755;
+            // finding proper link count is not needed in our case and it
+            // imposes a performance tax due to high network loading times. We
+            // fake the count with 1 and hope that fuse will not care too much.
+            stbuf->st_nlink = 1;
+            return 0;
+        }
+        if (is_stats_path(path_string)) {
+            // the size is only a hint, as the report changes all the time;
+            // frontends open the file in direct i/o mode
+            stbuf->st_mode = S_IFREG | 0444;
+            stbuf->st_nlink = 1;
+            stbuf->st_size = stats().size();
+            stbuf->st_mtime = stbuf->st_ctime = time(nullptr);
+            return 0;
+        }
+        if (is_known_missing(path_string)) {
+            return -ENOENT;
+        }
+        const size_t name_pos = filename_pos(path_string);
+        // we must load parent's resources, as the api doesn't permit for
+        // fetching the file/dir info directly.
+        LsDataPtr data;
+        try {
+            data = get_dir_data(parent_path(path_string, name_pos));
+        } catch (const soak::NotFoundException&) {
+            return -ENOENT;
+        }
+        LsData::Entry entry;
+        if (!data->find(path_string.data() + name_pos, path_string.size() - name_pos, entry)) {
+            remember_missing(path_string);
+            return -ENOENT;
+        }
+        fill_stat(entry, stbuf);
+        return 0;
+    }
+
+    // entry number n of the listing is reported with offset n + 3, as offsets
+    // 1 and 2 belong to "." and "..". A listing which is still being
+    // downloaded is handed out entry by entry as it arrives. Attributes are
+    // passed along with the names, as the listing has them anyway.
+    //
+    // fill(name, stat, next_offset) returns true once the reply is full.
+    template<typename Filler>
+    int readdir(const std::string &path, off_t offset, Filler fill) {
+        const soak::ScopedTimer timer { m_readdir_times };
+        struct stat dir_stat;
+        memset(&dir_stat, 0, sizeof(struct stat));
+        dir_stat.st_mode = S_IFDIR | 0755;
+        if (offset == 0 && fill(".", &dir_stat, 1)) {
+            return 0;
+        }
+        if (offset <= 1 && fill("..", &dir_stat, 2)) {
+            return 0;
+        }
+        const size_t first = offset > 2 ? offset - 2 : 0;
+        auto fill_entry = [&fill] (const LsData::Entry &entry, size_t index) -> bool {
+            struct stat stbuf;
+            memset(&stbuf, 0, sizeof(struct stat));
+            fill_stat(entry, &stbuf);
+            return !fill(entry.name, &stbuf, index + 3);
+        };
+        const LsDataPtr data { m_data.find(relative_path(path)) };
+        if (data) {
+            for (size_t i = first; i < data->count() && fill_entry(data->entry(i), i); ++i) {
+            }
+            return 0;
+        }
+        if (is_known_missing(path)) {
+            return -ENOENT;
+        }
+        try {
+            get_dir_stream(path)->visit_from(first, fill_entry);
+        } catch (const soak::NotFoundException&) {
+            return -ENOENT;
+        }
+        return 0;
+    }
+
+    // fh receives the handle to pass to read and release. direct_io is set
+    // if the file has no stable contents, so the kernel must neither cache
+    // them nor trust the reported size.
+    int open(const std::string &path, int flags, uint64_t &fh, bool &direct_io) {
+        if ((flags & O_ACCMODE) != O_RDONLY) {
+            return -EACCES;
+        }
+        std::unique_ptr<OpenFile> file { new OpenFile { m_max_readahead } };
+        direct_io = is_stats_path(path);
+        if (direct_io) {
+            const std::string report { stats() };
+            file->contents = std::make_shared<std::vector<char>>(report.begin(), report.end());
+        } else {
+            const int ret = resolve(path, *file);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+        fh = reinterpret_cast<uint64_t>(file.release());
+        return 0;
+    }
+
+    void release(uint64_t fh) {
+        delete reinterpret_cast<OpenFile*>(fh);
+    }
+
+    // calls visit(block, offset, size) for consecutive pieces of cached blocks
+    // making up the requested part of the file, so that the caller can copy
+    // them or hand them to the kernel directly. Returns the number of bytes
+    // visited or a negated errno.
+    //
+    // Without a handle, i.e. with fh of 0, the file is resolved on every read.
+    template<typename Visitor>
+    int read(const std::string &path, size_t requested_size, off_t offset, uint64_t fh, Visitor visit) {
+        const soak::ScopedTimer timer { m_read_times };
+        OpenFile unopened { 0 };
+        if (fh == 0) {
+            const int ret = resolve(path, unopened);
+            if (ret < 0) {
+                ++m_read_errors;
+                return ret;
+            }
+        }
+        OpenFile &f = fh != 0 ? *reinterpret_cast<OpenFile*>(fh) : unopened;
+        if (f.contents) {
+            if (offset < 0 || static_cast<size_t>(offset) >= f.contents->size()) {
+                return 0;
+            }
+            const size_t n = std::min(requested_size, f.contents->size() - offset);
+            visit(f.contents, offset, n);
+            return n;
+        }
+        try {
+            if (offset < 0 || static_cast<unsigned long>(offset) >= f.size) {
+                return 0;
+            }
+            const size_t read_size = std::min<unsigned long>(requested_size, f.size - offset); // last block?
+            const size_t block_size = m_blocks.block_size();
+            const unsigned long first = offset / block_size;
+            const unsigned long last = (offset + read_size - 1) / block_size;
+            if (!schedule_readahead(f, path, first, last) && !cached(path, f, first, last)) {
+                // a random read: the rest of the blocks would most likely
+                // never be read, so only the requested range is downloaded,
+                // and not cached
+                const std::shared_ptr<std::vector<char>> data { std::make_shared<std::vector<char>>(read_size) };
+                m_storage->download_url(f.url, data->data(), std::pair<long, long>(offset, offset + read_size - 1));
+                ++m_partial_reads;
+                visit(BlockCache::Block(data), 0, read_size);
+                m_bytes_returned.add(read_size);
+                return read_size;
+            }
+            size_t visited = 0;
+            while (visited < read_size) {
+                const unsigned long pos = offset + visited;
+                const BlockCache::Block block { get_block(path, f.url, f.size, f.mtime, pos / block_size) };
+                const size_t block_offset = pos % block_size;
+                if (block->size() <= block_offset) {
+                    // server returned less data than the listing promised
+                    throw std::runtime_error(path + ": short read");
+                }
+                const size_t n = std::min(read_size - visited, block->size() - block_offset);
+                visit(block, block_offset, n);
+                visited += n;
+            }
+            m_bytes_returned.add(read_size);
+            return read_size;
+        } catch (const std::exception &e) {
+            ++m_read_errors;
+            return -EIO;
+        }
+    }
+
+    void kill_running_threads() {
+        m_storage->kill_running_threads();
+    }
+
+    const DownloadPolicy& download_policy() const noexcept {
+        return *m_storage;
+    }
+
+    // runtime counters as "name value" lines, with latency distributions in
+    // microseconds. Comparing the number of storage requests and bytes with
+    // the operations and bytes returned tells how well the caches work.
+    std::string stats() {
+        std::ostringstream out;
+        out << "uptime_s " << std::chrono::duration_cast<std::chrono::seconds>(
+            std::chrono::steady_clock::now() - m_started).count() << "\n";
+        m_getattr_times.write(out, "getattr");
+        m_readdir_times.write(out, "readdir");
+        m_read_times.write(out, "read");
+        out << "read_errors " << m_read_errors.value() << "\n"
+            << "read_bytes " << m_bytes_returned.value() << "\n"
+            << "read_partial " << m_partial_reads.value() << "\n";
+        m_storage->report(out, "storage");
+        m_data.report(out, "listing_cache");
+        m_blocks.report(out, "block_cache");
+        out << "disk_cache_hits " << m_disk_hits.value() << "\n";
+        return out.str();
+    }
+
+private:
+
+    // fills in attributes and url of a regular file. Returns a negated errno
+    // on failure.
+    int resolve(const std::string &path, OpenFile &file) {
+        try {
+            LsDataPtr listing;
+            const LsData::Entry f { get_file_data(path, listing) };
+            file.url = m_storage->file_url(path);
+            file.size = f.size;
+            file.mtime = f.mtime;
+            return 0;
+        } catch (const soak::NotFoundException&) {
+            return -ENOENT;
+        } catch (const std::invalid_argument&) {
+            // no such file in the listing, or path outside of any device
+            return -ENOENT;
+        } catch (const std::exception&) {
+            return -EIO;
+        }
+    }
+
+    static bool is_stats_path(const std::string &path) {
+        return path == "/.soakfs-stats";
+    }
+
+    static StorageOptions storage_options(const SoakFSConfig &config, StorageOptions options) {
+        options.connections = config.connections;
+        options.idle_timeout = config.idle_timeout;
+        options.stripe_size = config.stripe_size * 1024;
+        options.stripes = config.stripes;
+        options.requests.timeout = config.request_timeout;
+        options.requests.hedge_percentile = config.hedge;
+        options.requests.retries = config.retries;
+        return options;
+    }
+
+    static std::vector<std::string> split_paths(const std::string &paths) {
+        std::vector<std::string> result;
+        size_t begin = 0;
+        for (;;) {
+            const size_t end = paths.find(':', begin);
+            std::string path { relative_path(paths.substr(begin, end - begin)) };
+            while (!path.empty() && path[path.size() - 1] == '/') {
+                path.erase(path.size() - 1);
+            }
+            result.push_back(path);
+            if (end == std::string::npos) {
+                return result;
+            }
+            begin = end + 1;
+        }
+    }
+
+    // lists dir into the listing cache on behalf of the warm-up crawl. Goes
+    // through get_dir_data, so a directory requested at the same time by a
+    // user is downloaded only once.
+    size_t warm_up(const std::string &dir, std::vector<std::string> &subdirs) {
+        const LsDataPtr data { get_dir_data(dir) };
+        for (size_t i = 0; i < data->count(); ++i) {
+            const LsData::Entry e { data->entry(i) };
+            if (e.dir) {
+                subdirs.push_back(dir.empty() ? std::string(e.name) : dir + "/" + e.name);
+            }
+        }
+        return data->count();
+    }
+
+    static void fill_stat(const LsData::Entry &entry, struct stat *stbuf) {
+        stbuf->st_nlink = 1;
+        if (entry.dir) {
+            stbuf->st_mode = S_IFDIR | 0755;
+        } else {
+            stbuf->st_mode = S_IFREG | 0444;
+            stbuf->st_size = entry.size;
+            stbuf->st_ctime = entry.ctime;
+            stbuf->st_mtime = entry.mtime;
+        }
+    }
+
+    // listings may be evicted at any time, so the one holding returned entry
+    // is stored in listing to keep it alive
+    LsData::Entry get_file_data(const std::string &file, LsDataPtr &listing) {
+        const size_t name_pos = filename_pos(file);
+        // the api permits for accessing the file data only by querying for parent dir info
+        listing = get_dir_data(parent_path(file, name_pos));
+        LsData::Entry entry;
+        if (!listing->find(file.data() + name_pos, file.size() - name_pos, entry) || entry.dir) {
+            // file path was invalid
+            throw std::invalid_argument(file + " not found");
+        }
+        return entry;
+    }
+
+    // position where the last component of the path starts
+    static size_t filename_pos(const std::string &path) {
+        const size_t slash = path.rfind('/');
+        return slash == std::string::npos ? 0 : slash + 1;
+    }
+
+    static std::string parent_path(const std::string &path, size_t name_pos) {
+        return path.substr(0, name_pos == 0 ? 0 : name_pos - 1);
+    }
+
+    // serves the block from memory or the disk cache if possible; otherwise
+    // fetches it from url with a single ranged request and caches it for
+    // subsequent reads
+    BlockCache::Block get_block(const std::string &path, const std::string &url, unsigned long file_size, unsigned long mtime,
+            unsigned long index) {
+        return m_blocks.fetch(path, index, file_size, mtime, [this, &path, &url, file_size, mtime, index] () -> BlockCache::Block {
+            return load_blocks(path, url, file_size, mtime, index, index + 1).front();
+        });
+    }
+
+    // blocks [first, last) of a file, taken from the disk cache if possible.
+    // Every run of the remaining blocks is downloaded with one ranged request,
+    // which is striped if it's long enough.
+    std::vector<BlockCache::Block> load_blocks(const std::string &path, const std::string &url, unsigned long file_size,
+            unsigned long mtime, unsigned long first, unsigned long last) {
+        std::vector<BlockCache::Block> blocks(last - first);
+        if (m_disk_cache) {
+            for (unsigned long i = first; i < last; ++i) {
+                blocks[i - first] = m_disk_cache->get(path, i, file_size, mtime);
+                if (blocks[i - first]) {
+                    ++m_disk_hits;
+                }
+            }
+        }
+        const size_t block_size = m_blocks.block_size();
+        for (unsigned long begin = first; begin < last; ) {
+            if (blocks[begin - first]) {
+                ++begin;
+                continue;
+            }
+            unsigned long end = begin + 1;
+            while (end < last && !blocks[end - first]) {
+                ++end;
+            }
+            const long from = begin * block_size;
+            const long to = std::min<unsigned long>(end * block_size, file_size) - 1;
+            std::shared_ptr<std::vector<char>> data { std::make_shared<std::vector<char>>(to - from + 1) };
+            m_storage->download_url(url, data->data(), std::make_pair(from, to));
+            for (unsigned long i = begin; i < end; ++i) {
+                if (end - begin == 1) {
+                    blocks[i - first] = data;
+                } else {
+                    const size_t offset = (i - begin) * block_size;
+                    blocks[i - first] = std::make_shared<std::vector<char>>(data->begin() + offset,
+                        data->begin() + std::min(offset + block_size, data->size()));
+                }
+                if (m_disk_cache) {
+                    m_disk_cache->put(path, i, file_size, mtime, blocks[i - first]);
+                }
+            }
+            begin = end;
+        }
+        return blocks;
+    }
+
+    // returns true if the read continued the previous one, in which case
+    // whole blocks are worth fetching
+    bool schedule_readahead(OpenFile &file, const std::string &path, unsigned long first, unsigned long last) {
+        const soak::ReadAhead::Advice advice { file.readahead.on_read(first, last) };
+        const unsigned long block_count = (file.size + m_blocks.block_size() - 1) / m_blocks.block_size();
+        if (advice.from < std::min(advice.to, block_count)) {
+            m_prefetcher.schedule(path, file.url, file.size, file.mtime, advice.from, std::min(advice.to, block_count));
+        }
+        return advice.sequential;
+    }
+
+    // tells if blocks [first, last] are all in memory or on disk
+    bool cached(const std::string &path, const OpenFile &file, unsigned long first, unsigned long last) {
+        for (unsigned long i = first; i <= last; ++i) {
+            if (!m_blocks.contains(path, i, file.size, file.mtime)
+                    && !(m_disk_cache && m_disk_cache->contains(path, i, file.size, file.mtime))) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    LsDataPtr get_dir_data(const std::string &dir) {
+        LsDataPtr data { m_data.get(relative_path(dir),
+            [this] (const std::string &d, const LsDataPtr &stale) -> LsDataPtr {
+                // not accessed previously or expired, so we need to load it
+                return fetch_dir_data(d, stale);
+            }) };
+        if (!data) {
+            throw soak::NotFoundException(dir);
+        }
+        return data;
+    }
+
+    // downloads listing of d, which must be relative. Entries are published
+    // while they're parsed, for the sake of readdir calls waiting for this
+    // directory. Returns null if there's no such directory.
+    LsDataPtr fetch_dir_data(const std::string &d, const LsDataPtr &stale) {
+        const LsStreamPtr stream { acquire_stream(d).first };
+        try {
+            m_storage->ls(d,
+                [&stream] (const std::string &name) {
+                    stream->add_dir(name);
+                },
+                [&stream] (const soak::File &f) {
+                    stream->add_file(f.name, f.size, f.ctime, f.mtime);
+                });
+        } catch (const soak::NotFoundException&) {
+            stream->fail(std::current_exception());
+            release_stream(d, stream);
+            if (m_snapshot) {
+                m_snapshot->put_missing(d);
+            }
+            return LsDataPtr();
+        } catch (...) {
+            stream->fail(std::current_exception());
+            release_stream(d, stream);
+            throw;
+        }
+        const LsDataPtr fresh { stream->finish() };
+        release_stream(d, stream);
+        if (m_snapshot && !(stale && stale->same_entries(*fresh))) {
+            m_snapshot->put_listing(d, *fresh);
+        }
+        return fresh;
+    }
+
+    // called by the listing cache once it served a listing taken from the
+    // snapshot; d is relative. The listing keeps being served until the
+    // fresh one arrives.
+    void revalidate(const std::string &d) {
+        m_revalidation_pool.post([this, d] {
+            try {
+                m_data.refresh(d, [this] (const std::string &path, const LsDataPtr &stale) -> LsDataPtr {
+                    return fetch_dir_data(path, stale);
+                });
+            } catch (...) {
+                // the restored listing stays until it expires
+            }
+        });
+    }
+
+    // returns listing of dir which may be still downloading. If nobody is
+    // fetching it yet, a download is started in the background.
+    LsStreamPtr get_dir_stream(const std::string &dir) {
+        const std::string d { relative_path(dir) };
+        const std::pair<LsStreamPtr, bool> stream { acquire_stream(d) };
+        if (stream.second) {
+            soak::TaskPool::task_t fetch { [this, d, stream] {
+                try {
+                    // finishes the stream by itself, unless the listing was
+                    // found in cache in the meantime
+                    stream.first->complete(get_dir_data(d));
+                } catch (...) {
+                    stream.first->fail(std::current_exception());
+                }
+                release_stream(d, stream.first);
+            } };
+            if (!m_listing_pool.post(fetch)) {
+                fetch();
+            }
+        }
+        return stream.first;
+    }
+
+    // returns stream of listings being downloaded, registering a new one if
+    // there's none. Second member tells if the stream was created.
+    std::pair<LsStreamPtr, bool> acquire_stream(const std::string &d) {
+        std::lock_guard<std::mutex> lock(m_streams_mutex);
+        LsStreamPtr &stream = m_streams[d];
+        if (stream) {
+            return std::make_pair(stream, false);
+        }
+        stream = std::make_shared<soak::GrowingListing>();
+        return std::make_pair(stream, true);
+    }
+
+    void release_stream(const std::string &d, const LsStreamPtr &stream) {
+        std::lock_guard<std::mutex> lock(m_streams_mutex);
+        auto iter = m_streams.find(d);
+        if (iter != m_streams.end() && iter->second == stream) {
+            m_streams.erase(iter);
+        }
+    }
+
+    bool is_known_missing(const std::string &path) {
+        return m_data.is_known_missing(relative_path(path));
+    }
+
+    void remember_missing(const std::string &path) {
+        m_data.insert_negative(relative_path(path));
+    }
+
+    static std::string relative_path(const std::string &path) {
+        if (!path.empty() && path[0] == '/') {
+            // convert to path relative to mounted fs root
+            return path.substr(1);
+        }
+        return path;
+    }
+
+    static size_t ls_data_cost(const LsData &data) {
+        return data.memory_usage();
+    }
+
+    std::unique_ptr<Storage> m_storage;
+
+    // m_data can be accessed and modified concurrently if fuse is run in
+    // multithreaded mode; it does its own locking
+    MetadataCache m_data;
+    // listings currently being downloaded
+    std::unordered_map<std::string, LsStreamPtr> m_streams;
+    std::mutex m_streams_mutex;
+
+    BlockCache m_blocks;
+    std::unique_ptr<soak::DiskCache> m_disk_cache;
+    std::unique_ptr<soak::MetadataSnapshot> m_snapshot;
+
+    // declared after everything the workers use, so that they are stopped
+    // before it's destroyed
+    soak::TaskPool m_listing_pool;
+    soak::TaskPool m_revalidation_pool;
+
+    const unsigned long m_max_readahead;
+    soak::Prefetcher m_prefetcher;
+
+    std::vector<std::string> m_warmup_roots;
+    std::unique_ptr<soak::Crawler> m_crawler;
+
+    const std::chrono::steady_clock::time_point m_started;
+    soak::Histogram m_getattr_times;
+    soak::Histogram m_readdir_times;
+    soak::Histogram m_read_times;
+    soak::Counter m_read_errors;
+    soak::Counter m_bytes_returned;
+    // random reads downloaded without their surrounding blocks
+    soak::Counter m_partial_reads;
+    soak::Counter m_disk_hits;
+    // declared last, so that reports aren't written while the rest is being
+    // destroyed
+    std::unique_ptr<soak::SignalListener> m_stats_listener;
+
+};
+
+#ifdef SOAKFS_ASYNC_HTTP
+typedef BasicSoakFS<soak::DownloadPolicyAsync> SoakFS;
+#else
+typedef BasicSoakFS<soak::DownloadPolicySync> SoakFS;
+#endif
+
+// asks for credentials and logs in. Returns null if it failed.
+inline SoakFS* soakfs_login(const SoakFSConfig &config) {
+    if (config.block_size == 0) {
+        std::cout << "block_size must be positive" << std::endl;
+        return nullptr;
+    }
+    std::string username;
+    std::cout << "Username: ";
+    std::cin >> username;
+    std::string password { getpass("Password: ") };
+    try {
+        std::unique_ptr<SoakFS> fs { new SoakFS { username, password, config } };
+        // When fuse is run in background mode/daemonized, crossing the threshold of
+        // fuse_main blocks all active threads. This requires that any new threads are
+        // created only after fuse_ops's init function is called. The transports run
+        // no threads until start_workers(), but connections opened while logging in
+        // are dropped, as they might not survive daemonizing.
+        fs->kill_running_threads();
+        return fs.release();
+    } catch (const soak::AuthException &e) {
+        std::cout << "Unable to login" << std::endl;
+        return nullptr;
+    } catch (const std::exception &e) {
+        std::cout << e.what() << std::endl;
+        return nullptr;
+    }
+}
+
+#endif // SOAKFS_HPP
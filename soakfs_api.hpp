@@ -18,27 +18,33 @@
 #define SOAKFS_API_HPP
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
 #include <iostream>
 #include <iterator>
-#include <map>
 #include <memory>
 #include <mutex>
+#include <ostream>
 #include <sstream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
-#include <boost/network.hpp>
-#include <boost/regex.hpp>
-#include <boost/algorithm/string/predicate.hpp>
-
-#include <libjson.h>
-#include <JSONNode.h>
-
 #include <basen.hpp>
 
-using namespace boost::network;
-using namespace boost::network::http;
+#include "json_stream.hpp"
+#include "lru_cache.hpp"
+#include "path_trie.hpp"
+#include "request_runner.hpp"
+#include "stats.hpp"
+#include "task_pool.hpp"
 
 namespace soak {
 
@@ -53,72 +59,187 @@ struct File {
     unsigned long mtime;
 };
 
-class AuthException : public std::exception {
+// Picks entries out of api listings as the parser reports them. "dirs" and
+// "devices" sections hold [name, url] pairs, "files" holds one object per
+// file.
+class ListingHandler : public JsonHandler {
 
-};
+public:
 
-class DownloadPolicyCppLib {
+    typedef std::function<void(const std::string &section, const std::string &name, const std::string &url)> dir_t;
+    typedef std::function<void(const File&)> file_t;
 
-public:
+    ListingHandler(dir_t on_dir, file_t on_file)
+    : m_on_dir(on_dir)
+    , m_on_file(on_file)
+    , m_depth(0) {
+
+    }
+
+    void start_object() override {
+        if (++m_depth == ENTRY_DEPTH && m_section == "files") {
+            m_file = File();
+        }
+    }
 
-    DownloadPolicyCppLib(const std::string &username, const std::string &password)
-    : m_client(new http::client)
-    , m_user_creds(http_auth_creds(username, password)) {
+    void end_object() override {
+        if (m_depth-- == ENTRY_DEPTH && m_section == "files" && m_on_file) {
+            m_on_file(m_file);
+        }
+    }
+
+    void start_array() override {
+        if (++m_depth == ENTRY_DEPTH) {
+            m_fields.clear();
+        }
+    }
 
+    void end_array() override {
+        if (m_depth-- == ENTRY_DEPTH && m_section != "files" && !m_fields.empty() && m_on_dir) {
+            m_on_dir(m_section, m_fields[0], m_fields.size() > 1 ? m_fields[1] : std::string());
+        }
     }
 
-protected:
+    void key(const std::string &name) override {
+        if (m_depth == SECTION_DEPTH) {
+            m_section = name;
+        } else if (m_depth == ENTRY_DEPTH) {
+            m_key = name;
+        }
+    }
 
-    void load(const std::string &url, std::ostream &out, std::pair<long, long> range) {
-        if (m_client.get() == nullptr) {
-            m_client.reset(new http::client);
+    void value(const std::string &value, ValueType type) override {
+        if (m_depth != ENTRY_DEPTH) {
+            return;
         }
-        client::request req { url };
-        req << header("Authorization", m_user_creds);
-        if (range.first != UNINITIALIZED || range.second != UNINITIALIZED) {
-            std::ostringstream r;
-            r <<  "bytes=";
-            if (range.first != UNINITIALIZED) {
-                r << range.first;
-            }
-            r << "-";
-            if (range.second != UNINITIALIZED) {
-                r << range.second;
+        if (m_section != "files") {
+            if (type == STRING && m_fields.size() < 2) {
+                m_fields.push_back(value);
             }
-            req << header("Range", r.str());
+        } else if (m_key == "name") {
+            m_file.name = value;
+        } else if (m_key == "url") {
+            m_file.url_component = value;
+        } else if (m_key == "size") {
+            m_file.size = to_ulong(value);
+        } else if (m_key == "ctime") {
+            m_file.ctime = to_ulong(value);
+        } else if (m_key == "mtime") {
+            m_file.mtime = to_ulong(value);
         }
-        client::response resp { m_client->get(req) };
-        if (resp.status() == 401) {
-            throw AuthException();
+    }
+
+private:
+
+    // depth of the top level object, whose keys name the sections, and depth
+    // of single entries inside section arrays
+    enum {
+        SECTION_DEPTH = 1,
+        ENTRY_DEPTH = 3
+    };
+
+    static unsigned long to_ulong(const std::string &number) {
+        char *end;
+        const unsigned long n = std::strtoul(number.c_str(), &end, 10);
+        if (*end != '\0') {
+            // fractions or exponent
+            return static_cast<unsigned long>(std::strtod(number.c_str(), nullptr));
         }
-        out << body(resp);
+        return n;
     }
 
-    void load(const std::string &url, std::ostream &out) {
-        load(url, out, std::make_pair(UNINITIALIZED, UNINITIALIZED));
+    dir_t m_on_dir;
+    file_t m_on_file;
+    int m_depth;
+    std::string m_section;
+    std::string m_key;
+    std::vector<std::string> m_fields;
+    File m_file;
+};
+
+class AuthException : public std::exception {
+
+};
+
+// thrown when requested path doesn't exist on the server
+class NotFoundException : public std::runtime_error {
+
+public:
+
+    NotFoundException(const std::string &url)
+    : std::runtime_error(url + ": not found") {
+
     }
+};
 
-    void kill_running_threads() {
-        m_client.reset(nullptr);
+// thrown when the server returns a different amount of data than requested
+class ShortReadException : public std::runtime_error {
+
+public:
+
+    ShortReadException(const std::string &url)
+    : std::runtime_error(url + ": unexpected response length") {
+
+    }
+};
+
+// thrown when the server answers with an error status other than the ones
+// above
+class HttpStatusException : public std::runtime_error {
+
+public:
+
+    HttpStatusException(const std::string &url, int status)
+    : std::runtime_error(url + ": HTTP status " + std::to_string(status))
+    , m_status(status) {
+
+    }
+
+    int status() const noexcept {
+        return m_status;
     }
 
 private:
 
-    std::string http_auth_creds(const std::string &id, const std::string &pwd) const noexcept {
-        std::ostringstream auth_builder { "Basic ", std::ios::ate };
-        std::string b64;
-        std::string to_encode { id + ":" + pwd };
-        bn::encode_b64(to_encode.begin(), to_encode.end(), std::back_inserter(b64));
-        auth_builder << b64;
-        switch(b64.size() % 4) {
-            case 2: auth_builder << "==";
-            case 3: auth_builder << "=";
-        }
-        return auth_builder.str();
+    int m_status;
+};
+
+// urls of directories, as opposed to files, end with a slash
+inline bool is_listing_url(const std::string &url) {
+    return !url.empty() && url[url.size() - 1] == '/';
+}
+
+// value of the Authorization header
+inline std::string http_basic_auth(const std::string &id, const std::string &pwd) {
+    std::ostringstream auth_builder { "Basic ", std::ios::ate };
+    std::string b64;
+    std::string to_encode { id + ":" + pwd };
+    bn::encode_b64(to_encode.begin(), to_encode.end(), std::back_inserter(b64));
+    auth_builder << b64;
+    switch(b64.size() % 4) {
+        case 2: auth_builder << "=="; break;
+        case 3: auth_builder << "="; break;
     }
+    return auth_builder.str();
+}
+
+// receives the response body piece by piece, as it arrives from the network
+typedef std::function<void(const char *data, size_t size)> Sink;
+
+// tells if a download policy starts requests without blocking, with
+// async_load(url, sink, range, done), rather than running them with load()
+template<typename Policy>
+class is_async_policy {
+
+    template<typename T>
+    static char test(decltype(&T::async_load));
 
-    std::string m_user_creds;
-    std::unique_ptr<http::client> m_client;
+    template<typename T>
+    static long test(...);
+
+public:
+
+    static const bool value = sizeof(test<Policy>(nullptr)) == sizeof(char);
 };
 
 template<typename DownloadPolicy>
@@ -128,56 +249,187 @@ public:
 
     typedef std::vector<std::string> Dirnames;
     typedef std::vector<File> Files;
-    typedef std::pair<std::string, std::string> NameUrlTuple;
-    typedef std::map<std::string, std::vector<NameUrlTuple>> root_paths_t;
-
-    Storage(const std::string &id, const std::string &pwd)
-    : DownloadPolicy(id, pwd) {
+    // names and encoded url components of root directories of a device
+    typedef std::vector<std::pair<std::string, std::string>> RootDirs;
+    typedef std::function<void(const std::string &device, const RootDirs &dirs)> roots_t;
+
+    typedef typename DownloadPolicy::Options Options;
+
+    Storage(const std::string &id, const std::string &pwd, const Options &options = Options())
+    : DownloadPolicy(id, pwd, options)
+    , m_stripe_size(options.stripe_size)
+    , m_stripes(options.stripes)
+    , m_urls(URL_CACHE_SIZE)
+    , m_runner(options.requests, &Storage::is_retryable, options.connections)
+    // the calling thread downloads stripes as well
+    , m_stripe_pool(options.stripes > 1 ? options.stripes - 1 : 0) {
         init_storage_root(id);
         init_root_paths();
     }
 
+    ~Storage() {
+        // attempts still running, e.g. abandoned ones of a server which went
+        // silent, end now rather than hold up the destruction of m_runner
+        DownloadPolicy::abort();
+    }
+
     void download(const std::string &path, std::ostream &out) {
-        std::string sanitized { sanitize_file_path(path) };
-        load(build_url_for_path(sanitized), out);
+        download(path, out, std::make_pair(UNINITIALIZED, UNINITIALIZED));
     }
 
     void download(const std::string &path, std::ostream &out, std::pair<long, long> range) {
+        download(path, [&out] (const char *data, size_t size) { out.write(data, size); }, range);
+    }
+
+    void download(const std::string &path, const Sink &sink, std::pair<long, long> range) {
         std::string sanitized { sanitize_file_path(path) };
-        load(build_url_for_path(sanitized), out, range);
+        load(build_url_for_path(sanitized), sink, range);
     }
 
-    std::pair<Dirnames, Files> ls(const std::string &path) {
+    // downloads bytes [range.first, range.second] straight into buf, which
+    // must be large enough to hold them. Throws ShortReadException unless the
+    // server returns exactly the requested number of bytes. Large ranges are
+    // striped: consecutive pieces are fetched over separate connections at
+    // the same time, each written to its own part of buf, by the calling
+    // thread and the stripe pool.
+    void download(const std::string &path, char *buf, std::pair<long, long> range) {
+        download_url(file_url(path), buf, range);
+    }
+
+    // url of a file, for callers which download it repeatedly and want to
+    // resolve it once
+    std::string file_url(const std::string &path) {
+        return build_url_for_path(sanitize_file_path(path));
+    }
+
+    // same as download, but takes the url returned by file_url
+    void download_url(const std::string &url, char *buf, std::pair<long, long> range) {
+        assert(range.first != UNINITIALIZED && range.second != UNINITIALIZED);
+        const size_t expected = range.second - range.first + 1;
+        if (m_stripe_size == 0 || m_stripes < 2 || expected < 2 * m_stripe_size) {
+            download_range(url, buf, range);
+            return;
+        }
+        const std::shared_ptr<Stripes> stripes { std::make_shared<Stripes>((expected + m_stripe_size - 1) / m_stripe_size) };
+        const std::function<void()> fetch_stripes { [this, url, buf, range, expected, stripes] {
+            for (size_t i = stripes->next++; i < stripes->count; i = stripes->next++) {
+                const size_t offset = i * m_stripe_size;
+                const size_t size = std::min(m_stripe_size, expected - offset);
+                download_range(url, buf + offset, std::pair<long, long>(range.first + offset, range.first + offset + size - 1));
+            }
+        } };
+        for (size_t i = 1; i < std::min(m_stripes, stripes->count); ++i) {
+            m_stripe_pool.post([stripes, fetch_stripes] {
+                {
+                    std::lock_guard<std::mutex> lock(stripes->mutex);
+                    if (stripes->closed) {
+                        // the range is done, and buf may be gone
+                        return;
+                    }
+                    ++stripes->helpers;
+                }
+                std::exception_ptr error;
+                try {
+                    fetch_stripes();
+                } catch (...) {
+                    error = std::current_exception();
+                    // stop the others from starting new stripes
+                    stripes->next = stripes->count;
+                }
+                std::lock_guard<std::mutex> lock(stripes->mutex);
+                if (error && !stripes->error) {
+                    stripes->error = error;
+                }
+                --stripes->helpers;
+                stripes->cond.notify_all();
+            });
+        }
+        std::exception_ptr error;
+        try {
+            fetch_stripes();
+        } catch (...) {
+            error = std::current_exception();
+            stripes->next = stripes->count;
+        }
+        // helpers which started must finish before buf can be given back to
+        // the caller; the ones which haven't won't touch it
+        std::unique_lock<std::mutex> lock(stripes->mutex);
+        stripes->closed = true;
+        stripes->cond.wait(lock, [&stripes] { return stripes->helpers == 0; });
+        if (!error) {
+            error = stripes->error;
+        }
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+    // entries are reported while the listing is being downloaded. Listing a
+    // device refreshes the urls of its root directories as well.
+    void ls(const std::string &path, const std::function<void(const std::string&)> &on_dir, const std::function<void(const File&)> &on_file) {
         std::string sanitized { sanitize_dir_path(path) };
-        std::string data { load(build_url_for_path(sanitized)) };
-        JSONNode n { libjson::parse(data) };
-        Dirnames dirs;
-        Files files;
-        for (auto items : n) {    
-            if (items.name() == "files") {
-                for (auto i : items) {
-                    assert(i.type() == JSON_NODE);
-                    File f;
-                    f.name = i["name"].as_string();
-                    f.size = i["size"].as_int();
-                    f.ctime = i["ctime"].as_int();
-                    f.mtime = i["mtime"].as_int();
-                    files.push_back(f);
+        const bool device = is_device(sanitized);
+        RootDirs roots;
+        ListingHandler handler {
+            [&on_dir, device, &roots] (const std::string &section, const std::string &name, const std::string &url) {
+                if (section == "dirs" || section == "devices") {
+                    on_dir(name);
                 }
-            } else if (items.name() == "dirs" || items.name() == "devices") {
-                for (auto i : items) {
-                    assert(i.type() == JSON_ARRAY);
-                    dirs.push_back(i.at(0).as_string());
+                if (device && section == "dirs") {
+                    roots.push_back(std::make_pair(name, url));
                 }
-            }
+            },
+            on_file
+        };
+        parse(build_url_for_path(sanitized), handler);
+        if (device) {
+            publish_device(sanitized, roots, true);
         }
+    }
+
+    std::pair<Dirnames, Files> ls(const std::string &path) {
+        Dirnames dirs;
+        Files files;
+        ls(path,
+            [&dirs] (const std::string &name) { dirs.push_back(name); },
+            [&files] (const File &f) { files.push_back(f); });
         return std::make_pair(std::move(dirs), std::move(files));
     }
 
+    // starts threads of the transport, if it has any. Like all threads,
+    // they must not be started before fuse is initialized.
+    void start() {
+        DownloadPolicy::start();
+        m_runner.start();
+        m_stripe_pool.start();
+    }
+
     void kill_running_threads() {
         DownloadPolicy::kill_running_threads();
     }
 
+    // callback is told about root directories of every device listed from
+    // now on. Must be set before the storage is used by several threads.
+    void on_device_roots(roots_t callback) {
+        m_on_device_roots = callback;
+    }
+
+    // publishes root directories of a device learned earlier, e.g. from a
+    // snapshot, so that the device needn't be listed before its files are
+    // accessed. device must end with '/'; unknown devices are ignored.
+    void import_device_roots(const std::string &device, const RootDirs &dirs) {
+        publish_device(device, dirs, false);
+    }
+
+    // writes counters of requests sent to the server as "name value" lines
+    void report(std::ostream &out, const std::string &prefix) const {
+        m_request_times.write(out, prefix + "_requests");
+        m_first_byte_times.write(out, prefix + "_first_byte");
+        m_runner.report(out, prefix);
+        out << prefix << "_errors " << m_request_errors.value() << "\n"
+            << prefix << "_bytes " << m_bytes_received.value() << "\n";
+    }
+
 private:
 
     void init_storage_root(const std::string &id) noexcept {
@@ -187,150 +439,341 @@ private:
         m_storage_root = url_builder.str();
     }
 
+    // url of a device or of one of its root directories. Root directories of
+    // a device are fetched when the device is first accessed.
+    struct Root {
+        std::string url;
+        bool device;
+        bool initialized;
+    };
+
     void init_root_paths() {
-        std::string data { load(storage_root()) };
-        JSONNode n { libjson::parse(data) };
-        for (auto metadata : n) {    
-            if (metadata.name() != "devices") {
-                continue;
-            }
-            assert(metadata.type() == JSON_ARRAY);
-            for (auto dev : metadata) {
-                assert(dev.type() == JSON_ARRAY);
-                if (dev.type() == JSON_ARRAY) {
-                    assert(dev.size() == 2);
-                    const std::string &device_name = dev.at(0).as_string() + '/';
-                    std::lock_guard<std::mutex> lock(m_root_paths_mutex);
-                    assert(m_root_paths.find(device_name) == m_root_paths.end());
-                    m_root_paths[device_name];
+        ListingHandler handler {
+            [this] (const std::string &section, const std::string &name, const std::string&) {
+                if (section != "devices") {
+                    return;
                 }
+                const std::string device_name { name + '/' };
+                std::lock_guard<std::mutex> lock(m_root_paths_mutex);
+                m_root_paths.insert(device_name, Root { storage_root() + pseudo_url_encode(device_name), true, false });
+            },
+            ListingHandler::file_t()
+        };
+        parse(storage_root(), handler);
+    }
+
+    // device must end with '/'
+    void init_device(const std::string &device) {
+        std::string url;
+        {
+            std::lock_guard<std::mutex> lock(m_root_paths_mutex);
+            size_t length;
+            const Root *root { m_root_paths.longest_prefix(device, length) };
+            if (root == nullptr || !root->device || length != device.size() || root->initialized) {
+                return;
             }
+            url = root->url;
         }
+        // collected first and published at once, so that concurrent lookups
+        // never see a partially initialized device
+        RootDirs dirs;
+        ListingHandler handler {
+            [&dirs] (const std::string &section, const std::string &name, const std::string &dir_url) {
+                if (section == "dirs") {
+                    dirs.push_back(std::make_pair(name, dir_url));
+                }
+            },
+            ListingHandler::file_t()
+        };
+        parse(url, handler);
+        publish_device(device, dirs, true);
     }
 
-    void init_device(const std::string &dev) {
-        std::string device { dev };
-        if (!device.empty() && *device.rbegin() != '/') {
-            device += '/';
-        }
-        std::string url { storage_root() + pseudo_url_encode(device) };
-        std::string data { load(url) };
-        JSONNode n { libjson::parse(data) };
-        for (auto metadata : n) {    
-            if (metadata.name() != "dirs") {
-                continue;
+    // device must end with '/'. Root directories which are already known
+    // get their urls replaced.
+    void publish_device(const std::string &device, const RootDirs &dirs, bool notify) {
+        bool republished;
+        {
+            std::lock_guard<std::mutex> lock(m_root_paths_mutex);
+            size_t length;
+            Root *root { m_root_paths.longest_prefix(device, length) };
+            if (root == nullptr || !root->device || length != device.size()) {
+                return;
             }
-            assert(metadata.type() == JSON_ARRAY);
-            for (auto dev : metadata) {
-                assert(dev.type() == JSON_ARRAY);
-                if (dev.type() == JSON_ARRAY) {
-                    assert(dev.size() == 2);
-                    std::lock_guard<std::mutex> lock(m_root_paths_mutex);
-                    m_root_paths[device].push_back(
-                        std::make_pair(
-                            dev.at(0).as_string(),
-                            dev.at(1).as_string()));
-                }
+            republished = root->initialized;
+            root->initialized = true;
+            const std::string url { root->url };
+            for (const std::pair<std::string, std::string> &dir : dirs) {
+                // root directory url component was taken from api in already
+                // encoded form
+                m_root_paths.insert(device + dir.first, Root { url + dir.second, false, true });
             }
         }
+        if (republished) {
+            // urls of the device's paths may have changed
+            std::lock_guard<std::mutex> lock(m_urls_mutex);
+            m_urls.erase_if([&device] (const std::string &path, const std::string&) -> bool {
+                return path.compare(0, device.size(), device) == 0;
+            });
+        }
+        if (notify && m_on_device_roots) {
+            m_on_device_roots(device, dirs);
+        }
     }
 
+    // path must be sanitized
+    bool is_device(const std::string &path) {
+        std::lock_guard<std::mutex> lock(m_root_paths_mutex);
+        size_t length = 0;
+        const Root *root { m_root_paths.longest_prefix(path, length) };
+        return root != nullptr && root->device && length == path.size();
+    }
+
+    // feeds the listing to the parser while it's being downloaded
+    void parse(const std::string &url, ListingHandler &handler) {
+        JsonStreamParser parser { handler };
+        load(url, [&parser] (const char *data, size_t size) { parser.feed(data, size); });
+        parser.finish();
+    }
+
+    // path must be sanitized. Urls of recently used paths are cached, so
+    // repeated reads of the same file need neither lookups nor encoding.
     std::string build_url_for_path(const std::string &path) {
         if (path.empty()) {
             return storage_root();
         }
-        root_paths_t::const_iterator device_iter { find_device_from_path(path) };
-        const std::string &device_name { device_iter->first };
-        const std::vector<NameUrlTuple> &device_dirs { device_iter->second };
-        if (device_dirs.empty()) {
-            init_device(device_name);
-        }
-        const std::string encoded_device { pseudo_url_encode(device_name) };
-        if (path == device_name) {
-            // full url already found so we bail out
-            return storage_root() + encoded_device;
-        } else {
-            // let's fetch the actual intra-device path
-            std::string subdir_path;
-            // first let's find the root directory on the current device. We
-            // have it cached in NameUrlTuple, where we keep the mapping from
-            // name to url component.
-            auto dir_iter = std::find_if(device_dirs.begin(), device_dirs.end(),
-                [&path, &device_name] (NameUrlTuple dir) -> bool {
-                    return path.find(dir.first, device_name.length()) == device_name.length();
-                });
-            if (dir_iter == device_dirs.end() && path == device_name) {
-                throw std::invalid_argument("malformed path");
+        {
+            std::lock_guard<std::mutex> lock(m_urls_mutex);
+            const std::string *cached { m_urls.find(path) };
+            if (cached != nullptr) {
+                return *cached;
             }
-            const std::string &base_dir_name { dir_iter->first };
-            const std::string &base_dir_url { dir_iter->second };
-            // root directory url component was taken from api in already
-            // encoded form. The rest of the path we need to encode on our own.
-            subdir_path = path.substr(device_name.length() + base_dir_name.length() + 1);
-            return storage_root() + encoded_device + base_dir_url + pseudo_url_encode(subdir_path);
         }
+        std::string url { resolve(path) };
+        std::lock_guard<std::mutex> lock(m_urls_mutex);
+        m_urls.insert(path, url, 1);
+        return url;
     }
 
-    root_paths_t::const_iterator find_device_from_path(const std::string &path) const {
-        std::lock_guard<std::mutex> lock(m_root_paths_mutex);
-        root_paths_t::const_iterator dev_iter = std::find_if(m_root_paths.begin(), m_root_paths.end(),
-            [&path] (const root_paths_t::value_type &device) -> bool {
-                return std::equal(device.first.begin(), device.first.end(), path.begin());
-            });
-        if (dev_iter == m_root_paths.end()) {
-            throw std::invalid_argument("incorrect device");
+    std::string resolve(const std::string &path) {
+        for (;;) {
+            std::string device;
+            {
+                std::lock_guard<std::mutex> lock(m_root_paths_mutex);
+                size_t length;
+                const Root *root { m_root_paths.longest_prefix(path, length) };
+                if (root == nullptr) {
+                    throw std::invalid_argument("incorrect device");
+                }
+                if (!root->device) {
+                    // the rest of the path we need to encode on our own
+                    std::string url { root->url };
+                    if (length < path.size()) {
+                        pseudo_url_encode(path.data() + length + 1, path.size() - length - 1, url);
+                    }
+                    return url;
+                }
+                if (root->initialized) {
+                    if (length != path.size()) {
+                        throw std::invalid_argument("malformed path");
+                    }
+                    return root->url;
+                }
+                device = path.substr(0, length);
+            }
+            init_device(device);
         }
-        return dev_iter;
     }
 
-    std::string pseudo_url_encode(const std::string &url) const noexcept {
-        std::ostringstream buf;
-        for (char c : url) {
-            if (isalnum(c) 
+    static std::string pseudo_url_encode(const std::string &url) {
+        std::string encoded;
+        pseudo_url_encode(url.data(), url.size(), encoded);
+        return encoded;
+    }
+
+    // appends encoded data to out
+    static void pseudo_url_encode(const char *data, size_t size, std::string &out) {
+        static const char hex[] = "0123456789ABCDEF";
+        out.reserve(out.size() + size);
+        for (size_t i = 0; i < size; ++i) {
+            const unsigned char c = data[i];
+            if ((c >= 'a' && c <= 'z')
+                    || (c >= 'A' && c <= 'Z')
+                    || (c >= '0' && c <= '9')
                     || c == '/'
                     || c == '.'
                     || c == '_'
                     || c == '-') {
-                buf << c;
+                out += c;
             } else {
-                buf << '%' << std::setw(2) << std::setfill('0') << std::hex << std::uppercase << int(c);
+                out += '%';
+                out += hex[c >> 4];
+                out += hex[c & 0xf];
             }
-        };
-        return buf.str();
+        }
     }
 
-    void load(const std::string &url, std::ostream &out, std::pair<long, long> range = std::pair<long, long>(UNINITIALIZED, UNINITIALIZED)) {
-        return DownloadPolicy::load(url, out, range);
-    } 
+    // every request to the server goes through here. Attempts may outlive
+    // the call if they stall, so they get their own copies of the arguments.
+    void load(const std::string &url, const Sink &sink, std::pair<long, long> range = std::pair<long, long>(UNINITIALIZED, UNINITIALIZED)) {
+        const ScopedTimer timer { m_request_times };
+        const bool ranged = range.first != UNINITIALIZED || range.second != UNINITIALIZED;
+        bool first = true;
+        try {
+            run_attempts(url, range,
+                [this, &sink, &timer, &first] (const char *data, size_t size) {
+                    if (first) {
+                        m_first_byte_times.add(timer.elapsed_us());
+                        first = false;
+                    }
+                    m_bytes_received.add(size);
+                    sink(data, size);
+                },
+                ranged ? m_range_attempt_first_byte : m_listing_attempt_first_byte,
+                std::integral_constant<bool, is_async_policy<DownloadPolicy>::value>());
+        } catch (...) {
+            ++m_request_errors;
+            throw;
+        }
+    }
+
+    void run_attempts(const std::string &url, std::pair<long, long> range, const Sink &sink, Histogram &first_bytes,
+            std::false_type) {
+        m_runner.run(
+            [this, url, range] (const Sink &attempt_sink) {
+                this->DownloadPolicy::load(url, attempt_sink, range);
+            },
+            sink, first_bytes);
+    }
+
+    void run_attempts(const std::string &url, std::pair<long, long> range, const Sink &sink, Histogram &first_bytes,
+            std::true_type) {
+        m_runner.run_async(
+            [this, url, range] (const Sink &attempt_sink, const RequestRunner::done_t &done) {
+                this->DownloadPolicy::async_load(url, attempt_sink, range, done);
+            },
+            sink, first_bytes);
+    }
 
     std::string load(const std::string &url, std::pair<long, long> range = std::pair<long, long>(UNINITIALIZED, UNINITIALIZED)) {
-        std::ostringstream obuf;
-        load(url, obuf, range);
-        return obuf.str();
+        std::string data;
+        load(url, [&data] (const char *chunk, size_t size) { data.append(chunk, size); }, range);
+        return data;
     } 
 
+    void download_range(const std::string &url, char *buf, std::pair<long, long> range) {
+        const size_t expected = range.second - range.first + 1;
+        size_t received = 0;
+        bool overflow = false;
+        load(url, [buf, expected, &received, &overflow] (const char *data, size_t size) {
+            if (size > expected - received) {
+                // don't write past the end of buf; most likely the server
+                // ignored the range and sends the whole file
+                overflow = true;
+                size = expected - received;
+            }
+            std::memcpy(buf + received, data, size);
+            received += size;
+        }, range);
+        if (overflow || received != expected) {
+            throw ShortReadException(url);
+        }
+    }
+
+    // errors of the server are retried, except for those which would only
+    // repeat themselves
+    static bool is_retryable(const std::exception_ptr &error) {
+        try {
+            std::rethrow_exception(error);
+        } catch (const AuthException&) {
+            return false;
+        } catch (const NotFoundException&) {
+            return false;
+        } catch (const HttpStatusException &e) {
+            return e.status() >= 500;
+        } catch (...) {
+            return true;
+        }
+    }
+
     std::string sanitize_file_path(const std::string &path) const {
-        auto s = boost::regex_replace(path, boost::regex("/+"), "/");
-        return boost::regex_replace(s, boost::regex("^/"), "");
+        return normalize_path(path, false);
     }
 
     std::string sanitize_dir_path(const std::string &path) const {
-        std::string sanitized = boost::regex_replace(path, boost::regex("/+"), "/");
-        if (sanitized.length() > 0 && *sanitized.rbegin() != '/') {
-            sanitized.append(1, '/');
+        return normalize_path(path, true);
+    }
+
+    // collapses runs of slashes and drops the leading one in a single pass.
+    // Directory paths, except for the root, get a trailing slash.
+    static std::string normalize_path(const std::string &path, bool dir) {
+        std::string normalized;
+        normalized.reserve(path.size() + 1);
+        for (char c : path) {
+            if (c == '/' && (normalized.empty() || *normalized.rbegin() == '/')) {
+                continue;
+            }
+            normalized += c;
+        }
+        if (dir && !normalized.empty() && *normalized.rbegin() != '/') {
+            normalized += '/';
         }
-        return sanitized;
+        return normalized;
     }
 
     const std::string& storage_root() const noexcept {
         return m_storage_root;
     }
 
+    // number of sanitized paths whose urls are remembered
+    static const size_t URL_CACHE_SIZE = 4096;
+
+    // a range being downloaded in stripes; shared with the stripe pool, as
+    // its tasks may start after the range is done
+    struct Stripes {
+        explicit Stripes(size_t count)
+        : count(count)
+        , next(0)
+        , helpers(0)
+        , closed(false) {
+
+        }
+
+        const size_t count;
+        std::atomic<size_t> next;
+        // pool threads downloading stripes at the moment
+        size_t helpers;
+        // set once the range is done; pool tasks starting later do nothing
+        bool closed;
+        std::exception_ptr error;
+        std::mutex mutex;
+        std::condition_variable cond;
+    };
+
+    const size_t m_stripe_size;
+    const size_t m_stripes;
     std::string m_storage_root;
-    root_paths_t m_root_paths;
-    // m_root_paths can be accessed and modified concurrently if fuse is run in
-    // multithreaded mode
-    mutable std::mutex m_root_paths_mutex;
+    PathTrie<Root> m_root_paths;
+    // m_root_paths and m_urls can be accessed and modified concurrently if
+    // fuse is run in multithreaded mode
+    std::mutex m_root_paths_mutex;
+    LruCache<std::string, std::string> m_urls;
+    std::mutex m_urls_mutex;
+    roots_t m_on_device_roots;
+
+    Histogram m_request_times;
+    Histogram m_first_byte_times;
+    Counter m_request_errors;
+    Counter m_bytes_received;
+    // time to first byte of single attempts, learned separately for listings
+    // and file ranges to set their hedging thresholds
+    Histogram m_listing_attempt_first_byte;
+    Histogram m_range_attempt_first_byte;
+    // declared last, so that the threads running attempts are stopped before
+    // anything the attempts use is destroyed
+    RequestRunner m_runner;
+    // runs stripes, which make requests through m_runner
+    TaskPool m_stripe_pool;
 };
 
 }
@@ -0,0 +1,181 @@
+/*******************************************************************************
+ * Copyright (c) 2012, Andrzej Zawadzki (azawadzki@gmail.com)
+ *
+ * soakfs is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * soakfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with soakfs; if not, see <http ://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#ifndef SOAKFS_STATS_HPP
+#define SOAKFS_STATS_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <string>
+
+namespace soak {
+
+// Runtime counters cheap enough for the hot paths: updates are relaxed atomic
+// increments, so readers may see values from slightly different moments.
+
+class Counter {
+
+public:
+
+    Counter()
+    : m_value(0) {
+
+    }
+
+    void add(uint64_t n) noexcept {
+        m_value.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    Counter& operator++() noexcept {
+        add(1);
+        return *this;
+    }
+
+    uint64_t value() const noexcept {
+        return m_value.load(std::memory_order_relaxed);
+    }
+
+private:
+
+    std::atomic<uint64_t> m_value;
+};
+
+// Distribution of durations in microseconds. Bucket n holds values of n
+// significant bits, so percentiles are reported as the upper bound of their
+// power of two bucket.
+class Histogram {
+
+public:
+
+    enum : size_t {
+        BUCKETS = 40
+    };
+
+    Histogram()
+    : m_count(0)
+    , m_sum(0)
+    , m_max(0) {
+        for (std::atomic<uint64_t> &bucket : m_buckets) {
+            bucket.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    void add(uint64_t us) noexcept {
+        const size_t bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+        m_buckets[bucket < BUCKETS ? bucket : BUCKETS - 1].fetch_add(1, std::memory_order_relaxed);
+        m_count.fetch_add(1, std::memory_order_relaxed);
+        m_sum.fetch_add(us, std::memory_order_relaxed);
+        uint64_t max = m_max.load(std::memory_order_relaxed);
+        while (us > max && !m_max.compare_exchange_weak(max, us, std::memory_order_relaxed)) {
+        }
+    }
+
+    uint64_t count() const noexcept {
+        return m_count.load(std::memory_order_relaxed);
+    }
+
+    uint64_t sum() const noexcept {
+        return m_sum.load(std::memory_order_relaxed);
+    }
+
+    uint64_t max() const noexcept {
+        return m_max.load(std::memory_order_relaxed);
+    }
+
+    // p is in [0, 1]
+    uint64_t percentile(double p) const noexcept {
+        uint64_t total = 0;
+        for (const std::atomic<uint64_t> &bucket : m_buckets) {
+            total += bucket.load(std::memory_order_relaxed);
+        }
+        const uint64_t rank = static_cast<uint64_t>(p * total + 0.5);
+        uint64_t seen = 0;
+        for (size_t i = 0; i < BUCKETS; ++i) {
+            seen += m_buckets[i].load(std::memory_order_relaxed);
+            if (seen >= rank && seen > 0) {
+                const uint64_t upper = i == 0 ? 0 : (uint64_t(1) << i) - 1;
+                return upper < max() ? upper : max();
+            }
+        }
+        return max();
+    }
+
+    // writes a single line: name count=... total_ms=... p50_us=... etc.
+    void write(std::ostream &out, const std::string &name) const {
+        out << name
+            << " count=" << count()
+            << " total_ms=" << sum() / 1000
+            << " p50_us=" << percentile(0.5)
+            << " p90_us=" << percentile(0.9)
+            << " p99_us=" << percentile(0.99)
+            << " max_us=" << max()
+            << "\n";
+    }
+
+private:
+
+    std::atomic<uint64_t> m_buckets[BUCKETS];
+    std::atomic<uint64_t> m_count;
+    std::atomic<uint64_t> m_sum;
+    std::atomic<uint64_t> m_max;
+};
+
+// adds the lifetime of the object to a histogram
+class ScopedTimer {
+
+public:
+
+    explicit ScopedTimer(Histogram &histogram)
+    : m_histogram(histogram)
+    , m_start(std::chrono::steady_clock::now()) {
+
+    }
+
+    ~ScopedTimer() {
+        m_histogram.add(elapsed_us());
+    }
+
+    uint64_t elapsed_us() const noexcept {
+        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - m_start).count();
+    }
+
+private:
+
+    ScopedTimer(const ScopedTimer&);
+    ScopedTimer& operator=(const ScopedTimer&);
+
+    Histogram &m_histogram;
+    const std::chrono::steady_clock::time_point m_start;
+};
+
+// locks mutex, recording the wait if it was held by someone else.
+// Uncontended locking costs no clock reads.
+template<typename Mutex>
+std::unique_lock<Mutex> timed_lock(Mutex &mutex, Histogram &waits) {
+    std::unique_lock<Mutex> lock(mutex, std::try_to_lock);
+    if (!lock.owns_lock()) {
+        ScopedTimer timer { waits };
+        lock.lock();
+    }
+    return lock;
+}
+
+}
+
+#endif // SOAKFS_STATS_HPP
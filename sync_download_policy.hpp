@@ -0,0 +1,451 @@
+/*******************************************************************************
+ * Copyright (c) 2012, Andrzej Zawadzki (azawadzki@gmail.com)
+ *
+ * soakfs is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * soakfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with soakfs; if not, see <http ://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#ifndef SOAKFS_SYNC_DOWNLOAD_POLICY_HPP
+#define SOAKFS_SYNC_DOWNLOAD_POLICY_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#include "connection_pool.hpp"
+#include "http_client.hpp"
+#include "inflate_sink.hpp"
+#include "soakfs_api.hpp"
+
+namespace soak {
+
+// Transport running each request on the calling thread, over blocking
+// sockets. Sockets get a receive timeout of `requests.timeout` seconds, so a
+// request to a server which went silent fails by itself and gives its
+// connection back, rather than holding it and its thread forever.
+// Keep-alive connections are reused, up to `connections` at once; further
+// requests wait for a free one.
+class DownloadPolicySync {
+
+    struct Connection;
+
+public:
+
+    struct Options {
+        Options()
+        : connections(8)
+        , idle_timeout(30)
+        , stripe_size(1024 * 1024)
+        , stripes(4) {
+
+        }
+
+        // deadlines, hedging and retries of requests
+        RequestRunner::Settings requests;
+        // maximal number of simultaneously open connections
+        size_t connections;
+        // seconds after which an unused connection is closed
+        unsigned idle_timeout;
+        // ranges of at least two stripes are downloaded in stripe sized
+        // pieces over several connections at once; 0 disables striping
+        size_t stripe_size;
+        // maximal number of pieces of a single range downloaded at once
+        size_t stripes;
+    };
+
+    DownloadPolicySync(const std::string &username, const std::string &password, const Options &options = Options())
+    : m_auth(http_basic_auth(username, password))
+    , m_timeout(options.requests.timeout)
+    , m_tls(create_tls_context())
+    , m_connections(options.connections, std::chrono::seconds(options.idle_timeout),
+        [] { return std::unique_ptr<Connection>(new Connection); })
+    , m_aborted(false) {
+
+    }
+
+    ~DownloadPolicySync() {
+        m_connections.clear();
+        SSL_CTX_free(m_tls);
+    }
+
+protected:
+
+    void load(const std::string &url, const Sink &sink, std::pair<long, long> range) {
+        const HttpTarget target { parse_http_url(url) };
+        const bool listing = is_listing_url(url);
+        const std::string head { http_request_head(target, m_auth, range, listing) };
+        // the response being received, for its Content-Encoding
+        const Connection *current = nullptr;
+        InflateSink inflated { sink, [&current] { return current->response.content_encoding(); } };
+        const Sink body { listing ? Sink(std::ref(inflated)) : sink };
+        const SigpipeGuard guard;
+        bool received = false;
+        {
+            ConnectionPool<Connection>::Lease conn { m_connections.acquire() };
+            const bool reused = conn->key == target.key();
+            int status = 0;
+            current = &*conn;
+            try {
+                status = request(*conn, target, head, body, received);
+            } catch (const TimeoutException&) {
+                conn.discard();
+                throw;
+            } catch (...) {
+                conn.discard();
+                if (received || !reused) {
+                    throw;
+                }
+                // the server may have closed an idle keep-alive connection.
+                // Retry once on another one before giving up.
+            }
+            if (status != 0) {
+                finish(status, url, inflated, listing);
+                return;
+            }
+        }
+        ConnectionPool<Connection>::Lease fresh { m_connections.acquire() };
+        fresh->close();
+        int status;
+        current = &*fresh;
+        try {
+            status = request(*fresh, target, head, body, received);
+        } catch (...) {
+            fresh.discard();
+            throw;
+        }
+        finish(status, url, inflated, listing);
+    }
+
+    void start() {
+
+    }
+
+    // closes idle connections, which might not survive daemonizing
+    void kill_running_threads() {
+        m_connections.clear();
+    }
+
+    // makes requests in progress fail right away and refuses new ones, so
+    // that nobody is left waiting for a server which doesn't answer
+    void abort() {
+        std::lock_guard<std::mutex> lock(m_busy_mutex);
+        m_aborted = true;
+        for (int fd : m_busy) {
+            shutdown(fd, SHUT_RDWR);
+        }
+    }
+
+private:
+
+    struct Connection {
+        Connection()
+        : fd(-1)
+        , ssl(nullptr) {
+
+        }
+
+        ~Connection() {
+            close();
+        }
+
+        void close() {
+            if (ssl != nullptr) {
+                SSL_free(ssl);
+                ssl = nullptr;
+            }
+            if (fd != -1) {
+                ::close(fd);
+                fd = -1;
+            }
+            key.clear();
+        }
+
+        // server the socket is connected to, empty if it isn't
+        std::string key;
+        int fd;
+        SSL *ssl;
+        HttpResponseParser response;
+        char buffer[64 * 1024];
+    };
+
+    // marks fd as used by a request in progress, for abort()
+    class Busy {
+
+    public:
+
+        Busy(DownloadPolicySync &policy, int fd)
+        : m_policy(policy)
+        , m_fd(fd) {
+            std::lock_guard<std::mutex> lock(m_policy.m_busy_mutex);
+            if (m_policy.m_aborted) {
+                throw std::runtime_error("transport shut down");
+            }
+            m_policy.m_busy.insert(m_fd);
+        }
+
+        ~Busy() {
+            std::lock_guard<std::mutex> lock(m_policy.m_busy_mutex);
+            m_policy.m_busy.erase(m_fd);
+        }
+
+    private:
+
+        Busy(const Busy&);
+        Busy& operator=(const Busy&);
+
+        DownloadPolicySync &m_policy;
+        const int m_fd;
+    };
+
+    // returns the status of the response, with the body passed to sink.
+    // received tells if anything came back, in which case a failure can't be
+    // blamed on a stale keep-alive connection. A connection which can't be
+    // used for another request is left closed.
+    int request(Connection &c, const HttpTarget &target, const std::string &head, const Sink &body, bool &received) {
+        if (c.key != target.key()) {
+            c.close();
+            connect(c, target);
+        }
+        bool reusable = false;
+        {
+            const Busy busy { *this, c.fd };
+            c.response.reset();
+            write_all(c, head.data(), head.size());
+            for (;;) {
+                const size_t n = read_some(c, c.buffer, sizeof(c.buffer));
+                if (n == 0) {
+                    c.response.on_close();
+                    if (!c.response.complete()) {
+                        throw std::runtime_error(target.host + ": connection closed");
+                    }
+                    break;
+                }
+                received = true;
+                const size_t used = c.response.feed(c.buffer, n, body);
+                if (c.response.complete()) {
+                    // anything past the response means the connection is
+                    // out of step with the server
+                    reusable = used == n && c.response.keep_alive();
+                    break;
+                }
+            }
+        }
+        if (!reusable) {
+            // not before the socket is forgotten by abort()
+            c.close();
+        }
+        return c.response.status();
+    }
+
+    // the connection goes back to the pool even if the server reported an
+    // error, as the response was read in full
+    static void finish(int status, const std::string &url, InflateSink &inflated, bool listing) {
+        check_http_status(url, status);
+        if (listing) {
+            inflated.finish();
+        }
+    }
+
+    // tries every address of the server in turn
+    void connect(Connection &c, const HttpTarget &target) {
+        addrinfo hints {};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo *addresses = nullptr;
+        const int ret = getaddrinfo(target.host.c_str(), target.port.c_str(), &hints, &addresses);
+        if (ret != 0 || addresses == nullptr) {
+            throw std::runtime_error(target.host + ": " + gai_strerror(ret));
+        }
+        const std::unique_ptr<addrinfo, void(*)(addrinfo*)> guard { addresses, &freeaddrinfo };
+        int error = 0;
+        for (const addrinfo *a = addresses; a != nullptr && c.fd == -1; a = a->ai_next) {
+            error = connect_to(c, a);
+        }
+        if (c.fd == -1) {
+            throw std::runtime_error(target.host + ": " + std::strerror(error));
+        }
+        const int one = 1;
+        setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (m_timeout > 0) {
+            const timeval timeout { static_cast<time_t>(m_timeout), 0 };
+            setsockopt(c.fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            setsockopt(c.fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        }
+        if (target.tls) {
+            handshake(c, target);
+        }
+        c.key = target.key();
+    }
+
+    // connects without blocking for longer than the timeout, and leaves the
+    // socket blocking. Returns 0, or the error if it failed.
+    int connect_to(Connection &c, const addrinfo *address) {
+        const int fd = socket(address->ai_family, address->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, address->ai_protocol);
+        if (fd == -1) {
+            return errno;
+        }
+        int error = 0;
+        if (::connect(fd, address->ai_addr, address->ai_addrlen) != 0) {
+            error = errno;
+            if (error == EINPROGRESS) {
+                pollfd p { fd, POLLOUT, 0 };
+                int ready;
+                do {
+                    ready = poll(&p, 1, m_timeout > 0 ? static_cast<int>(m_timeout * 1000) : -1);
+                } while (ready < 0 && errno == EINTR);
+                socklen_t length = sizeof(error);
+                if (ready == 0) {
+                    error = ETIMEDOUT;
+                } else if (ready < 0 || getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) != 0) {
+                    error = errno;
+                }
+            }
+        }
+        if (error != 0 || fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK) != 0) {
+            error = error != 0 ? error : errno;
+            ::close(fd);
+            return error;
+        }
+        c.fd = fd;
+        return 0;
+    }
+
+    void handshake(Connection &c, const HttpTarget &target) {
+        c.ssl = create_tls_connection(m_tls, c.fd, target.host);
+        const Busy busy { *this, c.fd };
+        for (;;) {
+            ERR_clear_error();
+            const int ret = SSL_connect(c.ssl);
+            if (ret == 1) {
+                return;
+            }
+            if (!interrupted(c, ret)) {
+                throw_tls_error(c, ret, target.host + ": TLS handshake failed: ");
+            }
+        }
+    }
+
+    void write_all(Connection &c, const char *data, size_t size) {
+        while (size > 0) {
+            ssize_t n;
+            if (c.ssl == nullptr) {
+                n = ::send(c.fd, data, size, MSG_NOSIGNAL);
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (n < 0) {
+                    throw_socket_error();
+                }
+            } else {
+                ERR_clear_error();
+                n = SSL_write(c.ssl, data, size);
+                if (n <= 0) {
+                    if (interrupted(c, n)) {
+                        continue;
+                    }
+                    throw_tls_error(c, n, "");
+                }
+            }
+            data += n;
+            size -= n;
+        }
+    }
+
+    // returns 0 at the end of the stream
+    size_t read_some(Connection &c, char *data, size_t size) {
+        for (;;) {
+            if (c.ssl == nullptr) {
+                const ssize_t n = recv(c.fd, data, size, 0);
+                if (n >= 0) {
+                    return n;
+                }
+                if (errno != EINTR) {
+                    throw_socket_error();
+                }
+                continue;
+            }
+            ERR_clear_error();
+            const int n = SSL_read(c.ssl, data, size);
+            if (n > 0) {
+                return n;
+            }
+            const int error = SSL_get_error(c.ssl, n);
+            if (error == SSL_ERROR_ZERO_RETURN || (error == SSL_ERROR_SYSCALL && ERR_peek_error() == 0 && n == 0)) {
+                // orderly or abrupt close
+                return 0;
+            }
+            if (!interrupted(c, n)) {
+                throw_tls_error(c, n, "");
+            }
+        }
+    }
+
+    // a blocking TLS call which failed for want of the socket was either
+    // interrupted by a signal, and can be repeated, or ran out of time
+    static bool interrupted(Connection &c, int ret) {
+        const int error = SSL_get_error(c.ssl, ret);
+        return (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE || error == SSL_ERROR_SYSCALL) && errno == EINTR;
+    }
+
+    static void throw_socket_error() {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            throw TimeoutException();
+        }
+        throw std::runtime_error(std::strerror(errno));
+    }
+
+    static void throw_tls_error(Connection &c, int ret, const std::string &prefix) {
+        const int error = SSL_get_error(c.ssl, ret);
+        if ((error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE || error == SSL_ERROR_SYSCALL)
+                && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            throw TimeoutException();
+        }
+        if (error == SSL_ERROR_SYSCALL && ERR_peek_error() == 0) {
+            throw std::runtime_error(prefix + std::strerror(errno));
+        }
+        throw std::runtime_error(prefix + tls_error());
+    }
+
+    const std::string m_auth;
+    const unsigned m_timeout;
+    SSL_CTX *m_tls;
+    ConnectionPool<Connection> m_connections;
+    // sockets of requests in progress
+    std::set<int> m_busy;
+    bool m_aborted;
+    std::mutex m_busy_mutex;
+};
+
+}
+
+#endif // SOAKFS_SYNC_DOWNLOAD_POLICY_HPP
@@ -0,0 +1,123 @@
+/*******************************************************************************
+ * Copyright (c) 2012, Andrzej Zawadzki (azawadzki@gmail.com)
+ *
+ * soakfs is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * soakfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with soakfs; if not, see <http ://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#ifndef SOAKFS_TASK_POOL_HPP
+#define SOAKFS_TASK_POOL_HPP
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace soak {
+
+// Fixed set of threads running queued tasks in FIFO order.
+class TaskPool {
+
+public:
+
+    typedef std::function<void()> task_t;
+
+    explicit TaskPool(size_t threads)
+    : m_thread_count(threads)
+    , m_stopping(false) {
+
+    }
+
+    ~TaskPool() {
+        stop();
+    }
+
+    // threads must not be started before fuse is initialized, see the comment
+    // in main()
+    void start() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (size_t i = m_threads.size(); i < m_thread_count; ++i) {
+            m_threads.push_back(std::thread(&TaskPool::run, this));
+        }
+    }
+
+    // queued tasks which haven't started yet are dropped, with their discard
+    // callbacks called instead
+    void stop() {
+        std::deque<Task> dropped;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stopping = true;
+            dropped.swap(m_tasks);
+        }
+        m_tasks_cond.notify_all();
+        for (Task &t : dropped) {
+            if (t.discard) {
+                t.discard();
+            }
+        }
+        for (std::thread &t : m_threads) {
+            t.join();
+        }
+        m_threads.clear();
+    }
+
+    // returns false if the task could not be queued because the pool is not
+    // running. discard is called in place of a task dropped by stop().
+    bool post(task_t task, task_t discard = task_t()) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_stopping || m_threads.empty()) {
+                return false;
+            }
+            m_tasks.push_back(Task { std::move(task), std::move(discard) });
+        }
+        m_tasks_cond.notify_one();
+        return true;
+    }
+
+private:
+
+    struct Task {
+        task_t run;
+        task_t discard;
+    };
+
+    void run() {
+        for (;;) {
+            task_t task;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_tasks_cond.wait(lock, [this] { return m_stopping || !m_tasks.empty(); });
+                if (m_stopping) {
+                    return;
+                }
+                task = std::move(m_tasks.front().run);
+                m_tasks.pop_front();
+            }
+            task();
+        }
+    }
+
+    const size_t m_thread_count;
+    bool m_stopping;
+    std::deque<Task> m_tasks;
+    std::vector<std::thread> m_threads;
+    std::mutex m_mutex;
+    std::condition_variable m_tasks_cond;
+};
+
+}
+
+#endif // SOAKFS_TASK_POOL_HPP
@@ -0,0 +1,76 @@
+/*******************************************************************************
+ * Copyright (c) 2012, Andrzej Zawadzki (azawadzki@gmail.com)
+ *
+ * soakfs is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * soakfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with soakfs; if not, see <http ://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#ifndef SOAKFS_TEST_HPP
+#define SOAKFS_TEST_HPP
+
+#include <exception>
+#include <iostream>
+
+// Bare bones checks shared by the test programs. A failed check is reported
+// and the test goes on, so that one run shows every failure; the program
+// exits with 1 if there were any.
+
+namespace soak {
+namespace test {
+
+inline int& failures() {
+    static int count = 0;
+    return count;
+}
+
+inline void check(bool ok, const char *what, const char *file, int line) {
+    if (!ok) {
+        ++failures();
+        std::cerr << file << ":" << line << ": check failed: " << what << std::endl;
+    }
+}
+
+// runs a single test, counting an exception escaping it as a failure
+template<typename Test>
+void run(const char *name, Test test) {
+    try {
+        test();
+    } catch (const std::exception &e) {
+        ++failures();
+        std::cerr << name << ": unexpected exception: " << e.what() << std::endl;
+    } catch (...) {
+        ++failures();
+        std::cerr << name << ": unexpected exception" << std::endl;
+    }
+}
+
+inline int result() {
+    return failures() == 0 ? 0 : 1;
+}
+
+}
+}
+
+#define CHECK(cond) soak::test::check((cond), #cond, __FILE__, __LINE__)
+
+#define CHECK_THROWS(expr, type) \
+    do { \
+        bool thrown = false; \
+        try { \
+            expr; \
+        } catch (const type&) { \
+            thrown = true; \
+        } \
+        soak::test::check(thrown, #expr " throws " #type, __FILE__, __LINE__); \
+    } while (0)
+
+#endif // SOAKFS_TEST_HPP
@@ -0,0 +1,192 @@
+/*******************************************************************************
+ * Copyright (c) 2012, Andrzej Zawadzki (azawadzki@gmail.com)
+ *
+ * soakfs is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * soakfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with soakfs; if not, see <http ://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#include "disk_cache.hpp"
+#include "test.hpp"
+
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+// Checks that the disk cache finds its blocks again after a restart, and
+// that it copes with chunk files and index lines which went missing or bad.
+
+using soak::DiskCache;
+
+namespace {
+
+// empty directory removed at the end of a test
+class TempDir {
+
+public:
+
+    TempDir()
+    : m_path((boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("soakfs-test-%%%%-%%%%")).string()) {
+        boost::filesystem::create_directories(m_path);
+    }
+
+    ~TempDir() {
+        boost::system::error_code ec;
+        boost::filesystem::remove_all(m_path, ec);
+    }
+
+    const std::string& path() const noexcept {
+        return m_path;
+    }
+
+private:
+
+    const std::string m_path;
+};
+
+DiskCache::Block block(const std::string &data) {
+    return std::make_shared<const std::vector<char>>(data.begin(), data.end());
+}
+
+std::string str(const DiskCache::Block &b) {
+    return b ? std::string(b->begin(), b->end()) : std::string("<miss>");
+}
+
+const size_t BUDGET = 1024 * 1024;
+
+void test_round_trip() {
+    const TempDir dir;
+    {
+        DiskCache cache { dir.path(), BUDGET };
+        cache.put("/a", 0, 100, 1, block("a0"));
+        cache.put("/a", 1, 100, 1, block("a1"));
+        cache.put("/dir with spaces/b c", 7, 100, 1, block("b7"));
+        cache.put("/e", 0, 0, 1, block(""));
+        CHECK(str(cache.get("/a", 1, 100, 1)) == "a1");
+    }
+    DiskCache cache { dir.path(), BUDGET };
+    CHECK(str(cache.get("/a", 0, 100, 1)) == "a0");
+    CHECK(str(cache.get("/a", 1, 100, 1)) == "a1");
+    CHECK(str(cache.get("/dir with spaces/b c", 7, 100, 1)) == "b7");
+    CHECK(str(cache.get("/e", 0, 0, 1)) == "");
+    CHECK(cache.contains("/a", 0, 100, 1));
+    CHECK(!cache.contains("/a", 2, 100, 1));
+    CHECK(!cache.get("/a", 2, 100, 1));
+}
+
+void test_versions() {
+    const TempDir dir;
+    {
+        DiskCache cache { dir.path(), BUDGET };
+        cache.put("/f", 0, 100, 1, block("old"));
+        cache.put("/f", 0, 200, 2, block("new"));
+    }
+    DiskCache cache { dir.path(), BUDGET };
+    CHECK(str(cache.get("/f", 0, 100, 1)) == "old");
+    CHECK(str(cache.get("/f", 0, 200, 2)) == "new");
+    CHECK(!cache.get("/f", 0, 100, 2));
+    CHECK(!cache.get("/f", 0, 200, 1));
+}
+
+void test_replaced_block() {
+    const TempDir dir;
+    {
+        DiskCache cache { dir.path(), BUDGET };
+        cache.put("/f", 0, 100, 1, block("first"));
+        cache.put("/f", 0, 100, 1, block("second"));
+    }
+    DiskCache cache { dir.path(), BUDGET };
+    CHECK(str(cache.get("/f", 0, 100, 1)) == "second");
+    // the replaced chunk is gone
+    size_t chunks = 0;
+    for (boost::filesystem::directory_iterator iter { dir.path() + "/chunks" }; iter != boost::filesystem::directory_iterator(); ++iter) {
+        ++chunks;
+    }
+    CHECK(chunks == 1);
+}
+
+// the least recently used blocks go first, in the order kept by the index
+void test_lru_order_survives_restart() {
+    const TempDir dir;
+    const std::string data(1000, 'x');
+    {
+        DiskCache cache { dir.path(), BUDGET };
+        for (unsigned long i = 0; i < 4; ++i) {
+            cache.put("/f", i, 4000, 1, block(data));
+        }
+        // block 0 becomes the most recently used
+        CHECK(cache.get("/f", 0, 4000, 1) != nullptr);
+    }
+    // room for about two blocks
+    DiskCache cache { dir.path(), 2500 };
+    CHECK(cache.contains("/f", 0, 4000, 1));
+    CHECK(cache.contains("/f", 3, 4000, 1));
+    CHECK(!cache.contains("/f", 1, 4000, 1));
+    CHECK(!cache.contains("/f", 2, 4000, 1));
+}
+
+void test_missing_chunk() {
+    const TempDir dir;
+    {
+        DiskCache cache { dir.path(), BUDGET };
+        cache.put("/f", 0, 100, 1, block("zero"));
+        cache.put("/f", 1, 100, 1, block("one"));
+        cache.flush();
+        // removed behind the cache's back while it runs
+        boost::filesystem::remove_all(dir.path() + "/chunks");
+        boost::filesystem::create_directories(dir.path() + "/chunks");
+        CHECK(!cache.get("/f", 0, 100, 1));
+        CHECK(!cache.contains("/f", 0, 100, 1));
+        cache.put("/f", 2, 100, 1, block("two"));
+    }
+    DiskCache cache { dir.path(), BUDGET };
+    CHECK(!cache.contains("/f", 0, 100, 1));
+    // its index entry is still there, but its chunk is not
+    CHECK(!cache.contains("/f", 1, 100, 1));
+    CHECK(str(cache.get("/f", 2, 100, 1)) == "two");
+}
+
+void test_damaged_index() {
+    const TempDir dir;
+    {
+        DiskCache cache { dir.path(), BUDGET };
+        cache.put("/f", 0, 100, 1, block("zero"));
+        cache.put("/f", 1, 100, 1, block("one"));
+    }
+    {
+        std::ofstream index { (dir.path() + "/index").c_str(), std::ios::app };
+        index << "garbage\n" << "5 0 100 1 4 100 /too/short\n";
+    }
+    {
+        // a chunk the index doesn't know about, e.g. after a crash
+        std::ofstream stray { (dir.path() + "/chunks/12345").c_str() };
+        stray << "stray";
+    }
+    DiskCache cache { dir.path(), BUDGET };
+    CHECK(str(cache.get("/f", 0, 100, 1)) == "zero");
+    CHECK(str(cache.get("/f", 1, 100, 1)) == "one");
+    CHECK(!boost::filesystem::exists(dir.path() + "/chunks/12345"));
+}
+
+}
+
+int main() {
+    soak::test::run("round_trip", test_round_trip);
+    soak::test::run("versions", test_versions);
+    soak::test::run("replaced_block", test_replaced_block);
+    soak::test::run("lru_order_survives_restart", test_lru_order_survives_restart);
+    soak::test::run("missing_chunk", test_missing_chunk);
+    soak::test::run("damaged_index", test_damaged_index);
+    return soak::test::result();
+}
@@ -0,0 +1,296 @@
+/*******************************************************************************
+ * Copyright (c) 2012, Andrzej Zawadzki (azawadzki@gmail.com)
+ *
+ * soakfs is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * soakfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with soakfs; if not, see <http ://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#include "http_client.hpp"
+#include "test.hpp"
+
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include <signal.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <openssl/evp.h>
+#include <openssl/rsa.h>
+#include <openssl/x509.h>
+
+// Checks of the response parser and of the verification of servers by the
+// TLS helpers the transports are built on.
+
+using soak::HttpResponseParser;
+
+namespace {
+
+struct Response {
+    std::string body;
+    // bytes of the input the parser didn't use
+    size_t left;
+};
+
+// feeds the parser in pieces of the given size, to see responses split at
+// every possible place
+Response parse(HttpResponseParser &parser, const std::string &data, size_t piece) {
+    Response r { std::string(), 0 };
+    const soak::Sink sink { [&r] (const char *d, size_t n) { r.body.append(d, n); } };
+    for (size_t pos = 0; pos < data.size(); pos += piece) {
+        const size_t n = std::min(piece, data.size() - pos);
+        const size_t used = parser.feed(data.data() + pos, n, sink);
+        if (used < n) {
+            r.left = data.size() - pos - used;
+            break;
+        }
+    }
+    return r;
+}
+
+const size_t PIECES[] = { 1, 2, 7, 1024 };
+
+void test_content_length() {
+    const std::string data { "HTTP/1.1 200 OK\r\nContent-Length: 11\r\n\r\nhello world" };
+    for (size_t piece : PIECES) {
+        HttpResponseParser parser;
+        const Response r { parse(parser, data, piece) };
+        CHECK(parser.complete());
+        CHECK(parser.status() == 200);
+        CHECK(parser.keep_alive());
+        CHECK(r.body == "hello world");
+    }
+}
+
+void test_chunked() {
+    const std::string data { "HTTP/1.1 206 Partial Content\r\nTransfer-Encoding: chunked\r\n\r\n"
+        "5;name=value\r\nhello\r\n1\r\n \r\nA\r\n0123456789\r\n0\r\nTrailer: yes\r\n\r\n" };
+    for (size_t piece : PIECES) {
+        HttpResponseParser parser;
+        const Response r { parse(parser, data, piece) };
+        CHECK(parser.complete());
+        CHECK(parser.status() == 206);
+        CHECK(r.body == "hello 0123456789");
+        CHECK(r.left == 0);
+    }
+}
+
+void test_malformed_chunk() {
+    HttpResponseParser parser;
+    CHECK_THROWS(parse(parser, "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\nxyz\r\n", 1024), std::runtime_error);
+}
+
+void test_until_close() {
+    const std::string data { "HTTP/1.1 200 OK\r\nConnection: keep-alive\r\n\r\nno length" };
+    for (size_t piece : PIECES) {
+        HttpResponseParser parser;
+        const Response r { parse(parser, data, piece) };
+        CHECK(!parser.complete());
+        parser.on_close();
+        CHECK(parser.complete());
+        CHECK(!parser.keep_alive());
+        CHECK(r.body == "no length");
+    }
+}
+
+void test_truncated() {
+    const std::string responses[] = {
+        "HTTP/1.1 200 OK\r\nContent-Length: 11\r\n\r\nhello",
+        "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n5\r\nhello\r\n",
+        "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n5\r\nhel",
+        "HTTP/1.1 200 OK\r\nContent-Le"
+    };
+    for (const std::string &data : responses) {
+        HttpResponseParser parser;
+        parse(parser, data, 1024);
+        parser.on_close();
+        CHECK(!parser.complete());
+    }
+}
+
+void test_error_body_skipped() {
+    HttpResponseParser parser;
+    const Response r { parse(parser, "HTTP/1.1 404 Not Found\r\nContent-Length: 9\r\n\r\nnot found", 1024) };
+    CHECK(parser.complete());
+    CHECK(parser.status() == 404);
+    CHECK(!parser.successful());
+    CHECK(r.body.empty());
+}
+
+void test_interim_response() {
+    HttpResponseParser parser;
+    const Response r { parse(parser, "HTTP/1.1 100 Continue\r\n\r\nHTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok", 3) };
+    CHECK(parser.complete());
+    CHECK(parser.status() == 200);
+    CHECK(r.body == "ok");
+}
+
+void test_no_body() {
+    HttpResponseParser parser;
+    parse(parser, "HTTP/1.1 204 No Content\r\n\r\n", 1024);
+    CHECK(parser.complete());
+}
+
+void test_connection_header() {
+    HttpResponseParser parser;
+    parse(parser, "HTTP/1.1 200 OK\r\nconnection: Close\r\ncontent-length: 0\r\n\r\n", 1024);
+    CHECK(parser.complete());
+    CHECK(!parser.keep_alive());
+    parser.reset();
+    parse(parser, "HTTP/1.0 200 OK\r\nContent-Length: 0\r\n\r\n", 1024);
+    CHECK(!parser.keep_alive());
+    parser.reset();
+    parse(parser, "HTTP/1.0 200 OK\r\nConnection: keep-alive\r\nContent-Length: 0\r\n\r\n", 1024);
+    CHECK(parser.keep_alive());
+}
+
+void test_content_encoding() {
+    HttpResponseParser parser;
+    parse(parser, "HTTP/1.1 200 OK\r\nContent-Encoding:  GZip \r\nContent-Length: 0\r\n\r\n", 1024);
+    CHECK(parser.content_encoding() == "gzip");
+    parser.reset();
+    parse(parser, "HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n", 1024);
+    CHECK(parser.content_encoding().empty());
+}
+
+void test_data_past_response() {
+    HttpResponseParser parser;
+    const Response r { parse(parser, "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nokHTTP/1.1", 1024) };
+    CHECK(parser.complete());
+    CHECK(r.body == "ok");
+    CHECK(r.left == 8);
+}
+
+void test_malformed_status() {
+    HttpResponseParser parser;
+    CHECK_THROWS(parse(parser, "ICY 200 OK\r\n\r\n", 1024), std::runtime_error);
+}
+
+void test_parse_url() {
+    const soak::HttpTarget a { soak::parse_http_url("https://example.com/a/b?c") };
+    CHECK(a.tls);
+    CHECK(a.host == "example.com");
+    CHECK(a.port == "443");
+    CHECK(a.path == "/a/b?c");
+    const soak::HttpTarget b { soak::parse_http_url("http://127.0.0.1:8080") };
+    CHECK(!b.tls);
+    CHECK(b.host == "127.0.0.1");
+    CHECK(b.port == "8080");
+    CHECK(b.authority == "127.0.0.1:8080");
+    CHECK(b.path == "/");
+    CHECK_THROWS(soak::parse_http_url("ftp://example.com/"), std::invalid_argument);
+}
+
+std::shared_ptr<EVP_PKEY> generate_key() {
+    const std::shared_ptr<EVP_PKEY_CTX> ctx { EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, nullptr), &EVP_PKEY_CTX_free };
+    EVP_PKEY *key = nullptr;
+    if (!ctx || EVP_PKEY_keygen_init(ctx.get()) != 1 || EVP_PKEY_CTX_set_rsa_keygen_bits(ctx.get(), 2048) != 1
+            || EVP_PKEY_keygen(ctx.get(), &key) != 1) {
+        throw std::runtime_error("unable to generate a key");
+    }
+    return std::shared_ptr<EVP_PKEY>(key, &EVP_PKEY_free);
+}
+
+// self-signed certificate of a server named localhost
+struct Certificate {
+    Certificate()
+    : key(generate_key())
+    , cert(X509_new(), &X509_free) {
+        X509 *x = cert.get();
+        X509_set_version(x, 2);
+        ASN1_INTEGER_set(X509_get_serialNumber(x), 1);
+        X509_gmtime_adj(X509_getm_notBefore(x), -60);
+        X509_gmtime_adj(X509_getm_notAfter(x), 3600);
+        X509_set_pubkey(x, key.get());
+        X509_NAME *name = X509_get_subject_name(x);
+        X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, reinterpret_cast<const unsigned char*>("localhost"), -1, -1, 0);
+        X509_set_issuer_name(x, name);
+        X509V3_CTX v3;
+        X509V3_set_ctx_nodb(&v3);
+        X509V3_set_ctx(&v3, x, x, nullptr, nullptr, 0);
+        X509_EXTENSION *san = X509V3_EXT_conf_nid(nullptr, &v3, NID_subject_alt_name, const_cast<char*>("DNS:localhost"));
+        if (san == nullptr || X509_add_ext(x, san, -1) != 1 || X509_sign(x, key.get(), EVP_sha256()) == 0) {
+            throw std::runtime_error("unable to make a certificate");
+        }
+        X509_EXTENSION_free(san);
+    }
+
+    std::shared_ptr<EVP_PKEY> key;
+    std::shared_ptr<X509> cert;
+};
+
+// runs a TLS handshake with a server presenting cert over a socket pair and
+// tells if the client accepted it
+bool handshake(const Certificate &cert, bool trusted, const std::string &host) {
+    SSL_CTX *client_ctx = soak::create_tls_context();
+    if (trusted) {
+        X509_STORE_add_cert(SSL_CTX_get_cert_store(client_ctx), cert.cert.get());
+    }
+    SSL_CTX *server_ctx = SSL_CTX_new(TLS_server_method());
+    SSL_CTX_use_certificate(server_ctx, cert.cert.get());
+    SSL_CTX_use_PrivateKey(server_ctx, cert.key.get());
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        throw std::runtime_error("socketpair failed");
+    }
+    std::thread server([server_ctx, &fds] {
+        SSL *ssl = SSL_new(server_ctx);
+        SSL_set_fd(ssl, fds[1]);
+        SSL_accept(ssl);
+        SSL_free(ssl);
+        close(fds[1]);
+    });
+    SSL *ssl = soak::create_tls_connection(client_ctx, fds[0], host);
+    const bool accepted = SSL_connect(ssl) == 1 && SSL_get_verify_result(ssl) == X509_V_OK;
+    SSL_free(ssl);
+    // lets a server still waiting for the handshake give up
+    close(fds[0]);
+    server.join();
+    SSL_CTX_free(server_ctx);
+    SSL_CTX_free(client_ctx);
+    return accepted;
+}
+
+void test_tls_verification() {
+    const Certificate cert;
+    CHECK(handshake(cert, true, "localhost"));
+    // host name doesn't match the certificate
+    CHECK(!handshake(cert, true, "example.com"));
+    // certificate not signed by anyone trusted
+    CHECK(!handshake(cert, false, "localhost"));
+}
+
+}
+
+int main() {
+    // the side of a failed handshake which gives up first closes its end,
+    // and the other one may still write to it
+    signal(SIGPIPE, SIG_IGN);
+    soak::test::run("content_length", test_content_length);
+    soak::test::run("chunked", test_chunked);
+    soak::test::run("malformed_chunk", test_malformed_chunk);
+    soak::test::run("until_close", test_until_close);
+    soak::test::run("truncated", test_truncated);
+    soak::test::run("error_body_skipped", test_error_body_skipped);
+    soak::test::run("interim_response", test_interim_response);
+    soak::test::run("no_body", test_no_body);
+    soak::test::run("connection_header", test_connection_header);
+    soak::test::run("content_encoding", test_content_encoding);
+    soak::test::run("data_past_response", test_data_past_response);
+    soak::test::run("malformed_status", test_malformed_status);
+    soak::test::run("parse_url", test_parse_url);
+    soak::test::run("tls_verification", test_tls_verification);
+    return soak::test::result();
+}
@@ -0,0 +1,174 @@
+/*******************************************************************************
+ * Copyright (c) 2012, Andrzej Zawadzki (azawadzki@gmail.com)
+ *
+ * soakfs is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * soakfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with soakfs; if not, see <http ://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#include "inflate_sink.hpp"
+#include "test.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include <zlib.h>
+
+// Checks that response bodies are decoded according to their
+// Content-Encoding, whichever way they are split into pieces.
+
+using soak::InflateSink;
+
+namespace {
+
+// window bits as taken by deflateInit2: 16 + MAX_WBITS for gzip, MAX_WBITS
+// for zlib and -MAX_WBITS for raw deflate
+std::string compress(const std::string &data, int window_bits) {
+    z_stream stream;
+    std::memset(&stream, 0, sizeof(stream));
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        throw std::runtime_error("unable to initialize zlib");
+    }
+    std::string compressed(deflateBound(&stream, data.size()), '\0');
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+    stream.avail_in = data.size();
+    stream.next_out = reinterpret_cast<Bytef*>(&compressed[0]);
+    stream.avail_out = compressed.size();
+    const int ret = deflate(&stream, Z_FINISH);
+    compressed.resize(compressed.size() - stream.avail_out);
+    deflateEnd(&stream);
+    if (ret != Z_STREAM_END) {
+        throw std::runtime_error("unable to compress");
+    }
+    return compressed;
+}
+
+const int GZIP = 16 + MAX_WBITS;
+const int ZLIB = MAX_WBITS;
+const int RAW = -MAX_WBITS;
+
+// passes body to a sink in pieces of the given size and returns what came
+// out of it
+std::string decode(const std::string &encoding, const std::string &body, size_t piece) {
+    std::string out;
+    InflateSink sink { [&out] (const char *data, size_t size) { out.append(data, size); },
+        [&encoding] { return encoding; } };
+    for (size_t pos = 0; pos < body.size(); pos += piece) {
+        sink(body.data() + pos, std::min(piece, body.size() - pos));
+    }
+    sink.finish();
+    return out;
+}
+
+// a listing-like document, several times larger than the sink's buffer
+std::string document() {
+    std::string json { "{\"files\": [" };
+    for (int i = 0; i < 5000; ++i) {
+        json += std::string(i > 0 ? ", " : "") + "{\"name\": \"f" + std::to_string(i) + "\", \"size\": " + std::to_string(i * 7) + "}";
+    }
+    return json + "]}";
+}
+
+const size_t PIECES[] = { 1, 2, 5, 4096, 1 << 20 };
+
+void test_gzip() {
+    const std::string json { document() };
+    const std::string body { compress(json, GZIP) };
+    for (size_t piece : PIECES) {
+        CHECK(decode("gzip", body, piece) == json);
+        CHECK(decode("x-gzip", body, piece) == json);
+    }
+}
+
+void test_gzip_members() {
+    const std::string body { compress("first ", GZIP) + compress("second", GZIP) };
+    for (size_t piece : PIECES) {
+        CHECK(decode("gzip", body, piece) == "first second");
+    }
+}
+
+void test_deflate() {
+    const std::string json { document() };
+    for (size_t piece : PIECES) {
+        CHECK(decode("deflate", compress(json, ZLIB), piece) == json);
+        // sent by servers which take deflate to mean a raw stream
+        CHECK(decode("deflate", compress(json, RAW), piece) == json);
+    }
+}
+
+void test_identity() {
+    // looks like a gzip stream, which doesn't matter without the header
+    const std::string body { compress("data", GZIP) };
+    for (size_t piece : PIECES) {
+        CHECK(decode("", body, piece) == body);
+        CHECK(decode("identity", body, piece) == body);
+    }
+}
+
+void test_empty() {
+    CHECK(decode("", "", 1).empty());
+    CHECK(decode("gzip", compress("", GZIP), 1).empty());
+    CHECK(decode("deflate", compress("", ZLIB), 1).empty());
+}
+
+void test_unsupported() {
+    CHECK_THROWS(decode("br", "data", 4), std::runtime_error);
+}
+
+void test_truncated() {
+    const std::string json { document() };
+    const std::string gzip { compress(json, GZIP) };
+    const std::string zlib { compress(json, ZLIB) };
+    CHECK_THROWS(decode("gzip", gzip.substr(0, gzip.size() / 2), 100), std::runtime_error);
+    CHECK_THROWS(decode("gzip", gzip.substr(0, gzip.size() - 1), 100), std::runtime_error);
+    CHECK_THROWS(decode("deflate", zlib.substr(0, zlib.size() / 2), 100), std::runtime_error);
+    CHECK_THROWS(decode("deflate", zlib.substr(0, 1), 1), std::runtime_error);
+}
+
+void test_corrupted() {
+    std::string body { compress(document(), GZIP) };
+    body[body.size() / 2] ^= 0x55;
+    body[body.size() / 2 + 1] ^= 0x55;
+    CHECK_THROWS(decode("gzip", body, 4096), std::runtime_error);
+    // anything after a zlib stream is not part of it
+    CHECK_THROWS(decode("deflate", compress("data", ZLIB) + "more", 4096), std::runtime_error);
+}
+
+// the encoding is known only once the headers are parsed, which happens
+// after the sink is made
+void test_encoding_asked_late() {
+    std::string encoding;
+    std::string out;
+    InflateSink sink { [&out] (const char *data, size_t size) { out.append(data, size); },
+        [&encoding] { return encoding; } };
+    encoding = "gzip";
+    const std::string body { compress("late", GZIP) };
+    sink(body.data(), body.size());
+    sink.finish();
+    CHECK(out == "late");
+}
+
+}
+
+int main() {
+    soak::test::run("gzip", test_gzip);
+    soak::test::run("gzip_members", test_gzip_members);
+    soak::test::run("deflate", test_deflate);
+    soak::test::run("identity", test_identity);
+    soak::test::run("empty", test_empty);
+    soak::test::run("unsupported", test_unsupported);
+    soak::test::run("truncated", test_truncated);
+    soak::test::run("corrupted", test_corrupted);
+    soak::test::run("encoding_asked_late", test_encoding_asked_late);
+    return soak::test::result();
+}
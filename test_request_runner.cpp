@@ -0,0 +1,240 @@
+/*******************************************************************************
+ * Copyright (c) 2012, Andrzej Zawadzki (azawadzki@gmail.com)
+ *
+ * soakfs is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * soakfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with soakfs; if not, see <http ://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#include "mock_download_policy.hpp"
+#include "test.hpp"
+
+#include <chrono>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Checks that requests which stall time out and are retried, and that slow
+// ones are hedged, on the storage served by MockDownloadPolicy.
+
+using soak::Histogram;
+using soak::MockDownloadPolicy;
+using soak::RequestRunner;
+using soak::Storage;
+using soak::TimeoutException;
+
+namespace {
+
+typedef std::chrono::steady_clock clock;
+
+// mock server whose next responses can be held back
+class ScriptedPolicy : public MockDownloadPolicy {
+
+public:
+
+    ScriptedPolicy(const std::string &user, const std::string &pwd, const Options &options)
+    : MockDownloadPolicy(user, pwd, options)
+    , m_held(0)
+    , m_hold_ms(0)
+    , m_gives_up(false) {
+
+    }
+
+    // the next count responses start ms later. If gives_up, they end with a
+    // TimeoutException instead, like those of a transport whose socket timed
+    // out; otherwise the runner is the only one to notice the stall.
+    void hold(unsigned count, unsigned long ms, bool gives_up) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_held = count;
+        m_hold_ms = ms;
+        m_gives_up = gives_up;
+    }
+
+protected:
+
+    void load(const std::string &url, const soak::Sink &sink, std::pair<long, long> range) {
+        unsigned long ms = 0;
+        bool gives_up = false;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_held > 0) {
+                --m_held;
+                ms = m_hold_ms;
+                gives_up = m_gives_up;
+            }
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+        if (gives_up) {
+            throw TimeoutException();
+        }
+        MockDownloadPolicy::load(url, sink, range);
+    }
+
+private:
+
+    std::mutex m_mutex;
+    unsigned m_held;
+    unsigned long m_hold_ms;
+    bool m_gives_up;
+};
+
+typedef Storage<ScriptedPolicy> TestStorage;
+
+const std::string PATH { "/dev0/d0/f0" };
+const long SIZE = 4096;
+
+TestStorage::Options options(unsigned timeout, unsigned hedge_percentile, unsigned retries) {
+    TestStorage::Options o;
+    o.requests.timeout = timeout;
+    o.requests.hedge_percentile = hedge_percentile;
+    o.requests.retries = retries;
+    o.latency = 1000;
+    o.bandwidth = 0;
+    return o;
+}
+
+// downloads the first SIZE bytes of PATH and tells if they are what the mock
+// serves
+bool download(TestStorage &storage, const std::string &url) {
+    std::vector<char> buf(SIZE);
+    storage.download_url(url, buf.data(), std::make_pair(0l, SIZE - 1));
+    const unsigned seed = MockDownloadPolicy::hash(PATH.substr(1));
+    for (long i = 0; i < SIZE; ++i) {
+        if (buf[i] != MockDownloadPolicy::content(seed, i)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// fills the histogram of time to first byte, without which there is nothing
+// to hedge after
+void warm_up(TestStorage &storage, const std::string &url) {
+    for (int i = 0; i < 25; ++i) {
+        download(storage, url);
+    }
+}
+
+// value of one of the runner's counters in the storage report
+unsigned long counter(const TestStorage &storage, const std::string &name) {
+    std::ostringstream out;
+    storage.report(out, "s");
+    const std::string key { "\ns_" + name + " " };
+    const std::string report { "\n" + out.str() };
+    const size_t found = report.find(key);
+    if (found == std::string::npos) {
+        return static_cast<unsigned long>(-1);
+    }
+    return std::stoul(report.substr(found + key.size()));
+}
+
+unsigned long elapsed_ms(clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(clock::now() - start).count();
+}
+
+void test_timeout_retried() {
+    TestStorage storage { "user", "pwd", options(1, 0, 2) };
+    const std::string url { storage.file_url(PATH) };
+    storage.hold(1, 1000, true);
+    CHECK(download(storage, url));
+    CHECK(counter(storage, "timeouts") == 1);
+    CHECK(counter(storage, "retried") == 1);
+}
+
+void test_timeouts_exhausted() {
+    TestStorage storage { "user", "pwd", options(1, 0, 1) };
+    const std::string url { storage.file_url(PATH) };
+    storage.hold(2, 1000, true);
+    CHECK_THROWS(download(storage, url), TimeoutException);
+    CHECK(counter(storage, "timeouts") == 2);
+    CHECK(counter(storage, "retried") == 1);
+    // the next request doesn't inherit anything from the failed one
+    CHECK(download(storage, url));
+}
+
+void test_hedge_wins() {
+    TestStorage storage { "user", "pwd", options(5, 50, 2) };
+    storage.start();
+    const std::string url { storage.file_url(PATH) };
+    warm_up(storage, url);
+    storage.hold(1, 1500, false);
+    const clock::time_point start { clock::now() };
+    CHECK(download(storage, url));
+    CHECK(elapsed_ms(start) < 1000);
+    CHECK(counter(storage, "hedged") == 1);
+    CHECK(counter(storage, "retried") == 0);
+    CHECK(counter(storage, "timeouts") == 0);
+}
+
+// neither the attempt nor its hedge receive anything, and the transport
+// doesn't give up on them, so the runner's deadline ends the race
+void test_hedged_stall_times_out() {
+    TestStorage storage { "user", "pwd", options(1, 50, 1) };
+    storage.start();
+    const std::string url { storage.file_url(PATH) };
+    warm_up(storage, url);
+    storage.hold(2, 2000, false);
+    const clock::time_point start { clock::now() };
+    CHECK(download(storage, url));
+    CHECK(elapsed_ms(start) < 1800);
+    CHECK(counter(storage, "hedged") == 1);
+    CHECK(counter(storage, "timeouts") == 1);
+    CHECK(counter(storage, "retried") == 1);
+}
+
+// an attempt waiting for a thread isn't timed out for the time it waits
+void test_queued_attempt_deadline() {
+    RequestRunner::Settings settings;
+    settings.timeout = 1;
+    settings.hedge_percentile = 50;
+    RequestRunner runner { settings, [] (const std::exception_ptr&) { return true; }, 1 };
+    runner.start();
+    Histogram first_bytes;
+    for (int i = 0; i < 30; ++i) {
+        first_bytes.add(100000);
+    }
+    // keeps the only thread busy for longer than the timeout, sending data
+    // often enough not to time out itself
+    std::string busy;
+    std::thread other([&runner, &first_bytes, &busy] {
+        runner.run([] (const RequestRunner::sink_t &sink) {
+            for (int i = 0; i < 4; ++i) {
+                sink("a", 1);
+                std::this_thread::sleep_for(std::chrono::milliseconds(400));
+            }
+        }, [&busy] (const char *data, size_t size) { busy.append(data, size); }, first_bytes);
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    std::string queued;
+    runner.run([] (const RequestRunner::sink_t &sink) { sink("b", 1); },
+        [&queued] (const char *data, size_t size) { queued.append(data, size); }, first_bytes);
+    other.join();
+    CHECK(busy == "aaaa");
+    CHECK(queued == "b");
+    std::ostringstream out;
+    runner.report(out, "r");
+    CHECK(out.str().find("r_timeouts 0\n") != std::string::npos);
+    CHECK(out.str().find("r_retried 0\n") != std::string::npos);
+}
+
+}
+
+int main() {
+    soak::test::run("timeout_retried", test_timeout_retried);
+    soak::test::run("timeouts_exhausted", test_timeouts_exhausted);
+    soak::test::run("hedge_wins", test_hedge_wins);
+    soak::test::run("hedged_stall_times_out", test_hedged_stall_times_out);
+    soak::test::run("queued_attempt_deadline", test_queued_attempt_deadline);
+    return soak::test::result();
+}
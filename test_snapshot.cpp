@@ -0,0 +1,226 @@
+/*******************************************************************************
+ * Copyright (c) 2012, Andrzej Zawadzki (azawadzki@gmail.com)
+ *
+ * soakfs is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * soakfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with soakfs; if not, see <http ://www.gnu.org/licenses/>.
+ ******************************************************************************/
+#include "metadata_snapshot.hpp"
+#include "test.hpp"
+
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include <boost/filesystem.hpp>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Checks that listings and roots put into a snapshot are found by the next
+// mount, and that a damaged tail costs only the records it holds.
+
+using soak::Listing;
+using soak::MetadataSnapshot;
+
+namespace {
+
+// file name removed at the end of a test
+class TempFile {
+
+public:
+
+    TempFile()
+    : m_path((boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("soakfs-test-%%%%-%%%%")).string()) {
+
+    }
+
+    ~TempFile() {
+        boost::system::error_code ec;
+        boost::filesystem::remove(m_path, ec);
+    }
+
+    const std::string& path() const noexcept {
+        return m_path;
+    }
+
+private:
+
+    const std::string m_path;
+};
+
+Listing listing(const std::string &prefix, size_t files) {
+    Listing l;
+    l.add_dir(prefix + "dir/");
+    for (size_t i = 0; i < files; ++i) {
+        l.add_file(prefix + std::to_string(i), 1000 + i, 1356998400, 1356998400 + i);
+    }
+    l.build_index();
+    return l;
+}
+
+bool same(const std::shared_ptr<const Listing> &taken, const Listing &expected) {
+    return taken && taken->same_entries(expected);
+}
+
+// roots passed to load, by device
+std::map<std::string, MetadataSnapshot::RootDirs> load(MetadataSnapshot &snapshot) {
+    std::map<std::string, MetadataSnapshot::RootDirs> roots;
+    snapshot.load([&roots] (const std::string &device, const MetadataSnapshot::RootDirs &dirs) {
+        roots[device] = dirs;
+    });
+    return roots;
+}
+
+off_t file_size(const std::string &path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 ? st.st_size : -1;
+}
+
+void test_round_trip() {
+    const TempFile file;
+    const Listing a { listing("a", 10) };
+    const Listing b { listing("b", 3) };
+    const MetadataSnapshot::RootDirs dirs { { "Documents", "abc%2F" }, { "Photos", "def%2F" } };
+    {
+        MetadataSnapshot snapshot { file.path(), "user" };
+        load(snapshot);
+        snapshot.put_roots("dev/", dirs);
+        snapshot.put_listing("dev/Documents", a);
+        snapshot.put_listing("dev/Photos", b);
+        snapshot.put_missing("dev/Gone");
+    }
+    MetadataSnapshot snapshot { file.path(), "user" };
+    std::map<std::string, MetadataSnapshot::RootDirs> roots { load(snapshot) };
+    CHECK(roots.size() == 1);
+    CHECK(roots["dev/"] == dirs);
+    CHECK(same(snapshot.take_listing("dev/Documents"), a));
+    CHECK(same(snapshot.take_listing("dev/Photos"), b));
+    // listings are handed out once
+    CHECK(!snapshot.take_listing("dev/Documents"));
+    CHECK(!snapshot.take_listing("dev/Gone"));
+    CHECK(!snapshot.take_listing("dev/Unknown"));
+}
+
+void test_latest_record_wins() {
+    const TempFile file;
+    const Listing newer { listing("new", 5) };
+    {
+        MetadataSnapshot snapshot { file.path(), "user" };
+        load(snapshot);
+        snapshot.put_listing("dev/x", listing("old", 5));
+        snapshot.put_listing("dev/x", newer);
+        snapshot.put_listing("dev/y", listing("y", 1));
+        snapshot.put_missing("dev/y");
+    }
+    MetadataSnapshot snapshot { file.path(), "user" };
+    load(snapshot);
+    CHECK(same(snapshot.take_listing("dev/x"), newer));
+    CHECK(!snapshot.take_listing("dev/y"));
+}
+
+void test_equal_record_not_appended() {
+    const TempFile file;
+    const Listing l { listing("a", 20) };
+    MetadataSnapshot snapshot { file.path(), "user" };
+    load(snapshot);
+    snapshot.put_listing("dev/x", l);
+    const off_t size = file_size(file.path());
+    snapshot.put_listing("dev/x", l);
+    CHECK(file_size(file.path()) == size);
+}
+
+// cuts the file at every length within the last record and checks that the
+// records before it survive, and that the snapshot takes new ones
+void test_damaged_tail() {
+    const TempFile file;
+    const Listing a { listing("a", 4) };
+    const Listing b { listing("b", 4) };
+    off_t intact;
+    off_t full;
+    {
+        MetadataSnapshot snapshot { file.path(), "user" };
+        load(snapshot);
+        snapshot.put_listing("dev/a", a);
+        intact = file_size(file.path());
+        snapshot.put_listing("dev/b", b);
+        full = file_size(file.path());
+    }
+    std::string contents;
+    {
+        std::ifstream in { file.path().c_str(), std::ios::binary };
+        contents.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+    CHECK(static_cast<off_t>(contents.size()) == full);
+    for (off_t cut = intact; cut < full; cut += 3) {
+        {
+            std::ofstream out { file.path().c_str(), std::ios::binary | std::ios::trunc };
+            out.write(contents.data(), cut);
+        }
+        MetadataSnapshot snapshot { file.path(), "user" };
+        load(snapshot);
+        CHECK(file_size(file.path()) == intact);
+        CHECK(same(snapshot.take_listing("dev/a"), a));
+        CHECK(!snapshot.take_listing("dev/b"));
+    }
+    // a corrupted byte in the last record is caught by its checksum
+    {
+        std::string corrupted { contents };
+        corrupted[full - 1] ^= 0x55;
+        corrupted[intact + 40] ^= 0x55;
+        std::ofstream out { file.path().c_str(), std::ios::binary | std::ios::trunc };
+        out.write(corrupted.data(), corrupted.size());
+    }
+    {
+        MetadataSnapshot snapshot { file.path(), "user" };
+        load(snapshot);
+        CHECK(file_size(file.path()) == intact);
+        CHECK(!snapshot.take_listing("dev/b"));
+        // appends go where the damage was
+        snapshot.put_listing("dev/b", b);
+    }
+    MetadataSnapshot snapshot { file.path(), "user" };
+    load(snapshot);
+    CHECK(same(snapshot.take_listing("dev/a"), a));
+    CHECK(same(snapshot.take_listing("dev/b"), b));
+}
+
+void test_other_account_discarded() {
+    const TempFile file;
+    {
+        MetadataSnapshot snapshot { file.path(), "someone" };
+        load(snapshot);
+        snapshot.put_listing("dev/a", listing("a", 1));
+    }
+    {
+        MetadataSnapshot snapshot { file.path(), "user" };
+        load(snapshot);
+        CHECK(!snapshot.take_listing("dev/a"));
+    }
+    MetadataSnapshot snapshot { file.path(), "someone" };
+    load(snapshot);
+    CHECK(!snapshot.take_listing("dev/a"));
+}
+
+}
+
+int main() {
+    soak::test::run("round_trip", test_round_trip);
+    soak::test::run("latest_record_wins", test_latest_record_wins);
+    soak::test::run("equal_record_not_appended", test_equal_record_not_appended);
+    soak::test::run("damaged_tail", test_damaged_tail);
+    soak::test::run("other_account_discarded", test_other_account_discarded);
+    return soak::test::result();
+}